@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018-2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: arena.h
+ *      Header of arena.c.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#include "list.h"
+
+#define ARENA_CHUNK_SIZE	16384
+#define ARENA_ALIGN		16
+
+struct attest_arena_chunk {
+	struct list_head list;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+};
+
+typedef struct {
+	struct list_head chunks;
+	struct attest_arena_chunk *current;
+	size_t used;
+	size_t size;
+} attest_arena;
+
+void attest_arena_init(attest_arena *arena);
+void *attest_arena_alloc(attest_arena *arena, size_t size);
+void *attest_arena_calloc(attest_arena *arena, size_t nmemb, size_t size);
+char *attest_arena_strdup(attest_arena *arena, const char *str);
+void attest_arena_splice(attest_arena *dest, attest_arena *src);
+size_t attest_arena_used(attest_arena *arena);
+void attest_arena_reset(attest_arena *arena);
+void attest_arena_release(attest_arena *arena);
+
+#endif /*_ARENA_H*/
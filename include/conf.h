@@ -22,6 +22,7 @@
 #define AK_PRIV_PATH ATTEST_TOOLS_CONF_DIR "ak_priv.bin"
 #define AK_PUB_PATH ATTEST_TOOLS_CONF_DIR "ak_pub.bin"
 #define AK_CERT_PATH ATTEST_TOOLS_CONF_DIR "ak_cert.pem"
+#define AK_PERSISTENT_PUB_PATH ATTEST_TOOLS_CONF_DIR "ak_persistent_pub.bin"
 #define TLS_KEY_PRIV_PATH ATTEST_TOOLS_CONF_DIR "tls_key_priv.bin"
 #define TLS_KEY_PUB_PATH ATTEST_TOOLS_CONF_DIR "tls_key_pub.bin"
 #define TLS_KEY_CERT_PATH ATTEST_TOOLS_CONF_DIR "tls_key_cert.pem"
@@ -31,5 +32,12 @@
 #define SYM_KEY_PUB_PATH ATTEST_TOOLS_CONF_DIR "sym_key_pub.bin"
 #define SYM_KEY_POLICY_PATH ATTEST_TOOLS_CONF_DIR "sym_key_policy.txt"
 #define SYM_KEY_BLOB ATTEST_TOOLS_CONF_DIR "trusted_key.blob"
+#define IMA_DELTA_STATE_PATH ATTEST_TOOLS_CONF_DIR "ima_delta_state.bin"
+#define IMA_DELTA_STATE_NEW_PATH IMA_DELTA_STATE_PATH ".new"
+#define KEY_POOL_DIR ATTEST_TOOLS_CONF_DIR "key_pool/"
+#define TOKEN_PUBKEY_PATH ATTEST_TOOLS_CONF_DIR "token_pubkey.pem"
+#define RA_PROTOCOL_VERSION 2
+#define RA_OP_NEGOTIATE 5
+#define RA_FEATURE_ZSTD "zstd"
 
 #endif /*_CONF_H*/
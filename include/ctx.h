@@ -16,6 +16,7 @@
 #define _CTX_H
 
 #include "list.h"
+#include "arena.h"
 #include "stdint.h"
 
 #define MAX_PATH_LENGTH 2048
@@ -26,35 +27,56 @@ enum ctx_fields { CTX_PRIVACY_CA_CERT, CTX_AK_CERT, CTX_TPM_AK_KEY,
 		  CTX_CRED, CTX_CRED_HMAC, CTX_CREDBLOB, CTX_SECRET, CTX_CSR,
 		  CTX_KEY_CERT, CTX_CA_CERT, CTX_HOSTNAME, CTX_TPM_SYM_KEY,
 		  CTX_NONCE, CTX_NONCE_HMAC, CTX_TPMS_ATTEST,
-		  CTX_TPMS_ATTEST_SIG, CTX__LAST };
+		  CTX_TPMS_ATTEST_SIG, CTX_ATTEST_TOKEN, CTX_NONCE_PROOF,
+		  CTX__LAST };
 
 enum data_formats { DATA_FMT_BASE64, DATA_FMT_URI, DATA_FMT__LAST };
 
+#define DATA_ITEM_ZSTD			0x01
+
 struct data_item {
 	struct list_head list;
 	char *mapped_file;
 	size_t len;
 	unsigned char *data;
 	char *label;
+	unsigned int flags;
 };
 
 #define CTX_INIT			0x01
 #define CTX_ALLOW_IMA_VIOLATIONS	0x02
 #define CTX_SKIP_SIG_VER		0x04
+#define CTX_PCR_SHADOW			0x08
+#define CTX_IMA_DELTA			0x10
 
 typedef struct {
 	struct list_head ctx_data[CTX__LAST];
 	char *data_dir;
+	attest_arena arena;
 	uint16_t flags;
 } attest_ctx_data;
 
+struct verification_log {
+	struct list_head list;
+	attest_arena *arena;
+	const char *operation;
+	const char *result;
+	char *reason;
+};
+
 typedef struct {
 	struct list_head event_logs;
 	struct list_head verifiers;
+	struct list_head registry;
 	struct list_head logs;
+	struct verification_log unknown_log;
 	void *pcr;
+	void *pcr_base;
+	uint32_t pcr_base_mask;
+	uint8_t pcr_bank_mask;
 	uint8_t pcr_mask[3];
 	unsigned char key[64];
+	attest_arena arena;
 	uint16_t flags;
 } attest_ctx_verifier;
 
@@ -76,15 +98,6 @@ struct verifier_struct {
 	char *req;
 };
 
-struct verification_log {
-	struct list_head list;
-	const char *operation;
-	const char *result;
-	char *reason;
-};
-
-extern struct verification_log unknown_log;
-
 #define check_goto(condition, new_rc, label, ctx, ...) \
 { \
 	if (condition) { \
@@ -112,6 +125,8 @@ int attest_ctx_data_add_copy(attest_ctx_data *ctx, enum ctx_fields field,
 			     const char *label);
 int attest_ctx_data_add_file(attest_ctx_data *ctx, enum ctx_fields field,
 			     char *path, const char *label);
+int attest_ctx_data_add_seq_file(attest_ctx_data *ctx, enum ctx_fields field,
+				 char *path, const char *label);
 int attest_ctx_data_add_dir(attest_ctx_data *ctx, enum ctx_fields field,
 			    char *dir_path, const char *label);
 int attest_ctx_data_add_string(attest_ctx_data *ctx, enum ctx_fields field,
@@ -122,8 +137,8 @@ struct data_item *attest_ctx_data_lookup_by_label(attest_ctx_data *ctx,
 						  const char *label);
 struct data_item *attest_ctx_data_lookup_by_digest(attest_ctx_data *ctx,
 				const char *algo, const uint8_t *digest);
-attest_ctx_data *attest_ctx_data_get_global(void);
 int attest_ctx_data_init(attest_ctx_data **ctx);
+void attest_ctx_data_reset(attest_ctx_data *ctx);
 void attest_ctx_data_cleanup(attest_ctx_data *ctx);
 
 struct verifier_struct *attest_ctx_verifier_lookup(attest_ctx_verifier *ctx,
@@ -137,13 +152,13 @@ void attest_ctx_verifier_set_log(struct verification_log *log,
 				 const char *fmt, ...);
 void attest_ctx_verifier_end_log(attest_ctx_verifier *ctx,
 				 struct verification_log *log, int result);
-attest_ctx_verifier *attest_ctx_verifier_get_global(void);
 int attest_ctx_verifier_init(attest_ctx_verifier **ctx);
 int attest_ctx_verifier_set_key(attest_ctx_verifier *ctx, int key_len,
 				unsigned char *key);
 int attest_ctx_verifier_set_pcr_mask(attest_ctx_verifier *ctx,
 				     int pcr_mask_len, uint8_t *pcr_mask);
 void attest_ctx_verifier_set_flags(attest_ctx_verifier *ctx, uint16_t flags);
+void attest_ctx_verifier_reset(attest_ctx_verifier *ctx);
 void attest_ctx_verifier_cleanup(attest_ctx_verifier *ctx);
 
 #endif /*_CTX_H*/
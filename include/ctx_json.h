@@ -29,6 +29,8 @@ int attest_ctx_data_add_json_data(attest_ctx_data *ctx, const char *data,
 int attest_ctx_data_add_json_file(attest_ctx_data *ctx, const char *path);
 int attest_ctx_data_print_json(attest_ctx_data *ctx, char **json_str);
 int attest_ctx_data_print_json_no_value(attest_ctx_data *ctx, char **json_str);
+int attest_ctx_data_json_len(attest_ctx_data *ctx, size_t *json_len);
+int attest_ctx_data_write_json(attest_ctx_data *ctx, int fd);
 int attest_ctx_data_json_get_by_field(char *json_data, enum ctx_fields field,
 				      int *data_out_len,
 				      unsigned char **data_out);
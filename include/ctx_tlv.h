@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: ctx_tlv.h
+ *      Header of ctx_tlv.c.
+ */
+
+#ifndef _CTX_TLV_H
+#define _CTX_TLV_H
+
+#include "ctx.h"
+
+#define CTX_TLV_MAGIC "ATLV"
+#define CTX_TLV_MAGIC_LEN 4
+#define CTX_TLV_FIELD_ZSTD 0x8000
+#define CTX_TLV_ZSTD_MIN_LEN 256
+#define CTX_TLV_ZSTD_MAX_LEN (1UL << 25)
+#define CTX_TLV_ZSTD_MAX_MSG_LEN (1UL << 26)
+
+/**
+ * TLV message header, followed by the items
+ */
+struct ctx_tlv_hdr {
+	/** CTX_TLV_MAGIC */
+	uint8_t magic[CTX_TLV_MAGIC_LEN];
+	/** message length including this header (big endian) */
+	uint32_t len;
+} __attribute__((packed));
+
+/**
+ * TLV item header, followed by the label and the data
+ */
+struct ctx_tlv_item_hdr {
+	/** ctx_fields value | CTX_TLV_FIELD_ZSTD if compressed (big endian) */
+	uint16_t field;
+	/** label length without terminator (big endian) */
+	uint16_t label_len;
+	/** data length (big endian) */
+	uint32_t data_len;
+} __attribute__((packed));
+
+enum ctx_msg_formats { CTX_MSG_JSON, CTX_MSG_TLV, CTX_MSG_TLV_ZSTD,
+		       CTX_MSG__LAST };
+
+int attest_ctx_data_add_tlv_data(attest_ctx_data *ctx,
+				 const unsigned char *data, size_t len);
+int attest_ctx_data_tlv_len(attest_ctx_data *ctx, size_t *tlv_len);
+int attest_ctx_data_print_tlv(attest_ctx_data *ctx, char **tlv_str);
+int attest_ctx_data_write_tlv(attest_ctx_data *ctx, int fd);
+int attest_ctx_data_tlv_compress(attest_ctx_data *ctx);
+int attest_ctx_tlv_zstd_supported(void);
+
+enum ctx_msg_formats attest_ctx_msg_format(const char *msg);
+size_t attest_ctx_msg_len(const char *msg);
+int attest_ctx_msg_check(const char *msg, size_t len);
+int attest_ctx_data_add_msg(attest_ctx_data *ctx, const char *msg);
+int attest_ctx_data_print_msg(attest_ctx_data *ctx, enum ctx_msg_formats fmt,
+			      char **msg);
+
+#endif /*_CTX_TLV_H*/
@@ -21,8 +21,19 @@
 #include <openssl/evp.h>
 
 #include "ctx.h"
+#include "ctx_tlv.h"
 #include "tss.h"
 
+/**
+ * Nonces of several verifiers covered by a single quote
+ */
+struct attest_enroll_quote_batch {
+	/** number of verifiers */
+	int num;
+	/** nonce, nonce HMAC and inclusion proof of each verifier */
+	attest_ctx_data **nonces;
+};
+
 int attest_enroll_add_ek_cert(attest_ctx_data *d_ctx, TSS_CONTEXT *tssContext);
 int attest_enroll_add_key(attest_ctx_data *d_ctx, TSS_CONTEXT *tssContext,
 			  char *keyPrivPath, char *keyPubPath,
@@ -41,6 +52,9 @@ int attest_enroll_add_quote(attest_ctx_data *d_ctx, TSS_CONTEXT *tssContext,
 			    uint8_t *nonce, TPML_PCR_SELECTION *pcr_selection);
 int attest_enroll_create_sym_key(int kernel_bios_log, int kernel_ima_log,
 				 char *pcr_alg_name, char *pcr_list_str);
+int attest_enroll_key_pool_fill(int kernel_bios_log, int kernel_ima_log,
+				char *pcr_alg_name, char *pcr_list_str,
+				int pool_size);
 int attest_enroll_generate_ak(void);
 int attest_enroll_msg_ak_challenge_request(char *certListPath, char **message_out);
 int attest_enroll_msg_ak_cert_request(char *message_in, char* hostname,
@@ -52,9 +66,28 @@ int attest_enroll_msg_key_cert_request(int kernel_bios_log, int kernel_ima_log,
 				       char *url, char **attest_data, char **message_out);
 int attest_enroll_msg_key_cert_response(char *message_in);
 int attest_enroll_msg_quote_nonce_request(char **message_out);
+int attest_enroll_msg_quote_evidence(char *privacy_ca_dir, int kernel_bios_log,
+				     int kernel_ima_log,
+				     int send_unsigned_files, int ima_delta,
+				     attest_ctx_data **evidence);
+int attest_enroll_msg_quote_finish(attest_ctx_data *evidence,
+				   char *pcr_alg_name, char *pcr_list_str,
+				   char *message_in);
+int attest_enroll_msg_quote_batch_finish(attest_ctx_data *evidence,
+				char *pcr_alg_name, char *pcr_list_str,
+				int num_messages, char *messages_in[],
+				struct attest_enroll_quote_batch **batch);
+int attest_enroll_quote_batch_select(struct attest_enroll_quote_batch *batch,
+				     attest_ctx_data *evidence, int index);
+void attest_enroll_quote_batch_free(struct attest_enroll_quote_batch *batch);
 int attest_enroll_msg_quote_request(char *certListPath, int kernel_bios_log,
 				    int kernel_ima_log, char *pcr_alg_name,
 				    char *pcr_list_str, int skip_sig_ver,
-				    int send_unsigned_files, char *message_in,
-				    char **message_out);
+				    int send_unsigned_files, int ima_delta,
+				    char *message_in, char **message_out);
+int attest_enroll_msg_quote_response(char *message_in, char *token_path);
+int attest_enroll_ima_delta_commit(void);
+int attest_enroll_ima_delta_reset(void);
+void attest_enroll_session_close(void);
+void attest_enroll_msg_set_format(enum ctx_msg_formats fmt);
 #endif /*ENROLL_CLIENT_H*/
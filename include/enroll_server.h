@@ -25,6 +25,24 @@
 #include <ibmtss/tssresponsecode.h>
 
 #include "ctx.h"
+#include "ctx_tlv.h"
+#include "token.h"
+
+#define NONCE_LEN 32
+
+/**
+ * State kept by the server for a client connection carrying several requests
+ */
+struct attest_enroll_session {
+	/** AK certificate sent with the quote nonce request */
+	size_t ak_cert_len;
+	/** AK certificate data */
+	uint8_t *ak_cert;
+	/** last nonce generated for the client */
+	uint8_t nonce[NONCE_LEN];
+	/** nonce generated and not yet used */
+	int nonce_valid;
+};
 
 int attest_enroll_hmac(attest_ctx_verifier *v_ctx, int akpub_len, BYTE *akpub,
 		       int credential_len, BYTE *credential,
@@ -57,11 +75,16 @@ int attest_enroll_sign_csr(char *caKeyPath, char *caKeyPassword,
 			   char *caCertPath, char *openssl_ca_section,
 			   char *csr_str, char **cert_str);
 int attest_enroll_msg_return_cert(char *cert_str, char *ca_cert_str,
-				  char **message_out);
+				  enum ctx_msg_formats fmt, char **message_out);
 int attest_enroll_msg_gen_quote_nonce(int hmac_key_len, uint8_t *hmac_key,
+				      struct attest_enroll_session *session,
 				      char *message_in, char **message_out);
 int attest_enroll_msg_process_quote(int hmac_key_len, uint8_t *hmac_key,
 				    int pcr_mask_len, uint8_t *pcr_mask,
 				    char *reqPath, uint16_t verifier_flags,
+				    struct attest_enroll_session *session,
+				    EVP_PKEY *token_key,
+				    uint32_t token_lifetime,
 				    char *message_in, char **message_out);
+void attest_enroll_session_cleanup(struct attest_enroll_session *session);
 #endif /*_ENROLL_SERVER_H*/
@@ -30,6 +30,9 @@
 
 #define CRYPTO_MAX_ALG_NAME 128
 
+#define IMA_PCR 10
+#define IMA_DELTA_LABEL "ima_delta"
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 
 struct ima_field_data {
@@ -56,6 +59,19 @@ struct ima_template_entry {
 	unsigned char data[0];
 };
 
+/* the SHA1 bank is extended by verifiers regardless of the quoted banks */
+#define IMA_DELTA_STATE_BANKS (1 << PCR_BANK_SHA1)
+
+/* error of verifiers not knowing the PCR value a partial log starts from */
+#define IMA_DELTA_UNKNOWN_POS ESTALE
+
+/* position of a partial IMA event log in the whole log */
+struct ima_delta {
+	uint32_t start_entry;
+	uint32_t num_entries;
+	uint8_t base_state[SHA256_DIGEST_LENGTH];
+} __attribute__((packed));
+
 struct ima_log_entry {
 	struct ima_template_entry *entry;
 	struct ima_template_desc *desc;
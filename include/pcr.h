@@ -23,11 +23,34 @@
 #include "ctx.h"
 
 enum pcr_banks { PCR_BANK_SHA1, PCR_BANK_SHA256, PCR_BANK_SHA384,
-		 PCR_BANK_SHA512, PCR_BANK__LAST };
+		 PCR_BANK_SHA512, PCR_BANK_SM3_256, PCR_BANK__LAST };
+
+/// @private
+struct pcr_shadow_extend {
+	uint8_t pcr_num;
+	uint8_t bank;
+	unsigned char digest[sizeof(TPMU_HA)];
+};
+
+/// @private
+struct pcr_shadow {
+	attest_ctx_verifier v_ctx;
+	uint32_t touched[PCR_BANK__LAST];
+	struct pcr_shadow_extend *extends;
+	int num_extends;
+	int max_extends;
+};
 
 TPM_ALG_ID attest_pcr_bank_alg(enum pcr_banks bank_id);
 TPM_ALG_ID attest_pcr_bank_alg_from_name(char *alg_name, int alg_name_len);
+enum pcr_banks attest_pcr_bank_from_name(const char *alg_name,
+					 int alg_name_len);
+int attest_pcr_digest_size(TPMI_ALG_HASH alg);
+int attest_pcr_hash(TPMT_HA *digest, size_t data1_len, const void *data1,
+		    size_t data2_len, const void *data2);
 int attest_pcr_init(attest_ctx_verifier *v_ctx);
+int attest_pcr_set_base(attest_ctx_verifier *v_ctx, unsigned int pcr_num,
+			TPMI_ALG_HASH alg, unsigned char *digest);
 void attest_pcr_cleanup(attest_ctx_verifier *v_ctx);
 TPMT_HA *attest_pcr_get(attest_ctx_verifier *v_ctx, int pcr_num,
 			TPMI_ALG_HASH alg);
@@ -35,7 +58,19 @@ int attest_pcr_extend(attest_ctx_verifier *v_ctx, unsigned int pcr_num,
 		      TPMI_ALG_HASH alg, unsigned char *digest);
 int attest_pcr_calc_digest(attest_ctx_verifier *v_ctx, TPMT_HA *digest,
 			   TPML_PCR_SELECTION *pcrs);
+int attest_pcr_calc_state(attest_ctx_verifier *v_ctx, uint32_t bank_mask,
+			  uint32_t pcr_mask, unsigned char *digest);
+uint32_t attest_pcr_selection_banks(TPML_PCR_SELECTION *pcrs);
+void attest_pcr_select_banks(attest_ctx_verifier *v_ctx,
+			     TPML_PCR_SELECTION *pcrs);
+int attest_pcr_bank_selected(attest_ctx_verifier *v_ctx,
+			     enum pcr_banks bank);
 int attest_pcr_verify(attest_ctx_verifier *v_ctx, TPML_PCR_SELECTION *pcrs,
 		      TPM_ALG_ID hashAlg, unsigned char *digest);
+int attest_pcr_shadow_init(attest_ctx_verifier *v_ctx,
+			   struct pcr_shadow *shadow);
+void attest_pcr_shadow_cleanup(struct pcr_shadow *shadow);
+int attest_pcr_shadow_merge(attest_ctx_verifier *v_ctx,
+			    struct pcr_shadow **shadows, int num_shadows);
 
 #endif /*_PCR_H*/
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: skae_ssl.h
+ *      SKAE functions for TLS applications.
+ */
+
+#ifndef _SKAE_SSL_H
+#define _SKAE_SSL_H
+
+#include <openssl/ssl.h>
+
+#include "ctx.h"
+
+/*
+ * Unlike skae.h, this header does not include the ASN.1 definitions, and can
+ * be included by more than one source file of the same program.
+ */
+
+struct skae_cache;
+
+int skae_ssl_set_ctx(SSL *ssl, attest_ctx_data *d_ctx,
+		     attest_ctx_verifier *v_ctx);
+int skae_ssl_get_ctx(SSL *ssl, attest_ctx_data **d_ctx,
+		     attest_ctx_verifier **v_ctx);
+int skae_cache_init(struct skae_cache **cache, int max_entries, int ttl);
+void skae_cache_set_policy(struct skae_cache *cache, const uint8_t *policy);
+int skae_cache_lookup(struct skae_cache *cache, const uint8_t *policy,
+		      const uint8_t *digest, int *verdict);
+int skae_cache_add(struct skae_cache *cache, const uint8_t *policy,
+		   const uint8_t *digest, int verdict);
+void skae_cache_cleanup(struct skae_cache *cache);
+int skae_ssl_set_cache(SSL *ssl, struct skae_cache *cache,
+		       const uint8_t *policy);
+int skae_callback(int preverify, X509_STORE_CTX* x509_ctx);
+int skae_verify_ssl(SSL *ssl);
+
+#endif /*_SKAE_SSL_H*/
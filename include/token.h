@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: token.h
+ *      Header of token.c.
+ */
+
+#ifndef _TOKEN_H
+#define _TOKEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#define ATTEST_TOKEN_MAGIC "ATOK"
+#define ATTEST_TOKEN_MAGIC_LEN 4
+#define ATTEST_TOKEN_VERSION 2
+#define ATTEST_TOKEN_MAX_DIGEST_LEN 64
+#define ATTEST_TOKEN_MAX_BANKS 8
+#define ATTEST_TOKEN_MAX_SIG_LEN 1024
+#define ATTEST_TOKEN_LIFETIME 300
+
+/**
+ * PCRs of a bank included in the PCR digest
+ */
+struct attest_token_pcr_bank {
+	/** TPM algorithm ID of the bank */
+	uint16_t alg;
+	/** selected PCRs (bit set at the PCR position) */
+	uint32_t pcr_mask;
+};
+
+/**
+ * Claims of an attestation token, in host byte order
+ */
+struct attest_token {
+	/** issue time (seconds since the Epoch) */
+	uint64_t issued;
+	/** expiration time (seconds since the Epoch) */
+	uint64_t expires;
+	/** SHA-256 digest of the AK certificate */
+	uint8_t ak_digest[SHA256_DIGEST_LENGTH];
+	/** SHA-256 digest of the verifier requirements */
+	uint8_t req_digest[SHA256_DIGEST_LENGTH];
+	/** length of the PCR digest */
+	uint16_t pcr_digest_len;
+	/** PCR digest from the verified quote */
+	uint8_t pcr_digest[ATTEST_TOKEN_MAX_DIGEST_LEN];
+	/** number of banks in the PCR selection of the quote */
+	uint16_t num_banks;
+	/** PCR selection of the quote, in the order of the PCR digest */
+	struct attest_token_pcr_bank banks[ATTEST_TOKEN_MAX_BANKS];
+};
+
+int attest_token_sign(EVP_PKEY *key, struct attest_token *token,
+		      size_t *len, uint8_t **data);
+int attest_token_verify(EVP_PKEY *key, size_t len, const uint8_t *data,
+			struct attest_token *token);
+int attest_token_key_get(const char *path, EVP_PKEY **key);
+void attest_token_key_cache_flush(void);
+
+#endif /*_TOKEN_H*/
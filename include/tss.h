@@ -22,6 +22,8 @@
 #include <ibmtss/tsscryptoh.h>
 #include <ibmtss/tssresponsecode.h>
 
+#define TPM_AK_PERSISTENT_HANDLE 0x81000002
+
 enum key_types { KEY_TYPE_AK, KEY_TYPE_ASYM_DEC, KEY_TYPE_SYM_HMAC,
 		 KEY_TYPE_PRIMARY, KEY_TYPE__LAST };
 
@@ -63,6 +65,8 @@ int attest_tss_load_certify(TSS_CONTEXT *tssContext, char *akPrivPath,
 			UINT16 *signature_len, BYTE **signature);
 int attest_tss_pcrread(TSS_CONTEXT *tssContext, TPMI_DH_PCR pcr,
 		       TPMI_ALG_HASH halg, BYTE *pcr_value);
+int attest_tss_pcrread_multi(TSS_CONTEXT *tssContext, TPMI_ALG_HASH halg,
+			     uint32_t pcr_mask, TPMT_HA *pcr_values);
 int attest_tss_loadexternal(TSS_CONTEXT *tssContext, EVP_PKEY *ek_pub,
 			    TPM_HANDLE *handle);
 int attest_tss_makecredential(TSS_CONTEXT *tssContext, TPM_HANDLE ek_handle,
@@ -75,6 +79,8 @@ int attest_tss_quote(TSS_CONTEXT *tssContext, TPM_HANDLE ak_handle,
 		     UINT16 *quote_len, BYTE **quote, UINT16 *signature_len,
 		     BYTE **signature);
 int attest_tss_check_key(TSS_CONTEXT *tssContext, TPM_HANDLE keyHandle);
+int attest_tss_readpublic(TSS_CONTEXT *tssContext, TPM_HANDLE keyHandle,
+			  UINT16 *public_len, BYTE **public);
 int attest_tss_evictcontrol(TSS_CONTEXT *tssContext, TPM_HANDLE objectHandle,
 			    TPM_HANDLE persistentHandle);
 
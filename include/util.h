@@ -15,9 +15,20 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#define MERKLE_HASH_LEN 32
+#define MERKLE_PROOF_LEFT 0
+#define MERKLE_PROOF_RIGHT 1
+#define MERKLE_PROOF_ENTRY_LEN (1 + MERKLE_HASH_LEN)
+
 int attest_util_read_file(const char *path, size_t *len, unsigned char **data);
+int attest_util_map_file(const char *path, size_t *len, unsigned char **data);
 int attest_util_read_seq_file(const char *path, size_t *len,
 			      unsigned char **data);
+int attest_util_read_seq_file_from(const char *path, off_t offset,
+				   size_t *len, unsigned char **data);
 int attest_util_write_file(const char *path, size_t len, unsigned char *data,
 			   int append);
 int attest_util_copy_file(const char *path_source, const char *path_dest);
@@ -34,6 +45,12 @@ int attest_util_check_mask(int mask_in_len, uint8_t *mask_in,
 			   int mask_ref_len, uint8_t *mask_ref);
 int attest_util_parse_pcr_list(const char *pcr_list_str, int pcr_list_num,
 			       int *pcr_list);
+int attest_util_merkle_proof(int num_leaves, const uint8_t *leaves[],
+			     const size_t leaf_lens[], int index,
+			     uint8_t *root, size_t *proof_len, uint8_t **proof);
+int attest_util_merkle_root(const uint8_t *leaf, size_t leaf_len,
+			    const uint8_t *proof, size_t proof_len,
+			    uint8_t *root);
 
 int _hex2bin(unsigned char *dst, const char *src, size_t count);
 char *_bin2hex(char *dst, const void *src, size_t count);
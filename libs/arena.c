@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2018-2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: arena.c
+ *      Arena allocator.
+ */
+
+/**
+ * @defgroup arena-api Arena API
+ * @ingroup developer-api
+ * @brief
+ * Functions to allocate memory that is released at once when a request has
+ * been processed. Memory is taken from chunks owned by the arena, which are
+ * kept after a reset and reused for the next request.
+ */
+
+/**
+ * @addtogroup arena-api
+ *  @{
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/**
+ * Initialize an arena
+ * @param[in] arena	arena
+ */
+void attest_arena_init(attest_arena *arena)
+{
+	INIT_LIST_HEAD(&arena->chunks);
+	arena->current = NULL;
+	arena->used = 0;
+	arena->size = 0;
+}
+
+static struct attest_arena_chunk *attest_arena_new_chunk(size_t size)
+{
+	struct attest_arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk)
+		return NULL;
+
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+/**
+ * Allocate memory from an arena
+ * @param[in] arena	arena
+ * @param[in] size	size of the memory to allocate
+ *
+ * @returns pointer to allocated memory on success, NULL on error
+ */
+void *attest_arena_alloc(attest_arena *arena, size_t size)
+{
+	struct attest_arena_chunk *chunk = arena->current;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	/* requests bigger than a chunk get a dedicated chunk */
+	if (size > ARENA_CHUNK_SIZE) {
+		chunk = attest_arena_new_chunk(size);
+		if (!chunk)
+			return NULL;
+
+		chunk->used = size;
+
+		if (arena->current)
+			list_add_tail(&chunk->list, &arena->current->list);
+		else
+			list_add(&chunk->list, &arena->chunks);
+
+		arena->used += size;
+		arena->size += size;
+		return chunk->data;
+	}
+
+	while (chunk && chunk->used + size > chunk->size) {
+		if (chunk->list.next == &arena->chunks) {
+			chunk = NULL;
+			break;
+		}
+
+		chunk = list_next_entry(chunk, list);
+	}
+
+	if (!chunk) {
+		chunk = attest_arena_new_chunk(ARENA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+
+		list_add_tail(&chunk->list, &arena->chunks);
+		arena->size += ARENA_CHUNK_SIZE;
+	}
+
+	arena->current = chunk;
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	arena->used += size;
+	return ptr;
+}
+
+/**
+ * Allocate zeroed memory from an arena
+ * @param[in] arena	arena
+ * @param[in] nmemb	number of elements
+ * @param[in] size	size of each element
+ *
+ * @returns pointer to allocated memory on success, NULL on error
+ */
+void *attest_arena_calloc(attest_arena *arena, size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > (size_t)-1 / size)
+		return NULL;
+
+	ptr = attest_arena_alloc(arena, nmemb * size);
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+/**
+ * Duplicate a string in an arena
+ * @param[in] arena	arena
+ * @param[in] str	string to duplicate
+ *
+ * @returns pointer to the new string on success, NULL on error
+ */
+char *attest_arena_strdup(attest_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ptr;
+
+	ptr = attest_arena_alloc(arena, len);
+	if (ptr)
+		memcpy(ptr, str, len);
+
+	return ptr;
+}
+
+/**
+ * Move memory allocated from an arena to another arena
+ * @param[in] dest	destination arena
+ * @param[in] src	source arena
+ */
+void attest_arena_splice(attest_arena *dest, attest_arena *src)
+{
+	struct attest_arena_chunk *chunk, *temp_chunk;
+
+	list_for_each_entry_safe(chunk, temp_chunk, &src->chunks, list) {
+		list_del(&chunk->list);
+
+		/* keep the current chunk of dest, new chunks are almost full */
+		if (dest->current)
+			list_add_tail(&chunk->list, &dest->current->list);
+		else
+			list_add_tail(&chunk->list, &dest->chunks);
+	}
+
+	dest->used += src->used;
+	dest->size += src->size;
+
+	attest_arena_init(src);
+}
+
+/**
+ * Return the amount of memory allocated from an arena
+ * @param[in] arena	arena
+ *
+ * @returns number of bytes allocated since the last reset
+ */
+size_t attest_arena_used(attest_arena *arena)
+{
+	return arena->used;
+}
+
+/**
+ * Release all allocations at once, keeping chunks of the default size
+ * @param[in] arena	arena
+ */
+void attest_arena_reset(attest_arena *arena)
+{
+	struct attest_arena_chunk *chunk, *temp_chunk;
+
+	list_for_each_entry_safe(chunk, temp_chunk, &arena->chunks, list) {
+		if (chunk->size > ARENA_CHUNK_SIZE) {
+			list_del(&chunk->list);
+			arena->size -= chunk->size;
+			free(chunk);
+			continue;
+		}
+
+		chunk->used = 0;
+	}
+
+	arena->current = NULL;
+	if (!list_empty(&arena->chunks))
+		arena->current = list_first_entry(&arena->chunks,
+					struct attest_arena_chunk, list);
+
+	arena->used = 0;
+}
+
+/**
+ * Free all chunks of an arena
+ * @param[in] arena	arena
+ */
+void attest_arena_release(attest_arena *arena)
+{
+	struct attest_arena_chunk *chunk, *temp_chunk;
+
+	list_for_each_entry_safe(chunk, temp_chunk, &arena->chunks, list) {
+		list_del(&chunk->list);
+		free(chunk);
+	}
+
+	attest_arena_init(arena);
+}
+/** @}*/
@@ -30,6 +30,14 @@
  * @brief
  * Functions to store data used by other APIs and to store the status of a
  * verification.
+ *
+ * The library does not keep any context on behalf of the caller: contexts
+ * are obtained with attest_ctx_data_init() and attest_ctx_verifier_init()
+ * and passed explicitly to every function. Contexts are not locked
+ * internally. Different contexts can be used concurrently by different
+ * threads, while the same context must be accessed by one thread at a time.
+ * Verification failures are recorded in the logs of the verifier context
+ * being used.
  */
 
 /**
@@ -59,12 +67,9 @@
 #define MAX_DIGEST_SIZE 128
 #define MAX_LOG_LENGTH 1024
 
-attest_ctx_data global_ctx_data = {0};
-attest_ctx_verifier global_ctx_verifier = {0};
-
-struct verification_log unknown_log = {{&unknown_log.list, &unknown_log.list},
-					"unknown log", "fail",
-					"unknown_reason"};
+#define UNKNOWN_LOG_OPERATION "unknown log"
+#define UNKNOWN_LOG_RESULT "fail"
+#define UNKNOWN_LOG_REASON "unknown_reason"
 
 static const char *ctx_fields_str[CTX__LAST] = {
 	[CTX_PRIVACY_CA_CERT] = "privacy_ca_cert",
@@ -90,6 +95,15 @@ static const char *ctx_fields_str[CTX__LAST] = {
 	[CTX_NONCE_HMAC] = "nonce_hmac",
 	[CTX_TPMS_ATTEST] = "tpms_attest",
 	[CTX_TPMS_ATTEST_SIG] = "tpms_attest_sig",
+	[CTX_ATTEST_TOKEN] = "attest_token",
+	[CTX_NONCE_PROOF] = "nonce_proof",
+};
+
+/* fields whose content must not remain in memory after release */
+static const uint8_t ctx_fields_sensitive[CTX__LAST] = {
+	[CTX_CRED] = 1,
+	[CTX_SECRET] = 1,
+	[CTX_TPM_SYM_KEY] = 1,
 };
 
 static const char *data_formats_str[DATA_FMT__LAST] = {
@@ -170,8 +184,8 @@ static int attest_ctx_data_add_common(attest_ctx_data *ctx,
 {
 	struct data_item *new_item = NULL;
 	char path_dest[MAX_PATH_LENGTH], *path_ptr = path;
-	char *filename;
-	int rc = -EINVAL;
+	char *filename, *mapped_file = NULL;
+	int rc = -EINVAL, in_data_dir, copied = 0, mapped = 0;
 
 	if (!ctx)
 		return -EINVAL;
@@ -183,31 +197,50 @@ static int attest_ctx_data_add_common(attest_ctx_data *ctx,
 		else
 			filename = path;
 
-		if (strncmp(path, ctx->data_dir, strlen(ctx->data_dir))) {
+		in_data_dir = !strncmp(path, ctx->data_dir,
+				       strlen(ctx->data_dir));
+
+		/*
+		 * Files are mapped read-only in place. Sensitive data is
+		 * copied instead, so that it does not change while in use and
+		 * can be wiped on cleanup.
+		 */
+		if (!in_data_dir && ctx_fields_sensitive[field]) {
 			snprintf(path_dest, sizeof(path_dest), "%s/%s",
 				 ctx->data_dir, filename);
+
+			/* a partial copy is removed too */
+			copied = 1;
 			rc = attest_util_copy_file(path, path_dest);
 			if (rc)
 				goto out;
 
 			path_ptr = path_dest;
+			in_data_dir = 1;
 		}
 
-		rc = attest_util_read_file(path_ptr, &len, &data);
+		if (in_data_dir)
+			rc = attest_util_read_file(path_ptr, &len, &data);
+		else
+			rc = attest_util_map_file(path_ptr, &len, &data);
 		if (rc)
 			goto out;
 
-		path_ptr = strdup(path_ptr);
-		if (!path_ptr) {
+		mapped = 1;
+
+		mapped_file = strdup(path_ptr);
+		if (!mapped_file) {
 			rc = -ENOMEM;
 			goto out;
 		}
 	}
 
-	if (!data)
+	if (!data) {
+		rc = -EINVAL;
 		goto out;
+	}
 
-	new_item = calloc(1, sizeof(*new_item));
+	new_item = attest_arena_calloc(&ctx->arena, 1, sizeof(*new_item));
 	if (!new_item) {
 		rc = -ENOMEM;
 		goto out;
@@ -215,10 +248,10 @@ static int attest_ctx_data_add_common(attest_ctx_data *ctx,
 
 	new_item->data = data;
 	new_item->len = len;
-	new_item->mapped_file = path_ptr;
+	new_item->mapped_file = mapped_file;
 
 	if (label) {
-		new_item->label = strdup(label);
+		new_item->label = attest_arena_strdup(&ctx->arena, label);
 		if (!new_item->label) {
 			rc = -ENOMEM;
 			goto out;
@@ -229,13 +262,12 @@ static int attest_ctx_data_add_common(attest_ctx_data *ctx,
 	rc = 0;
 out:
 	if (rc) {
-		if (path)
+		if (mapped)
 			munmap(data, len);
+		if (copied)
+			unlink(path_dest);
 
-		if (new_item) {
-			free(new_item->label);
-			free(new_item);
-		}
+		free(mapped_file);
 	}
 
 	return rc;
@@ -297,6 +329,35 @@ int attest_ctx_data_add_file(attest_ctx_data *ctx, enum ctx_fields field,
 	return attest_ctx_data_add_common(ctx, field, path, 0, NULL, label);
 }
 
+/**
+ * Read a sequential file (e.g. from securityfs) and add it to data context
+ * @param[in] ctx	data context
+ * @param[in] field	field identifier
+ * @param[in] path	file path
+ * @param[in] label	data label
+ *
+ * The buffer filled by the reader is stored in the context without copying.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_add_seq_file(attest_ctx_data *ctx, enum ctx_fields field,
+				 char *path, const char *label)
+{
+	unsigned char *data;
+	size_t len;
+	int rc;
+
+	rc = attest_util_read_seq_file(path, &len, &data);
+	if (rc)
+		return rc;
+
+	rc = attest_ctx_data_add_common(ctx, field, NULL, len, data, label);
+	if (rc)
+		free(data);
+
+	return rc;
+}
+
 /**
  * Add directory to data context
  * @param[in] ctx	data context
@@ -502,36 +563,31 @@ struct data_item *attest_ctx_data_lookup_by_digest(attest_ctx_data *ctx,
 	return NULL;
 }
 
-/**
- * Return global data context
- *
- * @returns data context
- */
-attest_ctx_data *attest_ctx_data_get_global(void)
-{
-	return &global_ctx_data;
-}
-
 /**
  * Obtain and initialize new data context
  * @param[in,out] ctx	data context
  *
+ * Thread-safe. The new context is owned by the caller.
+ *
  * @returns 0 on success, a negative value on error
  */
 int attest_ctx_data_init(attest_ctx_data **ctx)
 {
-	attest_ctx_data *new_ctx = &global_ctx_data;
+	attest_ctx_data *new_ctx;
 	int rc = 0, i;
 
-	if (ctx) {
-		new_ctx = calloc(1, sizeof(*new_ctx));
-		if (!new_ctx)
-			return -ENOMEM;
-	}
+	if (!ctx)
+		return -EINVAL;
+
+	new_ctx = calloc(1, sizeof(*new_ctx));
+	if (!new_ctx)
+		return -ENOMEM;
 
 	for (i = 0; i < CTX__LAST; i++)
 		INIT_LIST_HEAD(&new_ctx->ctx_data[i]);
 
+	attest_arena_init(&new_ctx->arena);
+
 	new_ctx->data_dir = strdup(TEMP_DIR_TEMPLATE);
 	if (!new_ctx->data_dir) {
 		rc = -ENOMEM;
@@ -545,59 +601,76 @@ int attest_ctx_data_init(attest_ctx_data **ctx)
 	}
 
 	new_ctx->flags = CTX_INIT;
-
-	if (ctx)
-		*ctx = new_ctx;
+	*ctx = new_ctx;
 
 	return rc;
 out:
 	free(new_ctx->data_dir);
-
-	if (new_ctx != &global_ctx_data) {
-		free(new_ctx);
-	}
+	free(new_ctx);
 
 	return rc;
 }
 
-/**
- * Deinitialize data context
- * @param[in] ctx	data context
- */
-void attest_ctx_data_cleanup(attest_ctx_data *ctx)
+static void attest_ctx_data_free_items(attest_ctx_data *ctx)
 {
 	struct data_item *item, *temp_item;
 	struct list_head *head;
 	int i;
 
-	if (!ctx)
-		ctx = &global_ctx_data;
-
-	if (!(ctx->flags & CTX_INIT))
-		return;
-
 	for (i = 0; i < CTX__LAST; i++) {
 		head = ctx->ctx_data + i;
 
 		list_for_each_entry_safe(item, temp_item, head, list) {
 			list_del(&item->list);
 
-			memset(item->data, 0, item->len);
+			/* public data is released without touching its pages */
+			if (ctx_fields_sensitive[i])
+				explicit_bzero(item->data, item->len);
 
-			if (item->mapped_file &&
-			    !strncmp(item->mapped_file, ctx->data_dir,
-				     strlen(ctx->data_dir))) {
+			if (item->mapped_file) {
 				munmap(item->data, item->len);
-				unlink(item->mapped_file);
-			} else if (!item->mapped_file) {
+
+				if (!strncmp(item->mapped_file, ctx->data_dir,
+					     strlen(ctx->data_dir)))
+					unlink(item->mapped_file);
+			} else {
 				free(item->data);
 			}
 
-			free(item->label);
 			free(item->mapped_file);
-			free(item);
 		}
 	}
+}
+
+/**
+ * Remove all data from a data context, so that it can be reused
+ * @param[in] ctx	data context
+ *
+ * The temporary directory and the memory reserved by the arena are kept.
+ */
+void attest_ctx_data_reset(attest_ctx_data *ctx)
+{
+	if (!ctx || !(ctx->flags & CTX_INIT))
+		return;
+
+	attest_ctx_data_free_items(ctx);
+	attest_arena_reset(&ctx->arena);
+
+	/* flags set while adding or converting the removed data */
+	ctx->flags = CTX_INIT;
+}
+
+/**
+ * Deinitialize data context
+ * @param[in] ctx	data context
+ */
+void attest_ctx_data_cleanup(attest_ctx_data *ctx)
+{
+	if (!ctx || !(ctx->flags & CTX_INIT))
+		return;
+
+	attest_ctx_data_free_items(ctx);
+	attest_arena_release(&ctx->arena);
 
 	if (ctx->data_dir) {
 		rmdir(ctx->data_dir);
@@ -606,9 +679,7 @@ void attest_ctx_data_cleanup(attest_ctx_data *ctx)
 	}
 
 	memset(ctx, 0, sizeof(*ctx));
-
-	if (ctx != &global_ctx_data)
-		free(ctx);
+	free(ctx);
 }
 
 /** @} */
@@ -684,7 +755,7 @@ int attest_ctx_verifier_req_add(attest_ctx_verifier *ctx,
 				const char *verifier_str, const char *req)
 {
 	const char *separator;
-	struct verifier_struct *func_array;
+	struct verifier_struct *func_array, *verifier;
 	char library_name[MAX_PATH_LENGTH];
 	void *handle;
 	int rc = 0, i = 0, *num_func;
@@ -695,6 +766,20 @@ int attest_ctx_verifier_req_add(attest_ctx_verifier *ctx,
 	if (!req)
 		return -EINVAL;
 
+	/* verifiers of a reset context are reused without loading them again */
+	list_for_each_entry(verifier, &ctx->registry, list) {
+		if (strcmp(verifier->id, verifier_str))
+			continue;
+
+		verifier->req = strdup(req);
+		if (!verifier->req)
+			return -ENOMEM;
+
+		list_del(&verifier->list);
+		list_add_tail(&verifier->list, &ctx->verifiers);
+		return 0;
+	}
+
 	separator = strchr(verifier_str, '|');
 	if (!separator)
 		separator = verifier_str + strlen(verifier_str);
@@ -743,13 +828,8 @@ static void attest_ctx_verifier_free_logs(attest_ctx_verifier *ctx)
 
 	list_for_each_entry_safe(log, temp_log, &ctx->logs, list) {
 		list_del(&log->list);
-		if (log == &unknown_log)
+		if (log == &ctx->unknown_log)
 			break;
-
-		if (strlen(log->reason))
-			free(log->reason);
-
-		free(log);
 	}
 }
 
@@ -769,16 +849,18 @@ struct verification_log *attest_ctx_verifier_add_log(attest_ctx_verifier *ctx,
 		return NULL;
 
 	last_log = list_last_entry(&ctx->logs, struct verification_log, list);
-	if (last_log == &unknown_log)
+	if (last_log == &ctx->unknown_log)
 		return NULL;
 
-	new_log = calloc(1, sizeof(*new_log));
+	new_log = attest_arena_calloc(&ctx->arena, 1, sizeof(*new_log));
 	if (!new_log) {
+		/* report the failure with the preallocated log of this ctx */
 		attest_ctx_verifier_free_logs(ctx);
-		new_log = &unknown_log;
+		list_add(&ctx->unknown_log.list, &ctx->logs);
 		return NULL;
 	}
 
+	new_log->arena = &ctx->arena;
 	new_log->operation = operation;
 	new_log->result = "in progress";
 	new_log->reason = "";
@@ -832,9 +914,9 @@ void attest_ctx_verifier_set_log(struct verification_log *log,
 	va_start(list, fmt);
 
 	vsnprintf(buf, sizeof(buf), fmt, list);
-	reason = strdup(buf);
+	reason = attest_arena_strdup(log->arena, buf);
 	if (!reason)
-		reason = unknown_log.reason;
+		reason = UNKNOWN_LOG_REASON;
 
 	log->reason = reason;
 	log->result = "failed";
@@ -867,51 +949,47 @@ void attest_ctx_verifier_end_log(attest_ctx_verifier *ctx,
 		if (strlen(previous_log->reason)) {
 			snprintf(buf, sizeof(buf), "%s failed",
 				 previous_log->operation);
-			if (strlen(log->reason))
-				free(log->reason);
-			log->reason = strdup(buf);
+			log->reason = attest_arena_strdup(&ctx->arena, buf);
 			if (!log->reason)
-				log->reason = unknown_log.reason;
+				log->reason = UNKNOWN_LOG_REASON;
 
 			break;
 		}
 	}
 }
 
-/**
- * Return global verifier context
- *
- * @returns verifier context
- */
-attest_ctx_verifier *attest_ctx_verifier_get_global(void)
-{
-	return &global_ctx_verifier;
-}
-
 /**
  * Obtain and initialize verifier context
  * @param[in,out] ctx	verifier context
  *
+ * Thread-safe. The new context is owned by the caller.
+ *
  * @returns 0 on success, a negative value on error
  */
 int attest_ctx_verifier_init(attest_ctx_verifier **ctx)
 {
-	attest_ctx_verifier *new_ctx = &global_ctx_verifier;
+	attest_ctx_verifier *new_ctx;
 
-	if (ctx) {
-		new_ctx = calloc(1, sizeof(*new_ctx));
-		if (!new_ctx)
-			return -ENOMEM;
-	}
+	if (!ctx)
+		return -EINVAL;
+
+	new_ctx = calloc(1, sizeof(*new_ctx));
+	if (!new_ctx)
+		return -ENOMEM;
 
 	INIT_LIST_HEAD(&new_ctx->event_logs);
 	INIT_LIST_HEAD(&new_ctx->verifiers);
+	INIT_LIST_HEAD(&new_ctx->registry);
 	INIT_LIST_HEAD(&new_ctx->logs);
 
-	new_ctx->flags = CTX_INIT;
+	new_ctx->unknown_log.operation = UNKNOWN_LOG_OPERATION;
+	new_ctx->unknown_log.result = UNKNOWN_LOG_RESULT;
+	new_ctx->unknown_log.reason = UNKNOWN_LOG_REASON;
 
-	if (ctx)
-		*ctx = new_ctx;
+	attest_arena_init(&new_ctx->arena);
+
+	new_ctx->flags = CTX_INIT;
+	*ctx = new_ctx;
 
 	return 0;
 }
@@ -962,6 +1040,39 @@ void attest_ctx_verifier_set_flags(attest_ctx_verifier *ctx, uint16_t flags)
 	ctx->flags |= flags;
 }
 
+/**
+ * Remove requirements and logs from a verifier context, so that it can be
+ * reused
+ * @param[in] ctx	verifier context
+ *
+ * Loaded verifiers, the PCR buffer and the memory reserved by the arena are
+ * kept.
+ */
+void attest_ctx_verifier_reset(attest_ctx_verifier *ctx)
+{
+	struct verifier_struct *v, *temp_v;
+
+	if (!ctx || !(ctx->flags & CTX_INIT))
+		return;
+
+	list_for_each_entry_safe(v, temp_v, &ctx->verifiers, list) {
+		list_del(&v->list);
+		free(v->req);
+		v->req = NULL;
+		list_add_tail(&v->list, &ctx->registry);
+	}
+
+	attest_ctx_verifier_free_logs(ctx);
+	INIT_LIST_HEAD(&ctx->event_logs);
+	attest_arena_reset(&ctx->arena);
+
+	ctx->pcr_base_mask = 0;
+	ctx->pcr_bank_mask = 0;
+	memset(ctx->pcr_mask, 0, sizeof(ctx->pcr_mask));
+	explicit_bzero(ctx->key, sizeof(ctx->key));
+	ctx->flags = CTX_INIT;
+}
+
 /**
  * Deinitialize verifier context
  * @param[in] ctx	verifier context
@@ -970,10 +1081,7 @@ void attest_ctx_verifier_cleanup(attest_ctx_verifier *ctx)
 {
 	struct verifier_struct *v, *temp_v;
 
-	if (!ctx)
-		ctx = &global_ctx_verifier;
-
-	if (!(ctx->flags & CTX_INIT))
+	if (!ctx || !(ctx->flags & CTX_INIT))
 		return;
 
 	list_for_each_entry_safe(v, temp_v, &ctx->verifiers, list) {
@@ -982,12 +1090,19 @@ void attest_ctx_verifier_cleanup(attest_ctx_verifier *ctx)
 		free(v);
 	}
 
+	list_for_each_entry_safe(v, temp_v, &ctx->registry, list) {
+		list_del(&v->list);
+		free(v);
+	}
+
 	attest_ctx_verifier_free_logs(ctx);
+	attest_arena_release(&ctx->arena);
+	free(ctx->pcr);
+	free(ctx->pcr_base);
 
+	explicit_bzero(ctx->key, sizeof(ctx->key));
 	memset(ctx, 0, sizeof(*ctx));
-
-	if (ctx != &global_ctx_verifier)
-		free(ctx);
+	free(ctx);
 }
 /** @}*/
 /** @}*/
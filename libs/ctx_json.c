@@ -17,6 +17,9 @@
  * @ingroup context-api
  * @brief
  * JSON specific functions for data and verifier context
+ *
+ * Same rules of the Context API apply: concurrent calls must use different
+ * contexts.
  */
 
 /**
@@ -28,6 +31,7 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <openssl/evp.h>
 
 #include "ctx_json.h"
 #include "util.h"
@@ -282,6 +286,229 @@ int attest_ctx_data_print_json_no_value(attest_ctx_data *ctx, char **json_str)
 	return attest_ctx_data_print_json_common(ctx, 0, json_str);
 }
 
+/// @private
+#define JSON_STREAM_BUF_SIZE 4096
+/// @private
+#define JSON_STREAM_CHUNK_SIZE 3072
+
+/// @private
+struct json_stream {
+	int fd;
+	size_t len;
+	size_t used;
+	unsigned char buf[JSON_STREAM_BUF_SIZE];
+};
+
+static int json_stream_flush(struct json_stream *s)
+{
+	int rc = 0;
+
+	if (s->fd >= 0 && s->used)
+		rc = attest_util_write_buf(s->fd, s->buf, s->used);
+
+	s->used = 0;
+	return rc;
+}
+
+static int json_stream_write(struct json_stream *s, const void *data,
+			     size_t len)
+{
+	const unsigned char *data_ptr = data;
+	size_t cur_len;
+	int rc;
+
+	s->len += len;
+
+	/* only compute the length of the JSON string */
+	if (s->fd < 0)
+		return 0;
+
+	while (len) {
+		cur_len = sizeof(s->buf) - s->used;
+		if (cur_len > len)
+			cur_len = len;
+
+		memcpy(s->buf + s->used, data_ptr, cur_len);
+		s->used += cur_len;
+		data_ptr += cur_len;
+		len -= cur_len;
+
+		if (s->used == sizeof(s->buf)) {
+			rc = json_stream_flush(s);
+			if (rc < 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int json_stream_write_string(struct json_stream *s, const char *str)
+{
+	char escaped[7];
+	const char *str_ptr;
+	int rc;
+
+	rc = json_stream_write(s, "\"", 1);
+
+	for (str_ptr = str; !rc && *str_ptr; str_ptr++) {
+		if (*str_ptr == '"' || *str_ptr == '\\') {
+			escaped[0] = '\\';
+			escaped[1] = *str_ptr;
+			rc = json_stream_write(s, escaped, 2);
+		} else if ((unsigned char)*str_ptr < 0x20) {
+			snprintf(escaped, sizeof(escaped), "\\u%04x",
+				 (unsigned char)*str_ptr);
+			rc = json_stream_write(s, escaped, 6);
+		} else {
+			rc = json_stream_write(s, str_ptr, 1);
+		}
+	}
+
+	if (!rc)
+		rc = json_stream_write(s, "\"", 1);
+
+	return rc;
+}
+
+static int json_stream_write_base64(struct json_stream *s, size_t len,
+				    unsigned char *data)
+{
+	const char *format_str = attest_ctx_data_get_format(DATA_FMT_BASE64);
+	unsigned char encoded[JSON_STREAM_CHUNK_SIZE / 3 * 4 + 1];
+	size_t cur_len;
+	int rc;
+
+	rc = json_stream_write(s, "\"", 1);
+	if (!rc)
+		rc = json_stream_write(s, format_str, strlen(format_str));
+	if (!rc)
+		rc = json_stream_write(s, ":", 1);
+
+	while (!rc && len) {
+		cur_len = len < JSON_STREAM_CHUNK_SIZE ?
+			  len : JSON_STREAM_CHUNK_SIZE;
+
+		/* the length of encoded data is known without encoding */
+		if (s->fd < 0)
+			rc = json_stream_write(s, NULL, (cur_len + 2) / 3 * 4);
+		else
+			rc = json_stream_write(s, encoded,
+					EVP_EncodeBlock(encoded, data, cur_len));
+
+		data += cur_len;
+		len -= cur_len;
+	}
+
+	if (!rc)
+		rc = json_stream_write(s, "\"", 1);
+
+	return rc;
+}
+
+static int attest_ctx_data_write_json_common(attest_ctx_data *ctx,
+					     struct json_stream *s)
+{
+	struct data_item *item;
+	enum ctx_fields field;
+	int rc, is_object, first_field = 1, first_item;
+
+	if (!ctx)
+		return -EINVAL;
+
+	rc = json_stream_write(s, "{", 1);
+
+	for (field = 0; !rc && field < CTX__LAST; field++) {
+		if (list_empty(&ctx->ctx_data[field]))
+			continue;
+
+		is_object = (field == CTX_EVENT_LOG || field == CTX_AUX_DATA);
+
+		if (!first_field)
+			rc = json_stream_write(s, ",", 1);
+		if (!rc)
+			rc = json_stream_write_string(s,
+					attest_ctx_data_get_field(field));
+		if (!rc)
+			rc = json_stream_write(s, is_object ? ":{" : ":[", 2);
+
+		first_field = 0;
+		first_item = 1;
+
+		list_for_each_entry(item, &ctx->ctx_data[field], list) {
+			if (rc)
+				break;
+
+			if (is_object && !item->label)
+				continue;
+
+			if (!first_item)
+				rc = json_stream_write(s, ",", 1);
+			if (!rc && is_object) {
+				rc = json_stream_write_string(s, item->label);
+				if (!rc)
+					rc = json_stream_write(s, ":", 1);
+			}
+			if (!rc)
+				rc = json_stream_write_base64(s, item->len,
+							      item->data);
+			first_item = 0;
+		}
+
+		if (!rc)
+			rc = json_stream_write(s, is_object ? "}" : "]", 1);
+	}
+
+	if (!rc)
+		rc = json_stream_write(s, "}", 1);
+
+	return rc;
+}
+
+/**
+ * Get the length of the JSON string written by attest_ctx_data_write_json()
+ * @param[in] ctx		data context
+ * @param[in,out] json_len	length of data in JSON format
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_json_len(attest_ctx_data *ctx, size_t *json_len)
+{
+	struct json_stream s = { .fd = -1 };
+	int rc;
+
+	rc = attest_ctx_data_write_json_common(ctx, &s);
+	if (!rc)
+		*json_len = s.len;
+
+	return rc;
+}
+
+/**
+ * Write data context in compact JSON format to a file descriptor
+ * @param[in] ctx	data context
+ * @param[in] fd	file descriptor
+ *
+ * Data is encoded in chunks and written through a fixed-size buffer, so that
+ * memory usage does not depend on the size of data items.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_write_json(attest_ctx_data *ctx, int fd)
+{
+	struct json_stream s = { .fd = fd };
+	int rc;
+
+	if (fd < 0)
+		return -EBADF;
+
+	rc = attest_ctx_data_write_json_common(ctx, &s);
+	if (!rc)
+		rc = json_stream_flush(&s);
+
+	return rc;
+}
+
 /**
  * Get data from a JSON string
  * @param[in] json_data		Input data in JSON format
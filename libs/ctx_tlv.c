@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: ctx_tlv.c
+ *      TLV specific context functions.
+ */
+
+/**
+ * @defgroup context-api-tlv Context API (TLV)
+ * @ingroup context-api
+ * @brief
+ * Binary encoding of data context, and functions to handle messages in JSON
+ * or TLV format
+ *
+ * A TLV message starts with struct ctx_tlv_hdr and contains for each data
+ * item a struct ctx_tlv_item_hdr, followed by the label and the raw data.
+ * Integers are in network byte order.
+ */
+
+/**
+ * @addtogroup context-api-tlv
+ *  @{
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#ifdef ZSTD_COMPRESSION
+#include <zstd.h>
+#endif
+
+#include "ctx_tlv.h"
+#include "ctx_json.h"
+#include "util.h"
+
+/// @private
+#define TLV_BUF_SIZE 4096
+
+/// @private
+struct tlv_stream {
+	int fd;
+	size_t len;
+	size_t used;
+	unsigned char *buf;
+	size_t buf_size;
+};
+
+static int tlv_stream_flush(struct tlv_stream *s)
+{
+	int rc = 0;
+
+	if (s->fd >= 0 && s->used)
+		rc = attest_util_write_buf(s->fd, s->buf, s->used);
+
+	s->used = 0;
+	return rc;
+}
+
+static int tlv_stream_write(struct tlv_stream *s, const void *data, size_t len)
+{
+	int rc;
+
+	s->len += len;
+
+	if (!s->buf)
+		return 0;
+
+	if (s->used + len > s->buf_size) {
+		/* the buffer is large enough to hold the whole message */
+		if (s->fd < 0)
+			return -ENOSPC;
+
+		rc = tlv_stream_flush(s);
+		if (rc < 0)
+			return rc;
+
+		/* large items are written without copying them */
+		if (len > s->buf_size)
+			return attest_util_write_buf(s->fd,
+						     (unsigned char *)data, len);
+	}
+
+	memcpy(s->buf + s->used, data, len);
+	s->used += len;
+	return 0;
+}
+
+static int attest_ctx_data_write_tlv_common(attest_ctx_data *ctx,
+					    struct tlv_stream *s)
+{
+	struct ctx_tlv_item_hdr item_hdr;
+	struct data_item *item;
+	enum ctx_fields field;
+	size_t label_len;
+	int rc = 0;
+
+	if (!ctx)
+		return -EINVAL;
+
+	for (field = 0; !rc && field < CTX__LAST; field++) {
+		list_for_each_entry(item, &ctx->ctx_data[field], list) {
+			label_len = item->label ? strlen(item->label) : 0;
+			if (label_len > UINT16_MAX || item->len > UINT32_MAX)
+				return -E2BIG;
+
+			item_hdr.field = htons(field |
+				((item->flags & DATA_ITEM_ZSTD) ?
+				 CTX_TLV_FIELD_ZSTD : 0));
+			item_hdr.label_len = htons(label_len);
+			item_hdr.data_len = htonl(item->len);
+
+			rc = tlv_stream_write(s, &item_hdr, sizeof(item_hdr));
+			if (!rc)
+				rc = tlv_stream_write(s, item->label, label_len);
+			if (!rc)
+				rc = tlv_stream_write(s, item->data, item->len);
+			if (rc)
+				break;
+		}
+	}
+
+	return rc;
+}
+
+static void attest_ctx_tlv_hdr_init(struct ctx_tlv_hdr *hdr, size_t len)
+{
+	memcpy(hdr->magic, CTX_TLV_MAGIC, CTX_TLV_MAGIC_LEN);
+	hdr->len = htonl(len);
+}
+
+/**
+ * Get the length of data context in TLV format
+ * @param[in] ctx		data context
+ * @param[in,out] tlv_len	length of data in TLV format
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_tlv_len(attest_ctx_data *ctx, size_t *tlv_len)
+{
+	struct tlv_stream s = { .fd = -1, .len = sizeof(struct ctx_tlv_hdr) };
+	int rc;
+
+	rc = attest_ctx_data_write_tlv_common(ctx, &s);
+	if (rc < 0)
+		return rc;
+
+	if (s.len > UINT32_MAX)
+		return -E2BIG;
+
+	*tlv_len = s.len;
+	return 0;
+}
+
+/**
+ * Print data context in TLV format
+ * @param[in] ctx		data context
+ * @param[in,out] tlv_str	buffer containing data in TLV format
+ *
+ * The buffer is terminated by a zero byte not included in the TLV length.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_print_tlv(attest_ctx_data *ctx, char **tlv_str)
+{
+	struct tlv_stream s = { .fd = -1 };
+	unsigned char *buf;
+	size_t len;
+	int rc;
+
+	rc = attest_ctx_data_tlv_len(ctx, &len);
+	if (rc < 0)
+		return rc;
+
+	buf = malloc(len + 1);
+	if (!buf)
+		return -ENOMEM;
+
+	attest_ctx_tlv_hdr_init((struct ctx_tlv_hdr *)buf, len);
+
+	s.buf = buf + sizeof(struct ctx_tlv_hdr);
+	s.buf_size = len - sizeof(struct ctx_tlv_hdr);
+
+	rc = attest_ctx_data_write_tlv_common(ctx, &s);
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
+
+	buf[len] = '\0';
+	*tlv_str = (char *)buf;
+	return 0;
+}
+
+/**
+ * Write data context in TLV format to a file descriptor
+ * @param[in] ctx	data context
+ * @param[in] fd	file descriptor
+ *
+ * Item headers and small items are written through a fixed-size buffer, large
+ * items are written directly from the data context.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_write_tlv(attest_ctx_data *ctx, int fd)
+{
+	unsigned char buf[TLV_BUF_SIZE];
+	struct tlv_stream s = { .fd = fd, .buf = buf, .buf_size = sizeof(buf) };
+	size_t len;
+	int rc;
+
+	if (fd < 0)
+		return -EBADF;
+
+	rc = attest_ctx_data_tlv_len(ctx, &len);
+	if (rc < 0)
+		return rc;
+
+	attest_ctx_tlv_hdr_init((struct ctx_tlv_hdr *)buf, len);
+	s.used = sizeof(struct ctx_tlv_hdr);
+
+	rc = attest_ctx_data_write_tlv_common(ctx, &s);
+	if (!rc)
+		rc = tlv_stream_flush(&s);
+
+	return rc;
+}
+
+#ifdef ZSTD_COMPRESSION
+/*
+ * Raw content dictionary with strings frequently found in IMA event logs with
+ * the ima-ng and ima-sig templates. Both peers must use the same dictionary.
+ */
+static const char ima_zstd_dict[] =
+	"\x06\x00\x00\x00ima-ng\x07\x00\x00\x00ima-sig\x07\x00\x00\x00ima-buf"
+	"\x0a\x00\x00\x00\x0e\x00\x00\x00kexec-cmdline"
+	"sha1:\0sha256:\0sha384:\0sha512:\0sm3:\0"
+	"\x0f\x00\x00\x00" "boot_aggregate\0"
+	"/etc/ld.so.cache\0/etc/ima/ima-policy\0/etc/passwd\0/etc/nsswitch.conf\0"
+	"/lib/modules/\0/usr/lib/modules/\0/usr/lib/firmware/\0.ko.xz\0.ko\0"
+	"/usr/share/\0/usr/libexec/\0/usr/sbin/\0/usr/bin/bash\0/usr/bin/\0"
+	"/usr/lib/systemd/system-generators/\0/usr/lib/systemd/systemd-\0"
+	"/usr/lib/systemd/systemd\0/usr/lib/systemd/\0/usr/lib/udev/\0"
+	"/usr/lib64/security/pam_\0/usr/lib64/systemd/libsystemd-shared-\0"
+	"/usr/lib64/libcrypto.so.\0/usr/lib64/libssl.so.\0/usr/lib64/libz.so.1\0"
+	"/usr/lib64/libselinux.so.1\0/usr/lib64/libpcre2-8.so.0\0"
+	"/usr/lib64/libpthread.so.0\0/usr/lib64/libdl.so.2\0/usr/lib64/libm.so.6\0"
+	"/usr/lib64/libsystemd.so.0\0/usr/lib64/libc.so.6\0"
+	"/usr/lib64/ld-linux-x86-64.so.2\0/usr/lib64/\0/usr/lib/\0.so.\0"
+	"\x0a\x00\x00\x00\x03\x02\x04";
+
+/// @private
+static struct {
+	pthread_once_t once;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+} ima_zstd = { .once = PTHREAD_ONCE_INIT };
+
+static void attest_ctx_tlv_zstd_init(void)
+{
+	ima_zstd.cdict = ZSTD_createCDict(ima_zstd_dict, sizeof(ima_zstd_dict),
+					  ZSTD_CLEVEL_DEFAULT);
+	ima_zstd.ddict = ZSTD_createDDict(ima_zstd_dict, sizeof(ima_zstd_dict));
+}
+
+static int attest_ctx_tlv_zstd_compress(const unsigned char *data, size_t len,
+					unsigned char **out, size_t *out_len)
+{
+	ZSTD_inBuffer in = { .src = data, .size = len };
+	ZSTD_outBuffer out_buf = { 0 };
+	ZSTD_CCtx *cctx;
+	void *new_buf;
+	size_t ret, new_size;
+	int rc = 0;
+
+	pthread_once(&ima_zstd.once, attest_ctx_tlv_zstd_init);
+	if (!ima_zstd.cdict)
+		return -ENOMEM;
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return -ENOMEM;
+
+	/* the decompressed size is stored in the frame */
+	ZSTD_CCtx_refCDict(cctx, ima_zstd.cdict);
+	ZSTD_CCtx_setPledgedSrcSize(cctx, len);
+
+	/* only compressed data is kept in memory */
+	while (1) {
+		if (out_buf.pos == out_buf.size) {
+			if (out_buf.size >= len) {
+				rc = -E2BIG;
+				goto out;
+			}
+
+			new_size = out_buf.size ? out_buf.size * 2 :
+				   ZSTD_CStreamOutSize();
+			new_buf = realloc(out_buf.dst, new_size);
+			if (!new_buf) {
+				rc = -ENOMEM;
+				goto out;
+			}
+
+			out_buf.dst = new_buf;
+			out_buf.size = new_size;
+		}
+
+		ret = ZSTD_compressStream2(cctx, &out_buf, &in, ZSTD_e_end);
+		if (ZSTD_isError(ret)) {
+			rc = -EINVAL;
+			goto out;
+		}
+
+		if (!ret)
+			break;
+	}
+
+	/* not worth sending compressed */
+	if (out_buf.pos >= len) {
+		rc = -E2BIG;
+		goto out;
+	}
+
+	*out = out_buf.dst;
+	*out_len = out_buf.pos;
+out:
+	if (rc)
+		free(out_buf.dst);
+
+	ZSTD_freeCCtx(cctx);
+	return rc;
+}
+
+static int attest_ctx_tlv_zstd_decompress(const unsigned char *data,
+					  size_t len, unsigned char **out,
+					  size_t *out_len, size_t *avail)
+{
+	unsigned long long size;
+	ZSTD_DCtx *dctx;
+	size_t ret;
+	int rc = 0;
+
+	pthread_once(&ima_zstd.once, attest_ctx_tlv_zstd_init);
+	if (!ima_zstd.ddict)
+		return -ENOMEM;
+
+	/* the decompressed size is bounded per item and per message */
+	size = ZSTD_getFrameContentSize(data, len);
+	if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+	    size == ZSTD_CONTENTSIZE_ERROR || size > CTX_TLV_ZSTD_MAX_LEN ||
+	    size > *avail)
+		return -EINVAL;
+
+	*out = malloc(size + 1);
+	if (!*out)
+		return -ENOMEM;
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	/* data is decompressed directly in the buffer of the new item */
+	ret = ZSTD_decompress_usingDDict(dctx, *out, size, data, len,
+					 ima_zstd.ddict);
+	if (ZSTD_isError(ret) || ret != size) {
+		rc = -EINVAL;
+		goto out;
+	}
+
+	*out_len = size;
+	*avail -= size;
+out:
+	if (rc)
+		free(*out);
+
+	ZSTD_freeDCtx(dctx);
+	return rc;
+}
+#endif
+
+/**
+ * Check if TLV items can be compressed
+ *
+ * @returns 1 if zstd compression is supported, 0 otherwise
+ */
+int attest_ctx_tlv_zstd_supported(void)
+{
+#ifdef ZSTD_COMPRESSION
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Compress event logs and auxiliary data in a data context
+ * @param[in] ctx	data context
+ *
+ * Compressed items can be only sent in TLV format, the data context should not
+ * be used for other purposes after compression. Items that are too small or
+ * that cannot be compressed are left unchanged.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_tlv_compress(attest_ctx_data *ctx)
+{
+#ifdef ZSTD_COMPRESSION
+	enum ctx_fields fields[] = { CTX_EVENT_LOG, CTX_AUX_DATA };
+	struct data_item *item;
+	unsigned char *data;
+	size_t len;
+	int rc, i;
+
+	if (!ctx)
+		return -EINVAL;
+
+	for (i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+		list_for_each_entry(item, &ctx->ctx_data[fields[i]], list) {
+			if ((item->flags & DATA_ITEM_ZSTD) ||
+			    item->len < CTX_TLV_ZSTD_MIN_LEN)
+				continue;
+
+			rc = attest_ctx_tlv_zstd_compress(item->data,
+							  item->len, &data,
+							  &len);
+			if (rc == -E2BIG)
+				continue;
+			if (rc < 0)
+				return rc;
+
+			if (item->mapped_file) {
+				munmap(item->data, item->len);
+
+				if (!strncmp(item->mapped_file, ctx->data_dir,
+					     strlen(ctx->data_dir)))
+					unlink(item->mapped_file);
+
+				free(item->mapped_file);
+				item->mapped_file = NULL;
+			} else {
+				free(item->data);
+			}
+
+			item->data = data;
+			item->len = len;
+			item->flags |= DATA_ITEM_ZSTD;
+		}
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int attest_ctx_data_add_tlv_item(attest_ctx_data *ctx,
+					enum ctx_fields field,
+					const unsigned char *data, size_t len,
+					const char *label, int compressed,
+					size_t *avail)
+{
+	char path[MAX_PATH_LENGTH];
+	unsigned char *buf = NULL;
+	int rc;
+
+	if (compressed) {
+#ifdef ZSTD_COMPRESSION
+		rc = attest_ctx_tlv_zstd_decompress(data, len, &buf, &len,
+						    avail);
+		if (rc < 0)
+			return rc;
+
+		data = buf;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	if (field != CTX_AUX_DATA || !label) {
+		if (buf)
+			return attest_ctx_data_add(ctx, field, len, buf, label);
+
+		return attest_ctx_data_add_copy(ctx, field, len,
+						(unsigned char *)data, label);
+	}
+
+	/* like for JSON, auxiliary data is stored in the data directory */
+	if (strchr(label, '/')) {
+		rc = -EINVAL;
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->data_dir, label);
+
+	rc = attest_util_write_file(path, len, (unsigned char *)data, 0);
+	if (rc < 0)
+		goto out;
+
+	rc = attest_ctx_data_add_file(ctx, field, path, label);
+out:
+	free(buf);
+	return rc;
+}
+
+/**
+ * Add data in TLV format to data context
+ * @param[in] ctx	data context
+ * @param[in] data	data to parse
+ * @param[in] len	length of data to parse
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_add_tlv_data(attest_ctx_data *ctx,
+				 const unsigned char *data, size_t len)
+{
+	struct ctx_tlv_item_hdr item_hdr;
+	const unsigned char *data_ptr = data + sizeof(struct ctx_tlv_hdr);
+	size_t label_len, data_len;
+	struct ctx_tlv_hdr hdr;
+	size_t avail = CTX_TLV_ZSTD_MAX_MSG_LEN;
+	char *label = NULL;
+	enum ctx_fields field;
+	int rc, compressed;
+
+	if (len < sizeof(hdr))
+		return -EINVAL;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (memcmp(hdr.magic, CTX_TLV_MAGIC, CTX_TLV_MAGIC_LEN) ||
+	    ntohl(hdr.len) != len)
+		return -EINVAL;
+
+	while (data_ptr < data + len) {
+		if (data + len - data_ptr < sizeof(item_hdr))
+			return -EINVAL;
+
+		memcpy(&item_hdr, data_ptr, sizeof(item_hdr));
+		data_ptr += sizeof(item_hdr);
+
+		field = ntohs(item_hdr.field);
+		label_len = ntohs(item_hdr.label_len);
+		data_len = ntohl(item_hdr.data_len);
+
+		compressed = (field & CTX_TLV_FIELD_ZSTD);
+		field &= ~CTX_TLV_FIELD_ZSTD;
+
+		if (field >= CTX__LAST ||
+		    data + len - data_ptr < label_len + data_len)
+			return -EINVAL;
+
+		if (label_len) {
+			label = strndup((const char *)data_ptr, label_len);
+			if (!label)
+				return -ENOMEM;
+		}
+
+		data_ptr += label_len;
+
+		rc = attest_ctx_data_add_tlv_item(ctx, field, data_ptr,
+						  data_len, label, compressed,
+						  &avail);
+		free(label);
+		label = NULL;
+
+		if (rc < 0)
+			return rc;
+
+		data_ptr += data_len;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the format of a message
+ * @param[in] msg	message
+ *
+ * @returns message format
+ */
+enum ctx_msg_formats attest_ctx_msg_format(const char *msg)
+{
+	if (!strncmp(msg, CTX_TLV_MAGIC, CTX_TLV_MAGIC_LEN))
+		return CTX_MSG_TLV;
+
+	return CTX_MSG_JSON;
+}
+
+/**
+ * Get the length of a message
+ * @param[in] msg	message checked with attest_ctx_msg_check()
+ *
+ * @returns message length
+ */
+size_t attest_ctx_msg_len(const char *msg)
+{
+	struct ctx_tlv_hdr hdr;
+
+	if (attest_ctx_msg_format(msg) == CTX_MSG_JSON)
+		return strlen(msg);
+
+	memcpy(&hdr, msg, sizeof(hdr));
+	return ntohl(hdr.len);
+}
+
+/**
+ * Check that a message received from the network has the expected length
+ * @param[in] msg	message
+ * @param[in] len	length of received data
+ *
+ * Messages must be terminated by an additional zero byte, not included in len.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_msg_check(const char *msg, size_t len)
+{
+	if (attest_ctx_msg_format(msg) == CTX_MSG_JSON)
+		return (strlen(msg) == len) ? 0 : -EINVAL;
+
+	if (len < sizeof(struct ctx_tlv_hdr))
+		return -EINVAL;
+
+	return (attest_ctx_msg_len(msg) == len) ? 0 : -EINVAL;
+}
+
+/**
+ * Add data from a message in JSON or TLV format to data context
+ * @param[in] ctx	data context
+ * @param[in] msg	message checked with attest_ctx_msg_check()
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_add_msg(attest_ctx_data *ctx, const char *msg)
+{
+	if (attest_ctx_msg_format(msg) == CTX_MSG_TLV)
+		return attest_ctx_data_add_tlv_data(ctx,
+						    (const unsigned char *)msg,
+						    attest_ctx_msg_len(msg));
+
+	return attest_ctx_data_add_json_data(ctx, msg, strlen(msg));
+}
+
+/**
+ * Print data context in the selected message format
+ * @param[in] ctx	data context
+ * @param[in] fmt	message format
+ * @param[in,out] msg	message
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_ctx_data_print_msg(attest_ctx_data *ctx, enum ctx_msg_formats fmt,
+			      char **msg)
+{
+	int rc;
+
+	if (fmt == CTX_MSG_TLV_ZSTD) {
+		rc = attest_ctx_data_tlv_compress(ctx);
+		if (rc < 0)
+			return rc;
+
+		fmt = CTX_MSG_TLV;
+	}
+
+	if (fmt == CTX_MSG_TLV)
+		return attest_ctx_data_print_tlv(ctx, msg);
+
+	return attest_ctx_data_print_json(ctx, msg);
+}
+/** @}*/
@@ -24,6 +24,9 @@
  * @ingroup enroll-api
  * @brief
  * Functions to generate enrollment requests and parse responses from a server.
+ *
+ * These functions share the TSS context and the AK loaded in the TPM of the
+ * client, and must be called by one thread at a time.
  * @addtogroup enroll-client-api
  *  @{
  */
@@ -35,6 +38,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -45,11 +51,13 @@
 
 #include "enroll_client.h"
 #include "ctx_json.h"
+#include "ctx_tlv.h"
 #include "util.h"
 #include "tss.h"
 #include "skae.h"
 #include "conf.h"
 #include "event_log.h"
+#include "event_log/ima.h"
 
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
@@ -68,12 +76,182 @@
 #define HASH_ALG_KEY TPM_ALG_SHA256
 #define PCR_ALG TPM_ALG_SHA1
 
+#define KEY_POOL_MAX_SIZE 32
+/* PCRs extended after boot: IMA and application PCRs */
+#define KEY_POOL_VOLATILE_PCRS (~0xffff | (1 << IMA_PCR))
+
 static enum ctx_fields key_type_to_ctx_field[KEY_TYPE__LAST] = {
 	[KEY_TYPE_AK] = CTX_TPM_AK_KEY,
 	[KEY_TYPE_ASYM_DEC] = CTX_TPM_KEY_TEMPLATE,
 	[KEY_TYPE_SYM_HMAC] = CTX_TPM_SYM_KEY,
 };
 
+/*
+ * TSS context and AK kept across requests, so that repeated attestations
+ * only pay for the TPM commands they need and not for loading the AK again.
+ */
+static struct {
+	TSS_CONTEXT *tssContext;
+	TPM_HANDLE ak_handle;
+	char *ak_pub_path;
+	size_t ak_public_len;
+	BYTE *ak_public;
+	enum ctx_msg_formats msg_fmt;
+} client_session;
+
+static int attest_enroll_session_tss(void **tssContext)
+{
+	int rc;
+
+	if (!client_session.tssContext) {
+		rc = TSS_Create(&client_session.tssContext);
+		if (rc)
+			return -EINVAL;
+	}
+
+	*tssContext = client_session.tssContext;
+	return 0;
+}
+
+static void attest_enroll_session_drop_ak(void)
+{
+	if ((client_session.ak_handle >> 24) == TPM_HT_TRANSIENT)
+		attest_tss_flushcontext(client_session.tssContext,
+					client_session.ak_handle);
+
+	free(client_session.ak_pub_path);
+	free(client_session.ak_public);
+
+	client_session.ak_handle = 0;
+	client_session.ak_pub_path = NULL;
+	client_session.ak_public = NULL;
+	client_session.ak_public_len = 0;
+}
+
+/*
+ * Return a handle of the AK that stays valid across requests. The AK is made
+ * persistent, so that also the next processes find it already in the TPM. If
+ * the TPM does not allow that, or the persistent handle is used by another
+ * application, the AK stays loaded until the session is closed.
+ */
+static int attest_enroll_session_ak(TSS_CONTEXT *tssContext, char *akPrivPath,
+				    char *akPubPath, TPM_HANDLE *ak_handle,
+				    size_t *ak_public_len, BYTE **ak_public)
+{
+	BYTE *private = NULL, *public = NULL, *resident_public = NULL;
+	BYTE *owned_public = NULL;
+	size_t private_len = 0, public_len = 0, owned_public_len = 0;
+	UINT16 resident_public_len = 0;
+	TPM_HANDLE handle;
+	int rc, resident, owned = 0;
+
+	if (client_session.ak_handle &&
+	    tssContext == client_session.tssContext &&
+	    !strcmp(akPubPath, client_session.ak_pub_path))
+		goto out_session;
+
+	attest_enroll_session_drop_ak();
+
+	rc = attest_util_read_file(akPubPath, &public_len, &public);
+	if (rc)
+		return rc;
+
+	rc = attest_tss_readpublic(tssContext, TPM_AK_PERSISTENT_HANDLE,
+				   &resident_public_len, &resident_public);
+	resident = !rc;
+	if (resident && resident_public_len == public_len &&
+	    !memcmp(resident_public, public, public_len)) {
+		handle = TPM_AK_PERSISTENT_HANDLE;
+		goto out_set;
+	}
+
+	/* the handle can be taken over only if it holds an AK we persisted */
+	if (resident &&
+	    !attest_util_read_file(AK_PERSISTENT_PUB_PATH, &owned_public_len,
+				   &owned_public)) {
+		owned = (owned_public_len == resident_public_len &&
+			 !memcmp(owned_public, resident_public,
+				 owned_public_len));
+		munmap(owned_public, owned_public_len);
+	}
+
+	rc = attest_util_read_file(akPrivPath, &private_len, &private);
+	if (rc)
+		goto out;
+
+	rc = attest_tss_load(tssContext, private_len, private, public_len,
+			     public, &handle);
+	if (rc)
+		goto out;
+
+	if (resident && !owned)
+		goto out_set;
+
+	/* a different AK was generated, replace the persistent one */
+	if (resident)
+		attest_tss_evictcontrol(tssContext, TPM_AK_PERSISTENT_HANDLE,
+					TPM_AK_PERSISTENT_HANDLE);
+
+	/* record the AK before persisting it, to recognize it later */
+	if (!attest_util_write_file(AK_PERSISTENT_PUB_PATH, public_len,
+				    public, 0) &&
+	    !attest_tss_evictcontrol(tssContext, handle,
+				     TPM_AK_PERSISTENT_HANDLE)) {
+		attest_tss_flushcontext(tssContext, handle);
+		handle = TPM_AK_PERSISTENT_HANDLE;
+	}
+out_set:
+	client_session.ak_handle = handle;
+	client_session.tssContext = tssContext;
+	client_session.ak_pub_path = strdup(akPubPath);
+	client_session.ak_public = malloc(public_len);
+	if (!client_session.ak_pub_path || !client_session.ak_public) {
+		attest_enroll_session_drop_ak();
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(client_session.ak_public, public, public_len);
+	client_session.ak_public_len = public_len;
+out_session:
+	*ak_handle = client_session.ak_handle;
+	*ak_public_len = client_session.ak_public_len;
+	*ak_public = client_session.ak_public;
+	rc = 0;
+out:
+	if (private)
+		munmap(private, private_len);
+	if (public)
+		munmap(public, public_len);
+
+	free(resident_public);
+	return rc;
+}
+
+/**
+ * Release the TSS context and the AK kept across requests
+ *
+ * A persistent AK stays in the TPM and is used by the next process.
+ */
+void attest_enroll_session_close(void)
+{
+	attest_enroll_session_drop_ak();
+
+	if (client_session.tssContext)
+		TSS_Delete(client_session.tssContext);
+
+	client_session.tssContext = NULL;
+}
+
+/**
+ * Select the format of messages sent to the RA server
+ * @param[in] fmt	message format negotiated with the RA server
+ */
+void attest_enroll_msg_set_format(enum ctx_msg_formats fmt)
+{
+	client_session.msg_fmt = fmt;
+}
+
 /**
  * Add EK certificate to data context
  * @param[in] d_ctx		data context
@@ -184,6 +362,271 @@ out:
 	return rc;
 }
 
+static int attest_enroll_policy_digest(TPMI_ALG_HASH nalg,
+				       UINT16 policy_bin_len, BYTE *policy_bin,
+				       TPMT_HA *digest)
+{
+	memset(digest, 0, sizeof(*digest));
+	digest->hashAlg = nalg;
+
+	if (TSS_Hash_Generate(digest, TSS_GetDigestSize(nalg),
+			      (uint8_t *)&digest->digest, policy_bin_len,
+			      policy_bin, 0, NULL))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int attest_enroll_check_primary(TSS_CONTEXT *tssContext,
+				       TPMI_ALG_HASH nalg, TPMI_ALG_HASH halg)
+{
+	TPM_HANDLE primaryHandle;
+	int rc;
+
+	rc = attest_tss_check_key(tssContext, 0x81000001);
+	if (rc != -ENOENT)
+		return rc;
+
+	rc = attest_tss_create_obj(tssContext, TPM_ALG_RSA, TPM_ECC_NONE, nalg,
+				   halg, KEY_TYPE_PRIMARY, NULL, 0, NULL, 0,
+				   NULL, &primaryHandle);
+	if (rc < 0)
+		return rc;
+
+	rc = attest_tss_evictcontrol(tssContext, primaryHandle, 0x81000001);
+
+	attest_tss_flushcontext(tssContext, primaryHandle);
+	return rc;
+}
+
+/*
+ * Keys generated in advance are stored in KEY_POOL_DIR, one file per key
+ * with the private and the public part. The file name starts with the key
+ * template and the policy digest, so that a key is used only by requests
+ * that would create the same key.
+ */
+static void attest_enroll_key_pool_prefix(char *prefix, size_t prefix_len,
+					  enum key_types type,
+					  TPMI_ALG_HASH nalg,
+					  TPMI_ALG_HASH halg,
+					  BYTE *policy_digest)
+{
+	char policy_hex[sizeof(TPMU_HA) * 2 + 1] = "none";
+
+	if (policy_digest)
+		*_bin2hex(policy_hex, policy_digest,
+			  TSS_GetDigestSize(nalg)) = '\0';
+
+	snprintf(prefix, prefix_len, "%d-%04x-%04x-%s-", type, nalg, halg,
+		 policy_hex);
+}
+
+static int key_pool_seq;
+
+static int attest_enroll_key_pool_count(const char *prefix)
+{
+	struct dirent *d_entry;
+	int num_keys = 0;
+	DIR *dir;
+
+	dir = opendir(KEY_POOL_DIR);
+	if (!dir)
+		return 0;
+
+	while ((d_entry = readdir(dir)))
+		if (!strncmp(d_entry->d_name, prefix, strlen(prefix)))
+			num_keys++;
+
+	closedir(dir);
+	return num_keys;
+}
+
+/* remove the keys of a type without the prefix (all if NULL) */
+static void attest_enroll_key_pool_prune(enum key_types type,
+					 const char *prefix)
+{
+	char path[PATH_MAX], type_prefix[16];
+	struct dirent *d_entry;
+	DIR *dir;
+
+	dir = opendir(KEY_POOL_DIR);
+	if (!dir)
+		return;
+
+	snprintf(type_prefix, sizeof(type_prefix), "%d-", type);
+
+	while ((d_entry = readdir(dir))) {
+		if (strncmp(d_entry->d_name, type_prefix, strlen(type_prefix)))
+			continue;
+
+		if (prefix && !strncmp(d_entry->d_name, prefix, strlen(prefix)))
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s", KEY_POOL_DIR,
+			 d_entry->d_name);
+		unlink(path);
+	}
+
+	closedir(dir);
+}
+
+static int attest_enroll_key_pool_take(const char *prefix,
+				       UINT16 *private_len, BYTE **private,
+				       UINT16 *public_len, BYTE **public)
+{
+	char path[PATH_MAX], claimed_path[PATH_MAX];
+	struct dirent *d_entry;
+	unsigned char *data;
+	size_t len;
+	int rc = -ENOENT;
+	DIR *dir;
+
+	dir = opendir(KEY_POOL_DIR);
+	if (!dir)
+		return -ENOENT;
+
+	snprintf(claimed_path, sizeof(claimed_path), "%s.claimed-%d",
+		 KEY_POOL_DIR, getpid());
+
+	while ((d_entry = readdir(dir))) {
+		if (strncmp(d_entry->d_name, prefix, strlen(prefix)))
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s", KEY_POOL_DIR,
+			 d_entry->d_name);
+
+		/* another process took the key first */
+		if (rename(path, claimed_path) < 0)
+			continue;
+
+		/* invalid keys are removed, and the next one is tried */
+		rc = attest_util_read_file(claimed_path, &len, &data);
+		unlink(claimed_path);
+		if (rc)
+			continue;
+
+		rc = -EINVAL;
+
+		if (len < sizeof(*private_len))
+			goto next;
+
+		memcpy(private_len, data, sizeof(*private_len));
+		if (len < sizeof(*private_len) * 2 + *private_len)
+			goto next;
+
+		memcpy(public_len, data + sizeof(*private_len) + *private_len,
+		       sizeof(*public_len));
+		if (len != sizeof(*private_len) * 2 + *private_len +
+			   *public_len)
+			goto next;
+
+		*private = malloc(*private_len);
+		*public = malloc(*public_len);
+		if (!*private || !*public) {
+			free(*private);
+			free(*public);
+			rc = -ENOMEM;
+			goto next;
+		}
+
+		memcpy(*private, data + sizeof(*private_len), *private_len);
+		memcpy(*public, data + len - *public_len, *public_len);
+		rc = 0;
+next:
+		munmap(data, len);
+		if (!rc || rc == -ENOMEM)
+			break;
+	}
+
+	closedir(dir);
+
+	/* no valid key found */
+	if (rc && rc != -ENOMEM)
+		rc = -ENOENT;
+
+	return rc;
+}
+
+static int attest_enroll_key_pool_add(TSS_CONTEXT *tssContext,
+				      enum key_types type, TPMI_ALG_HASH nalg,
+				      TPMI_ALG_HASH halg, UINT16 policy_bin_len,
+				      BYTE *policy_bin, int pool_size)
+{
+	char prefix[sizeof(TPMU_HA) * 2 + 32];
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	UINT16 private_len, public_len;
+	BYTE *private, *public, *policy_digest = NULL;
+	TPMT_HA calculated_digest;
+	unsigned char *data;
+	size_t len;
+	int rc, num_keys;
+
+	if (policy_bin_len) {
+		rc = attest_enroll_policy_digest(nalg, policy_bin_len,
+						 policy_bin, &calculated_digest);
+		if (rc)
+			return rc;
+
+		policy_digest = (uint8_t *)&calculated_digest.digest;
+	}
+
+	attest_enroll_key_pool_prefix(prefix, sizeof(prefix), type, nalg, halg,
+				      policy_digest);
+
+	/* keys bound to a previous policy would not match any request */
+	attest_enroll_key_pool_prune(type, prefix);
+
+	rc = attest_enroll_check_primary(tssContext, nalg, halg);
+	if (rc < 0)
+		return rc;
+
+	for (num_keys = attest_enroll_key_pool_count(prefix);
+	     num_keys < pool_size; num_keys++) {
+		rc = attest_tss_create_obj(tssContext, TPM_ALG_RSA,
+					   TPM_ECC_NONE, nalg, halg, type,
+					   policy_digest, &private_len,
+					   &private, &public_len, &public,
+					   NULL);
+		if (rc)
+			return rc;
+
+		/* keys become visible to requests only when complete */
+		snprintf(tmp_path, sizeof(tmp_path), "%s.new-%d", KEY_POOL_DIR,
+			 getpid());
+		snprintf(path, sizeof(path), "%s%s%d-%ld-%d", KEY_POOL_DIR,
+			 prefix, getpid(), (long)time(NULL), key_pool_seq++);
+
+		len = sizeof(private_len) * 2 + private_len + public_len;
+		data = malloc(len);
+		if (!data) {
+			rc = -ENOMEM;
+			goto next;
+		}
+
+		memcpy(data, &private_len, sizeof(private_len));
+		memcpy(data + sizeof(private_len), private, private_len);
+		memcpy(data + sizeof(private_len) + private_len, &public_len,
+		       sizeof(public_len));
+		memcpy(data + len - public_len, public, public_len);
+
+		rc = attest_util_write_file(tmp_path, len, data, 0);
+		if (!rc && rename(tmp_path, path) < 0)
+			rc = -errno;
+
+		free(data);
+next:
+		free(private);
+		free(public);
+
+		if (rc) {
+			unlink(tmp_path);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * Create and add key to data context
  * @param[in] d_ctx		data context
@@ -204,50 +647,44 @@ int attest_enroll_add_key(attest_ctx_data *d_ctx, TSS_CONTEXT *tssContext,
 			  TPMI_ALG_HASH halg, UINT16 policy_bin_len,
 			  BYTE *policy_bin)
 {
+	char prefix[sizeof(TPMU_HA) * 2 + 32];
 	UINT16 private_len, public_len;
-	BYTE *private, *public;
+	BYTE *private = NULL, *public = NULL;
 	TPMT_HA calculated_digest = { 0 };
 	BYTE *policy_digest = NULL;
-	TPM_HANDLE primaryHandle;
 	int rc;
 
-	if (policy_bin_len) {
-		memset(&calculated_digest, 0, sizeof(calculated_digest));
-
-		calculated_digest.hashAlg = nalg;
+	/* the AK files are replaced, do not use the old AK anymore */
+	if (type == KEY_TYPE_AK)
+		attest_enroll_session_drop_ak();
 
-		rc = TSS_Hash_Generate(&calculated_digest,
-				TSS_GetDigestSize(calculated_digest.hashAlg),
-				(uint8_t *)&calculated_digest.digest,
-				policy_bin_len, policy_bin, 0, NULL);
-		if (rc) {
-			rc = -EINVAL;
-			goto out;
-		}
+	if (policy_bin_len) {
+		rc = attest_enroll_policy_digest(nalg, policy_bin_len,
+						 policy_bin, &calculated_digest);
+		if (rc)
+			return rc;
 
 		policy_digest = (uint8_t *)&calculated_digest.digest;
 	}
 
-	rc = attest_tss_check_key(tssContext, 0x81000001);
-	if (rc == -ENOENT) {
-		rc = attest_tss_create_obj(tssContext, TPM_ALG_RSA,
-				   TPM_ECC_NONE, nalg, halg, KEY_TYPE_PRIMARY,
-				   NULL, 0, NULL, 0, NULL, &primaryHandle);
-		if (rc < 0)
-			return rc;
-
-		rc = attest_tss_evictcontrol(tssContext, primaryHandle,
-					     0x81000001);
-
-		attest_tss_flushcontext(tssContext, primaryHandle);
+	attest_enroll_key_pool_prefix(prefix, sizeof(prefix), type, nalg, halg,
+				      policy_digest);
 
+	/* use a key generated in advance with the same template and policy */
+	rc = attest_enroll_key_pool_take(prefix, &private_len, &private,
+					 &public_len, &public);
+	if (rc && rc != -ENOMEM) {
+		rc = attest_enroll_check_primary(tssContext, nalg, halg);
 		if (rc < 0)
 			return rc;
+
+		rc = attest_tss_create_obj(tssContext, TPM_ALG_RSA,
+					   TPM_ECC_NONE, nalg, halg, type,
+					   policy_digest, &private_len,
+					   &private, &public_len, &public,
+					   NULL);
 	}
 
-	rc = attest_tss_create_obj(tssContext, TPM_ALG_RSA, TPM_ECC_NONE, nalg,
-				   halg, type, policy_digest, &private_len,
-				   &private, &public_len, &public, NULL);
 	if (rc)
 		return rc;
 
@@ -297,8 +734,8 @@ int attest_enroll_add_cred(attest_ctx_data *d_ctx, attest_ctx_data *d_ctx_cred,
 			   char *akPubPath)
 {
 	TPM_HANDLE activateHandle, keyHandle;
-	BYTE *private, *public, *cred;
-	size_t private_len, public_len;
+	BYTE *public, *cred;
+	size_t public_len;
 	struct data_item *credblob, *secret, *credhmac;
 	UINT16 cred_len;
 	int rc;
@@ -307,59 +744,45 @@ int attest_enroll_add_cred(attest_ctx_data *d_ctx, attest_ctx_data *d_ctx_cred,
 	if (rc)
 		return rc;
 
-	rc = attest_util_read_file(akPrivPath, &private_len, &private);
+	rc = attest_enroll_session_ak(tssContext, akPrivPath, akPubPath,
+				      &keyHandle, &public_len, &public);
 	if (rc)
 		goto out_flush_ek;
 
-	rc = attest_util_read_file(akPubPath, &public_len, &public);
-	if (rc)
-		goto out_munmap_priv;
-
 	rc = attest_ctx_data_add_copy(d_ctx, CTX_TPM_AK_KEY, public_len,
 				      public, NULL);
 	if (rc)
-		goto out_munmap_pub;
+		goto out_flush_ek;
 
 	rc = attest_ctx_data_add_copy(d_ctx_cred, CTX_TPM_AK_KEY, public_len,
 				      public, NULL);
 	if (rc)
-		goto out_munmap_pub;
-
-	rc = attest_tss_load(tssContext, private_len, private, public_len,
-			     public, &keyHandle);
-	if (rc)
-		goto out_munmap_pub;
+		goto out_flush_ek;
 
 	credblob = attest_ctx_data_get(d_ctx, CTX_CREDBLOB);
 	if (!credblob)
-		goto out_flush_ak;
+		goto out_flush_ek;
 
 	secret = attest_ctx_data_get(d_ctx, CTX_SECRET);
 	if (!secret)
-		goto out_flush_ak;
+		goto out_flush_ek;
 
 	credhmac = attest_ctx_data_get(d_ctx, CTX_CRED_HMAC);
 	if (!secret)
-		goto out_flush_ak;
+		goto out_flush_ek;
 
 	rc = attest_ctx_data_add_copy(d_ctx_cred, CTX_CRED_HMAC, credhmac->len,
 				      credhmac->data, NULL);
 	if (rc)
-		goto out_flush_ak;
+		goto out_flush_ek;
 
 	rc = attest_tss_activatecredential(tssContext, keyHandle,
 				activateHandle, credblob->len, credblob->data,
 				secret->len, secret->data, &cred_len, &cred);
 	if (rc)
-		goto out_flush_ak;
+		goto out_flush_ek;
 
 	rc = attest_ctx_data_add(d_ctx_cred, CTX_CRED, cred_len, cred, NULL);
-out_flush_ak:
-	attest_tss_flushcontext(tssContext, keyHandle);
-out_munmap_pub:
-	munmap(public, public_len);
-out_munmap_priv:
-	munmap(private, private_len);
 out_flush_ek:
 	attest_tss_flushcontext(tssContext, activateHandle);
 	return rc;
@@ -371,26 +794,198 @@ out_flush_ek:
 #define IMA_FILENAME "binary_runtime_measurements"
 #define IMA_BINARY_MEASUREMENTS SECURITYFS_PATH "ima/" IMA_FILENAME
 
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LEN 36
+
+/* IMA event log already sent to the verifier */
+struct ima_delta_state {
+	char boot_id[BOOT_ID_LEN];
+	uint64_t offset;
+	uint32_t num_entries;
+	uint8_t pcr[PCR_BANK__LAST][sizeof(TPMU_HA)];
+};
+
+static int ima_delta_read_boot_id(char *boot_id)
+{
+	unsigned char *data;
+	size_t len;
+	int rc;
+
+	rc = attest_util_read_seq_file(BOOT_ID_PATH, &len, &data);
+	if (rc)
+		return rc;
+
+	if (len < BOOT_ID_LEN)
+		rc = -EINVAL;
+	else
+		memcpy(boot_id, data, BOOT_ID_LEN);
+
+	free(data);
+	return rc;
+}
+
+static int ima_delta_count_entries(unsigned char *data, size_t len)
+{
+	struct ima_template_entry *entry;
+	size_t entry_len, offset = 0;
+	uint32_t field_len;
+	int num_entries = 0;
+
+	while (offset < len) {
+		entry = (struct ima_template_entry *)(data + offset);
+		entry_len = sizeof(entry->header);
+		if (offset + entry_len > len)
+			return -EINVAL;
+
+		/* replaying from the last PCR value works only for one PCR */
+		if (entry->header.pcr != IMA_PCR)
+			return -ENOTSUP;
+
+		entry_len += entry->header.name_len;
+		if (offset + entry_len > len)
+			return -EINVAL;
+
+		/* legacy template: digest, name length and name */
+		if (entry->header.name_len == strlen(IMA_TEMPLATE_IMA_NAME) &&
+		    !memcmp(entry->data, IMA_TEMPLATE_IMA_NAME,
+			    entry->header.name_len))
+			entry_len += SHA_DIGEST_LENGTH;
+
+		if (offset + entry_len + sizeof(field_len) > len)
+			return -EINVAL;
+
+		memcpy(&field_len, data + offset + entry_len,
+		       sizeof(field_len));
+		entry_len += sizeof(field_len) + field_len;
+		if (offset + entry_len > len)
+			return -EINVAL;
+
+		offset += entry_len;
+		num_entries++;
+	}
+
+	return num_entries;
+}
+
+/*
+ * Add only the part of the IMA event log that was not sent before, and the
+ * position of that part in the whole log. Software PCRs start from the value
+ * they had at the end of the last part sent.
+ */
+static int collect_ima_delta(attest_ctx_data *d_ctx,
+			     attest_ctx_verifier *v_ctx,
+			     struct ima_delta_state *next_state)
+{
+	struct ima_delta_state state = { 0 };
+	struct ima_delta delta = { 0 };
+	unsigned char *data = NULL, *state_data;
+	size_t len, state_len;
+	int rc, i, num_entries;
+
+	rc = ima_delta_read_boot_id(next_state->boot_id);
+	if (rc)
+		return rc;
+
+	if (!attest_util_read_file(IMA_DELTA_STATE_PATH, &state_len,
+				   &state_data)) {
+		if (state_len == sizeof(state))
+			memcpy(&state, state_data, sizeof(state));
+
+		munmap(state_data, state_len);
+	}
+
+	/* the IMA event log starts again at every boot */
+	if (memcmp(state.boot_id, next_state->boot_id, BOOT_ID_LEN))
+		memset(&state, 0, sizeof(state));
+
+	rc = attest_util_read_seq_file_from(IMA_BINARY_MEASUREMENTS,
+					    state.offset, &len, &data);
+	if (rc)
+		return rc;
+
+	num_entries = ima_delta_count_entries(data, len);
+	if (num_entries < 0) {
+		rc = num_entries;
+		goto out;
+	}
+
+	if (state.offset) {
+		for (i = 0; i < PCR_BANK__LAST; i++) {
+			rc = attest_pcr_set_base(v_ctx, IMA_PCR,
+						 attest_pcr_bank_alg(i),
+						 state.pcr[i]);
+			if (rc)
+				goto out;
+		}
+
+		attest_ctx_verifier_set_flags(v_ctx, CTX_IMA_DELTA);
+	}
+
+	/* the state must match the PCR value calculated by the verifier */
+	attest_ctx_verifier_set_flags(v_ctx, CTX_ALLOW_IMA_VIOLATIONS);
+
+	rc = attest_pcr_calc_state(v_ctx, IMA_DELTA_STATE_BANKS, 1 << IMA_PCR,
+				   delta.base_state);
+	if (rc)
+		goto out;
+
+	delta.start_entry = state.num_entries;
+	delta.num_entries = num_entries;
+
+	rc = attest_ctx_data_add_copy(d_ctx, CTX_AUX_DATA, sizeof(delta),
+				      (unsigned char *)&delta, IMA_DELTA_LABEL);
+	if (rc)
+		goto out;
+
+	if (len) {
+		rc = attest_ctx_data_add(d_ctx, CTX_EVENT_LOG, len, data,
+					 "ima");
+		if (rc)
+			goto out;
+
+		data = NULL;
+	}
+
+	next_state->offset = state.offset + len;
+	next_state->num_entries = state.num_entries + num_entries;
+out:
+	free(data);
+	return rc;
+}
+
+static int ima_delta_write_state(attest_ctx_verifier *v_ctx,
+				 struct ima_delta_state *state)
+{
+	TPMT_HA *pcr;
+	int i;
+
+	for (i = 0; i < PCR_BANK__LAST; i++) {
+		pcr = attest_pcr_get(v_ctx, IMA_PCR, attest_pcr_bank_alg(i));
+		if (!pcr)
+			return -ENOENT;
+
+		memcpy(state->pcr[i], (uint8_t *)&pcr->digest,
+		       attest_pcr_digest_size(pcr->hashAlg));
+	}
+
+	return attest_util_write_file(IMA_DELTA_STATE_NEW_PATH, sizeof(*state),
+				      (unsigned char *)state, 0);
+}
+
 static int collect_data(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 			int kernel_bios_log, int kernel_ima_log,
-			int send_unsigned_files)
+			int send_unsigned_files, int ima_delta)
 {
-	unsigned char *data = NULL;
+	struct ima_delta_state ima_delta_state = { 0 };
 	const char *verifier_str = "dummy|verify";
 	struct stat st;
-	size_t len;
 	int rc = 0;
 
 	if (kernel_bios_log) {
-		if (!stat(BIOS_BINARY_MEASUREMENTS, &st)) {
-			rc = attest_util_read_seq_file(BIOS_BINARY_MEASUREMENTS,
-						       &len, &data);
-			if (rc < 0)
-				goto out;
-
-			rc = attest_ctx_data_add(d_ctx, CTX_EVENT_LOG, len,
-						 data, "bios");
-		}
+		if (!stat(BIOS_BINARY_MEASUREMENTS, &st))
+			rc = attest_ctx_data_add_seq_file(d_ctx, CTX_EVENT_LOG,
+						BIOS_BINARY_MEASUREMENTS,
+						"bios");
 	} else {
 		if (!stat(BIOS_FILENAME, &st))
 			rc = attest_ctx_data_add_file(d_ctx, CTX_EVENT_LOG,
@@ -402,15 +997,21 @@ static int collect_data(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 
 	if (kernel_ima_log) {
 		if (!stat(IMA_BINARY_MEASUREMENTS, &st)) {
-			rc = attest_util_read_seq_file(IMA_BINARY_MEASUREMENTS,
-						       &len, &data);
-			if (rc)
-				goto out;
-
-			rc = attest_ctx_data_add(d_ctx, CTX_EVENT_LOG, len,
-						 data, "ima");
+			if (ima_delta)
+				rc = collect_ima_delta(d_ctx, v_ctx,
+						       &ima_delta_state);
+
+			/* send the whole log if a part is not enough */
+			if (!ima_delta || rc == -ENOTSUP) {
+				ima_delta = 0;
+				rc = attest_ctx_data_add_seq_file(d_ctx,
+						CTX_EVENT_LOG,
+						IMA_BINARY_MEASUREMENTS, "ima");
+			}
 		}
 	} else {
+		ima_delta = 0;
+
 		if (!stat(IMA_FILENAME, &st))
 			rc = attest_ctx_data_add_file(d_ctx, CTX_EVENT_LOG,
 						      IMA_FILENAME, "ima");
@@ -427,6 +1028,11 @@ static int collect_data(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 		goto out;
 
 	rc = attest_event_log_parse_verify(d_ctx, v_ctx, 1);
+	if (rc)
+		goto out;
+
+	if (ima_delta)
+		rc = ima_delta_write_state(v_ctx, &ima_delta_state);
 out:
 	if (rc)
 		printf("Failed to collect data, rc: %d\n", rc);
@@ -434,6 +1040,42 @@ out:
 	return rc;
 }
 
+/**
+ * Mark the IMA event log sent with the last quote as verified
+ *
+ * The next quote requested with IMA delta enabled includes only the new
+ * measurements. Call this function only when the verifier accepted the quote,
+ * otherwise the next quote starts again from the previous part of the log.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_ima_delta_commit(void)
+{
+	if (rename(IMA_DELTA_STATE_NEW_PATH, IMA_DELTA_STATE_PATH) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Forget the IMA event log sent with previous quotes
+ *
+ * Call this function when the verifier rejected a quote with a part of the
+ * IMA event log with -IMA_DELTA_UNKNOWN_POS, because it does not know the PCR
+ * value that part starts from. The next quote includes the whole log.
+ *
+ * @returns 0 on success, -ENOENT if no part of the log was sent before
+ */
+int attest_enroll_ima_delta_reset(void)
+{
+	unlink(IMA_DELTA_STATE_NEW_PATH);
+
+	if (unlink(IMA_DELTA_STATE_PATH) < 0)
+		return -errno;
+
+	return 0;
+}
+
 static int build_key_policy(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 			    void *tssContext, TPMI_ALG_HASH nalg,
 			    TPMI_ALG_HASH halg, int *pcr_list,
@@ -442,12 +1084,13 @@ static int build_key_policy(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 			    BYTE **policy_bin)
 {
 	TPML_PCR_SELECTION selection = { 0 };
-	TPMT_HA *pcr, digest_pcr, digest_event_log;
+	TPMT_HA *pcr_bank, digest_pcr, digest_event_log;
 	attest_ctx_verifier *v_ctx_pcr;
 	BYTE *policy_ptr;
 	char *policy_str;
 	UINT16 written;
 	TPM_CC code = TPM_CC_PolicyPCR;
+	uint32_t pcr_mask = 0;
 	int rc, i, max_len;
 
 	max_len = sizeof(INT32) + sizeof(TPML_PCR_SELECTION) +
@@ -481,16 +1124,21 @@ static int build_key_policy(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx,
 
 		selection.pcrSelections[0].pcrSelect[pcr_list[i] / 8] |=
 							1 << (pcr_list[i] % 8);
+		pcr_mask |= 1 << pcr_list[i];
+	}
 
-		if (!kernel_event_logs)
-			continue;
-
-		pcr = attest_pcr_get(v_ctx_pcr, pcr_list[i], halg);
+	if (kernel_event_logs) {
+		pcr_bank = attest_pcr_get(v_ctx_pcr, 0, halg);
+		if (!pcr_bank) {
+			rc = -ENOENT;
+			goto out;
+		}
 
-		rc = attest_tss_pcrread(tssContext, pcr_list[i], halg,
-					(uint8_t *)&pcr->digest);
+		/* all selected PCRs are read with the minimum number of commands */
+		rc = attest_tss_pcrread_multi(tssContext, halg, pcr_mask,
+					      pcr_bank);
 		if (rc < 0)
-			break;
+			goto out;
 	}
 
 	rc = attest_pcr_calc_digest(v_ctx, &digest_event_log, &selection);
@@ -736,51 +1384,36 @@ int attest_enroll_add_quote(attest_ctx_data *d_ctx, TSS_CONTEXT *tssContext,
 			    char *akPrivPath, char *akPubPath, int nonce_len,
 			    uint8_t *nonce, TPML_PCR_SELECTION *pcr_selection)
 {
-	BYTE *ak_private = NULL, *ak_public = NULL, *tpms_attest = NULL;
-	BYTE *tpms_attest_sig = NULL;
-	size_t ak_private_len = 0, ak_public_len = 0;
+	BYTE *ak_public, *tpms_attest = NULL, *tpms_attest_sig = NULL;
+	size_t ak_public_len;
 	UINT16 tpms_attest_len = 0, tpms_attest_sig_len = 0;
 	TPM_HANDLE ak_handle;
 	int rc;
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
-	if (rc < 0)
-		return -EINVAL;
-
-	rc = attest_util_read_file(akPrivPath, &ak_private_len, &ak_private);
-	if (rc)
-		goto out;
-
-	rc = attest_util_read_file(akPubPath, &ak_public_len, &ak_public);
+	rc = attest_enroll_session_ak(tssContext, akPrivPath, akPubPath,
+				      &ak_handle, &ak_public_len, &ak_public);
 	if (rc)
-		goto out;
-
-	rc = attest_tss_load(tssContext, ak_private_len, ak_private,
-			     ak_public_len, ak_public, &ak_handle);
-	if (rc)
-		goto out;
+		return rc;
 
 	rc = attest_tss_quote(tssContext, ak_handle, ak_public_len, ak_public,
 			      nonce_len, nonce, pcr_selection, &tpms_attest_len,
 			      &tpms_attest, &tpms_attest_sig_len,
 			      &tpms_attest_sig);
 	if (rc)
-		goto out_flush;
+		return rc;
 
 	rc = attest_ctx_data_add(d_ctx, CTX_TPMS_ATTEST, tpms_attest_len,
 				 tpms_attest, NULL);
-	if (rc)
-		goto out_flush;
+	if (rc) {
+		free(tpms_attest);
+		free(tpms_attest_sig);
+		return rc;
+	}
 
 	rc = attest_ctx_data_add(d_ctx, CTX_TPMS_ATTEST_SIG,
 				 tpms_attest_sig_len, tpms_attest_sig, NULL);
-out_flush:
-	attest_tss_flushcontext(tssContext, ak_handle);
-out:
-	if (ak_private)
-		munmap(ak_private, ak_private_len);
-	if (ak_public)
-		munmap(ak_public, ak_public_len);
+	if (rc)
+		free(tpms_attest_sig);
 
 	return rc;
 }
@@ -848,9 +1481,9 @@ int attest_enroll_create_sym_key(int kernel_bios_log, int kernel_ima_log,
 	pcr_alg = attest_pcr_bank_alg_from_name(pcr_alg_name,
 						strlen(pcr_alg_name));
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
+	rc = attest_enroll_session_tss(&tssContext);
 	if (rc < 0)
-		return -EINVAL;
+		return rc;
 
 	attest_ctx_data_init(&d_ctx);
 	attest_ctx_verifier_init(&v_ctx);
@@ -859,7 +1492,7 @@ int attest_enroll_create_sym_key(int kernel_bios_log, int kernel_ima_log,
 	if (rc < 0)
 		goto out;
 
-	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log, 0);
+	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log, 0, 0);
 	if (rc < 0)
 		goto out;
 
@@ -899,18 +1532,159 @@ int attest_enroll_create_sym_key(int kernel_bios_log, int kernel_ima_log,
 	rc = attest_util_write_file(SYM_KEY_POLICY_PATH, policy_item->len,
 				    policy_item->data, 0);
 out:
-	TSS_Delete(tssContext);
-	tssContext = NULL;
+	if (policy_bin)
+		free(policy_bin);
+
+	attest_ctx_data_cleanup(d_ctx);
+	attest_ctx_verifier_cleanup(v_ctx);
+
+	return rc;
+}
+
+static int attest_enroll_certify_key(TSS_CONTEXT *tssContext,
+				     char *keyPrivPath, char *keyPubPath,
+				     UINT16 *certify_info_len,
+				     BYTE **certify_info,
+				     UINT16 *signature_len, BYTE **signature)
+{
+	BYTE *key_private = NULL, *key_public = NULL, *ak_public;
+	size_t key_private_len, key_public_len, ak_public_len;
+	TPM_HANDLE keyHandle, signHandle;
+	int rc;
+
+	rc = attest_enroll_session_ak(tssContext, AK_PRIV_PATH, AK_PUB_PATH,
+				      &signHandle, &ak_public_len, &ak_public);
+	if (rc)
+		return rc;
+
+	rc = attest_util_read_file(keyPrivPath, &key_private_len, &key_private);
+	if (rc)
+		goto out;
+
+	rc = attest_util_read_file(keyPubPath, &key_public_len, &key_public);
+	if (rc)
+		goto out;
+
+	rc = attest_tss_load(tssContext, key_private_len, key_private,
+			     key_public_len, key_public, &keyHandle);
+	if (rc)
+		goto out;
+
+	rc = attest_tss_certify(tssContext, keyHandle, signHandle, TPM_ALG_RSA,
+				HASH_ALG_AK, certify_info_len, certify_info,
+				signature_len, signature);
+
+	attest_tss_flushcontext(tssContext, keyHandle);
+out:
+	if (key_private)
+		munmap(key_private, key_private_len);
+	if (key_public)
+		munmap(key_public, key_public_len);
+
+	return rc;
+}
+
+/**
+ * Generate keys in advance, so that requests do not wait for the TPM
+ * @param[in] kernel_bios_log	take or not the current BIOS event log
+ * @param[in] kernel_ima_log	take or not the current IMA event log
+ * @param[in] pcr_alg_name	PCR algorithm name
+ * @param[in] pcr_list_str	list of PCRs to use for auth policy
+ * @param[in] pool_size		number of keys to keep for each template
+ *
+ * TLS keys are bound to the PCR policy calculated when this function is
+ * called, and are used by a key certificate request only if the policy
+ * calculated for the request is the same. They are not generated if the
+ * policy includes PCRs extended at run-time, and keys bound to a previous
+ * policy are removed.
+ *
+ * The TSS context is released before returning, so that the TPM is available
+ * to other applications between two calls.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_key_pool_fill(int kernel_bios_log, int kernel_ima_log,
+				char *pcr_alg_name, char *pcr_list_str,
+				int pool_size)
+{
+	attest_ctx_data *d_ctx = NULL;
+	attest_ctx_verifier *v_ctx = NULL;
+	TSS_CONTEXT *tssContext = NULL;
+	UINT16 policy_bin_len = 0;
+	BYTE *policy_bin = NULL;
+	int pcr_list[IMPLEMENTATION_PCR];
+	TPM_ALG_ID pcr_alg = PCR_ALG;
+	int rc, i, volatile_pcrs = 0;
+
+	if (pool_size < 0 || pool_size > KEY_POOL_MAX_SIZE)
+		return -EINVAL;
+
+	for (i = 0; i < IMPLEMENTATION_PCR; i++)
+		pcr_list[i] = -1;
+
+	if (pcr_list_str) {
+		rc = attest_util_parse_pcr_list(pcr_list_str,
+					sizeof(pcr_list) / sizeof(*pcr_list),
+					pcr_list);
+		if (rc < 0)
+			return rc;
+	}
+
+	for (i = 0; i < IMPLEMENTATION_PCR; i++)
+		if (pcr_list[i] != -1 &&
+		    (KEY_POOL_VOLATILE_PCRS & (1 << pcr_list[i])))
+			volatile_pcrs = 1;
+
+	pcr_alg = attest_pcr_bank_alg_from_name(pcr_alg_name,
+						strlen(pcr_alg_name));
+
+	if (mkdir(KEY_POOL_DIR, 0700) < 0 && errno != EEXIST)
+		return -errno;
+
+	rc = TSS_Create(&tssContext);
+	if (rc)
+		return -EINVAL;
+
+	if (volatile_pcrs) {
+		/* the policy changes too often to find matching requests */
+		attest_enroll_key_pool_prune(KEY_TYPE_ASYM_DEC, NULL);
+		goto out_ak;
+	}
+
+	attest_ctx_data_init(&d_ctx);
+	attest_ctx_verifier_init(&v_ctx);
+
+	rc = attest_pcr_init(v_ctx);
+	if (rc < 0)
+		goto out;
+
+	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log, 0, 0);
+	if (rc < 0)
+		goto out;
+
+	rc = build_key_policy(d_ctx, v_ctx, tssContext, NAME_ALG_KEY, pcr_alg,
+			      pcr_list, sizeof(pcr_list) / sizeof(*pcr_list),
+			      CTX_TPM_KEY_POLICY,
+			      (kernel_bios_log && kernel_ima_log),
+			      &policy_bin_len, &policy_bin);
+	if (rc < 0)
+		goto out;
 
+	rc = attest_enroll_key_pool_add(tssContext, KEY_TYPE_ASYM_DEC,
+					NAME_ALG_KEY, HASH_ALG_KEY,
+					policy_bin_len, policy_bin, pool_size);
+	if (rc < 0)
+		goto out;
+out_ak:
+	rc = attest_enroll_key_pool_add(tssContext, KEY_TYPE_AK, NAME_ALG_AK,
+					HASH_ALG_AK, 0, NULL, pool_size);
+out:
 	if (policy_bin)
 		free(policy_bin);
 
-	if (tssContext)
-		TSS_Delete(tssContext);
-
 	attest_ctx_data_cleanup(d_ctx);
 	attest_ctx_verifier_cleanup(v_ctx);
-
+	TSS_Delete(tssContext);
 	return rc;
 }
 
@@ -925,18 +1699,17 @@ int attest_enroll_generate_ak(void)
 	void *tssContext;
 	int rc;
 
-	attest_ctx_data_init(&d_ctx);
-
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
+	rc = attest_enroll_session_tss(&tssContext);
 	if (rc)
-		return -EINVAL;
+		return rc;
+
+	attest_ctx_data_init(&d_ctx);
 
 	rc = attest_enroll_add_key(d_ctx, tssContext, AK_PRIV_PATH, AK_PUB_PATH,
 				   KEY_TYPE_AK, NAME_ALG_AK, HASH_ALG_AK, 0,
 				   NULL);
 
 	attest_ctx_data_cleanup(d_ctx);
-	TSS_Delete(tssContext);
 	return rc;
 }
 
@@ -964,34 +1737,31 @@ int attest_enroll_msg_ak_challenge_request(char *ek_ca_dir,
 
 	attest_ctx_data_init(&d_ctx);
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
-	if (rc) {
-		rc = -EINVAL;
+	rc = attest_enroll_session_tss(&tssContext);
+	if (rc)
 		goto out;
-	}
 
 	rc = attest_enroll_add_ek_cert(d_ctx, tssContext);
 	if (rc)
-		goto out_tss;
+		goto out;
 
 	rc = attest_ctx_data_add_dir(d_ctx, CTX_EK_CA_CERT, ek_ca_dir, NULL);
 	if (rc < 0)
-		goto out_tss;
+		goto out;
 
 	rc = attest_enroll_add_key(d_ctx, tssContext, AK_PRIV_PATH, AK_PUB_PATH,
 				   KEY_TYPE_AK, NAME_ALG_AK, HASH_ALG_AK, 0,
 				   NULL);
 	if (rc)
-		goto out_tss;
+		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx, client_session.msg_fmt,
+				       message_out);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
 	free(message_out_stripped);
 #endif
-out_tss:
-	TSS_Delete(tssContext);
 out:
 	attest_ctx_data_cleanup(d_ctx);
 	return rc;
@@ -1016,15 +1786,14 @@ int attest_enroll_msg_ak_cert_request(char *message_in, char* hostname,
 	void *tssContext;
 	int rc;
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
+	rc = attest_enroll_session_tss(&tssContext);
 	if (rc)
-		return -EINVAL;
+		return rc;
 
 	attest_ctx_data_init(&d_ctx);
 	attest_ctx_data_init(&d_ctx_cred);
 
-	rc = attest_ctx_data_add_json_data(d_ctx, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -1043,14 +1812,14 @@ int attest_enroll_msg_ak_cert_request(char *message_in, char* hostname,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx_cred, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx_cred, client_session.msg_fmt,
+				       message_out);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx_cred, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
 	free(message_out_stripped);
 #endif
 out:
-	TSS_Delete(tssContext);
 	attest_ctx_data_cleanup(d_ctx);
 	attest_ctx_data_cleanup(d_ctx_cred);
 
@@ -1074,8 +1843,7 @@ int attest_enroll_msg_ak_cert_response(char *message_in)
 
 	attest_ctx_data_init(&d_ctx);
 
-	rc = attest_ctx_data_add_json_data(d_ctx, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -1149,9 +1917,9 @@ int attest_enroll_msg_key_cert_request(int kernel_bios_log, int kernel_ima_log,
 	pcr_alg = attest_pcr_bank_alg_from_name(pcr_alg_name,
 						strlen(pcr_alg_name));
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
+	rc = attest_enroll_session_tss(&tssContext);
 	if (rc < 0)
-		return -EINVAL;
+		return rc;
 
 	attest_ctx_data_init(&d_ctx);
 	attest_ctx_verifier_init(&v_ctx);
@@ -1161,7 +1929,7 @@ int attest_enroll_msg_key_cert_request(int kernel_bios_log, int kernel_ima_log,
 		goto out;
 
 	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log,
-			  send_unsigned_files);
+			  send_unsigned_files, 0);
 	if (rc < 0)
 		goto out;
 
@@ -1195,17 +1963,13 @@ int attest_enroll_msg_key_cert_request(int kernel_bios_log, int kernel_ima_log,
 	attest_ctx_data_add_file(d_ctx, CTX_SYM_KEY_POLICY, SYM_KEY_POLICY_PATH,
 				 NULL);
 
-	rc = attest_tss_load_certify(tssContext, AK_PRIV_PATH, AK_PUB_PATH,
-				     TLS_KEY_PRIV_PATH, TLS_KEY_PUB_PATH,
-				     TPM_ALG_RSA, HASH_ALG_AK,
-				     &certify_info_len, &certify_info,
-				     &signature_len, &signature);
+	rc = attest_enroll_certify_key(tssContext, TLS_KEY_PRIV_PATH,
+				       TLS_KEY_PUB_PATH, &certify_info_len,
+				       &certify_info, &signature_len,
+				       &signature);
 	if (rc < 0)
 		goto out;
 
-	TSS_Delete(tssContext);
-	tssContext = NULL;
-
 	if (attest_data) {
 		rc = attest_ctx_data_print_json(d_ctx, attest_data);
 		if (rc < 0)
@@ -1218,7 +1982,8 @@ int attest_enroll_msg_key_cert_request(int kernel_bios_log, int kernel_ima_log,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx, client_session.msg_fmt,
+				       message_out);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
@@ -1232,9 +1997,6 @@ out:
 	if (policy_bin)
 		free(policy_bin);
 
-	if (tssContext)
-		TSS_Delete(tssContext);
-
 	attest_ctx_data_cleanup(d_ctx);
 	attest_ctx_verifier_cleanup(v_ctx);
 
@@ -1258,8 +2020,7 @@ int attest_enroll_msg_key_cert_response(char *message_in)
 
 	attest_ctx_data_init(&d_ctx);
 
-	rc = attest_ctx_data_add_json_data(d_ctx, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -1310,7 +2071,8 @@ int attest_enroll_msg_quote_nonce_request(char **message_out)
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx, client_session.msg_fmt,
+				       message_out);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
@@ -1323,74 +2085,71 @@ out:
 }
 
 /**
- * Parse a quote nonce response
+ * Collect the part of a quote request that does not depend on the nonce
  * @param[in] privacy_ca_dir	Directory containing Privacy CA certificates
  * @param[in] kernel_bios_log	take or not the current BIOS event log
  * @param[in] kernel_ima_log	take or not the current IMA event log
- * @param[in] pcr_alg_name	Selected PCR bank
- * @param[in] pcr_list_str	String containing selected PCRs
- * @param[in] skip_sig_ver	skip signature verification
  * @param[in] send_unsigned_files	Send unsigned files to verifier
- * @param[in] message_in	Input message
- * @param[in,out] message_out	Output message
+ * @param[in] ima_delta	send only IMA measurements not yet verified
+ * @param[in,out] evidence	Data context with collected evidence
+ *
+ * The TPM is not accessed, so that evidence can be collected while the quote
+ * nonce request is being processed by the server. The AK certificate is not
+ * added, as the server takes it from the quote nonce request sent on the same
+ * connection. Servers that don't negotiate the protocol version close the
+ * connection after each response, the caller must add the AK certificate for
+ * them. The data context must be freed with attest_ctx_data_cleanup().
  *
  * @returns 0 on success, a negative value on error
  */
-int attest_enroll_msg_quote_request(char *privacy_ca_dir, int kernel_bios_log,
-				    int kernel_ima_log, char *pcr_alg_name,
-				    char *pcr_list_str, int skip_sig_ver,
-				    int send_unsigned_files, char *message_in,
-				    char **message_out)
+int attest_enroll_msg_quote_evidence(char *privacy_ca_dir, int kernel_bios_log,
+				     int kernel_ima_log,
+				     int send_unsigned_files, int ima_delta,
+				     attest_ctx_data **evidence)
 {
-#ifdef DEBUG
-	char *message_in_stripped;
-	char *message_out_stripped;
-#endif
-	void *tssContext;
-	uint8_t *nonce;
 	attest_ctx_data *d_ctx;
 	attest_ctx_verifier *v_ctx;
-	int pcr_list[IMPLEMENTATION_PCR];
-	TPML_PCR_SELECTION selection = { 0 };
-	TPM_ALG_ID pcr_alg = PCR_ALG;
-	int rc, i, nonce_len;
+	int rc;
+
+	rc = attest_ctx_data_init(&d_ctx);
+	if (rc < 0)
+		return rc;
 
-	attest_ctx_data_init(&d_ctx);
 	attest_ctx_verifier_init(&v_ctx);
 
 	rc = attest_pcr_init(v_ctx);
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_add_json_data(d_ctx, message_in,
-					   strlen(message_in));
-	if (rc < 0)
-		goto out;
-#ifdef DEBUG
-	attest_ctx_data_print_json_no_value(d_ctx, &message_in_stripped);
-	printf("<- %s\n", message_in_stripped);
-	free(message_in_stripped);
-#endif
-	rc = attest_ctx_data_json_get_by_field(message_in, CTX_NONCE,
-					       &nonce_len, &nonce);
-	if (rc < 0)
-		goto out;
-
 	rc = attest_ctx_data_add_dir(d_ctx, CTX_PRIVACY_CA_CERT, privacy_ca_dir,
 				     NULL);
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_add_file(d_ctx, CTX_AK_CERT, AK_CERT_PATH, NULL);
-	if (rc < 0)
-		goto out;
-
 	attest_ctx_data_add_file(d_ctx, CTX_SYM_KEY_POLICY, SYM_KEY_POLICY_PATH,
 				 NULL);
 
-	rc = TSS_Create((TSS_CONTEXT **)&tssContext);
+	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log,
+			  send_unsigned_files, ima_delta);
+out:
 	if (rc < 0)
-		goto out;
+		attest_ctx_data_cleanup(d_ctx);
+	else
+		*evidence = d_ctx;
+
+	attest_ctx_verifier_cleanup(v_ctx);
+	return rc;
+}
+
+static int quote_pcr_selection(char *pcr_alg_name, char *pcr_list_str,
+			       TPML_PCR_SELECTION *selection)
+{
+	int pcr_list[IMPLEMENTATION_PCR];
+	TPMS_PCR_SELECTION *bank;
+	char *alg_name = pcr_alg_name, *alg_name_end;
+	int max_banks = sizeof(selection->pcrSelections) /
+			sizeof(*selection->pcrSelections);
+	int rc, i, alg_name_len, bank_id, bank_mask = 0;
 
 	for (i = 0; i < IMPLEMENTATION_PCR; i++)
 		pcr_list[i] = -1;
@@ -1400,45 +2159,364 @@ int attest_enroll_msg_quote_request(char *privacy_ca_dir, int kernel_bios_log,
 					sizeof(pcr_list) / sizeof(*pcr_list),
 					pcr_list);
 		if (rc < 0)
-			goto out_ctx;
+			return rc;
 	}
 
-	pcr_alg = attest_pcr_bank_alg_from_name(pcr_alg_name,
-						strlen(pcr_alg_name));
+	selection->count = 0;
 
-	selection.count = 1;
-	selection.pcrSelections[0].sizeofSelect = 3;
-	selection.pcrSelections[0].hash = pcr_alg;
+	/* banks separated by comma are quoted together */
+	while (1) {
+		if (selection->count == max_banks)
+			return -E2BIG;
 
-	for (i = 0; i < IMPLEMENTATION_PCR; i++) {
-		if (pcr_list[i] == -1)
-			continue;
+		alg_name_end = strchr(alg_name, ',');
+		alg_name_len = alg_name_end ? alg_name_end - alg_name :
+					      strlen(alg_name);
 
-		selection.pcrSelections[0].pcrSelect[pcr_list[i] / 8] |=
+		bank_id = attest_pcr_bank_from_name(alg_name, alg_name_len);
+		if (bank_id == PCR_BANK__LAST) {
+			printf("Unknown PCR bank %.*s\n", alg_name_len,
+			       alg_name);
+			return -EINVAL;
+		}
+
+		/* a bank can be selected only once */
+		if (bank_mask & (1 << bank_id))
+			return -EINVAL;
+
+		bank_mask |= (1 << bank_id);
+
+		bank = &selection->pcrSelections[selection->count++];
+		bank->sizeofSelect = 3;
+		bank->hash = attest_pcr_bank_alg(bank_id);
+		memset(bank->pcrSelect, 0, sizeof(bank->pcrSelect));
+
+		for (i = 0; i < IMPLEMENTATION_PCR; i++) {
+			if (pcr_list[i] == -1)
+				continue;
+
+			bank->pcrSelect[pcr_list[i] / 8] |=
 							1 << (pcr_list[i] % 8);
+		}
+
+		if (!alg_name_end)
+			break;
+
+		alg_name = alg_name_end + 1;
 	}
 
-	rc = attest_enroll_add_quote(d_ctx, tssContext, AK_PRIV_PATH,
-				     AK_PUB_PATH, nonce_len, nonce, &selection);
+	return 0;
+}
+
+/**
+ * Parse a quote nonce response and add the quote to collected evidence
+ * @param[in] evidence		Output of attest_enroll_msg_quote_evidence()
+ * @param[in] pcr_alg_name	Selected PCR bank
+ * @param[in] pcr_list_str	String containing selected PCRs
+ * @param[in] message_in	Input message
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_msg_quote_finish(attest_ctx_data *evidence,
+				   char *pcr_alg_name, char *pcr_list_str,
+				   char *message_in)
+{
+#ifdef DEBUG
+	char *message_in_stripped;
+	char *message_out_stripped;
+#endif
+	attest_ctx_data *d_ctx = evidence;
+	struct data_item *nonce;
+	void *tssContext;
+	TPML_PCR_SELECTION selection = { 0 };
+	int rc;
+
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
 	if (rc < 0)
-		goto out;
+		return rc;
+#ifdef DEBUG
+	attest_ctx_data_print_json_no_value(d_ctx, &message_in_stripped);
+	printf("<- %s\n", message_in_stripped);
+	free(message_in_stripped);
+#endif
+	nonce = attest_ctx_data_get(d_ctx, CTX_NONCE);
+	if (!nonce)
+		return -ENOENT;
 
-	rc = collect_data(d_ctx, v_ctx, kernel_bios_log, kernel_ima_log,
-			  send_unsigned_files);
+	rc = attest_enroll_session_tss(&tssContext);
+	if (rc < 0)
+		return rc;
+
+	rc = quote_pcr_selection(pcr_alg_name, pcr_list_str, &selection);
 	if (rc < 0)
-		goto out_ctx;
+		return rc;
 
-	rc = attest_ctx_data_print_json(d_ctx, message_out);
+	rc = attest_enroll_add_quote(d_ctx, tssContext, AK_PRIV_PATH,
+				     AK_PUB_PATH, nonce->len, nonce->data,
+				     &selection);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
 	free(message_out_stripped);
 #endif
-out_ctx:
-	TSS_Delete(tssContext);
+	return rc;
+}
+
+static const enum ctx_fields quote_batch_fields[] = {
+	CTX_NONCE, CTX_NONCE_HMAC, CTX_NONCE_PROOF
+};
+
+/**
+ * Free the nonces of a batch quote
+ * @param[in] batch	nonces of the verifiers
+ */
+void attest_enroll_quote_batch_free(struct attest_enroll_quote_batch *batch)
+{
+	int i;
+
+	if (!batch)
+		return;
+
+	for (i = 0; i < batch->num; i++)
+		attest_ctx_data_cleanup(batch->nonces[i]);
+
+	free(batch->nonces);
+	free(batch);
+}
+
+/**
+ * Parse quote nonce responses of several verifiers and add a single quote
+ * to collected evidence
+ * @param[in] evidence		Output of attest_enroll_msg_quote_evidence()
+ * @param[in] pcr_alg_name	Selected PCR bank
+ * @param[in] pcr_list_str	String containing selected PCRs
+ * @param[in] num_messages	Number of quote nonce responses
+ * @param[in] messages_in	Quote nonce responses
+ * @param[in,out] batch		nonces of the verifiers
+ *
+ * The quote is over the root of a Merkle tree of the nonces, so that the TPM
+ * is accessed once regardless of the number of verifiers. The nonce, the
+ * nonce HMAC and the inclusion proof of a verifier must be added to the
+ * evidence with attest_enroll_quote_batch_select() before sending it. The
+ * batch must be freed with attest_enroll_quote_batch_free().
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_msg_quote_batch_finish(attest_ctx_data *evidence,
+				char *pcr_alg_name, char *pcr_list_str,
+				int num_messages, char *messages_in[],
+				struct attest_enroll_quote_batch **batch)
+{
+	struct attest_enroll_quote_batch *new_batch;
+	struct data_item *nonce;
+	const uint8_t **leaves = NULL;
+	size_t *leaf_lens = NULL, proof_len;
+	uint8_t root[MERKLE_HASH_LEN], *proof;
+	TPML_PCR_SELECTION selection = { 0 };
+	void *tssContext;
+	int rc = -ENOMEM, i;
+
+	if (num_messages < 1)
+		return -EINVAL;
+
+	new_batch = calloc(1, sizeof(*new_batch));
+	if (!new_batch)
+		return -ENOMEM;
+
+	new_batch->nonces = calloc(num_messages, sizeof(*new_batch->nonces));
+	leaves = calloc(num_messages, sizeof(*leaves));
+	leaf_lens = calloc(num_messages, sizeof(*leaf_lens));
+	if (!new_batch->nonces || !leaves || !leaf_lens)
+		goto out;
+
+	for (i = 0; i < num_messages; i++) {
+		rc = attest_ctx_data_init(&new_batch->nonces[i]);
+		if (rc < 0)
+			goto out;
+
+		new_batch->num++;
+
+		rc = attest_ctx_data_add_msg(new_batch->nonces[i],
+					     messages_in[i]);
+		if (rc < 0)
+			goto out;
+
+		nonce = attest_ctx_data_get(new_batch->nonces[i], CTX_NONCE);
+		if (!nonce) {
+			rc = -ENOENT;
+			goto out;
+		}
+
+		leaves[i] = nonce->data;
+		leaf_lens[i] = nonce->len;
+	}
+
+	for (i = 0; i < num_messages; i++) {
+		rc = attest_util_merkle_proof(num_messages, leaves, leaf_lens,
+					      i, root, &proof_len, &proof);
+		if (rc < 0)
+			goto out;
+
+		rc = attest_ctx_data_add(new_batch->nonces[i], CTX_NONCE_PROOF,
+					 proof_len, proof, NULL);
+		if (rc < 0) {
+			free(proof);
+			goto out;
+		}
+	}
+
+	rc = attest_enroll_session_tss(&tssContext);
+	if (rc < 0)
+		goto out;
+
+	rc = quote_pcr_selection(pcr_alg_name, pcr_list_str, &selection);
+	if (rc < 0)
+		goto out;
+
+	rc = attest_enroll_add_quote(evidence, tssContext, AK_PRIV_PATH,
+				     AK_PUB_PATH, sizeof(root), root,
+				     &selection);
+	if (rc < 0)
+		goto out;
+
+	/* replaced by attest_enroll_quote_batch_select() */
+	for (i = 0; i < ARRAY_SIZE(quote_batch_fields); i++) {
+		rc = attest_ctx_data_add_copy(evidence, quote_batch_fields[i],
+					      sizeof(root), root, NULL);
+		if (rc < 0)
+			goto out;
+	}
+out:
+	free(leaves);
+	free(leaf_lens);
+
+	if (rc < 0)
+		attest_enroll_quote_batch_free(new_batch);
+	else
+		*batch = new_batch;
+
+	return rc;
+}
+
+/**
+ * Add the nonce of a verifier to evidence with a batch quote
+ * @param[in] batch		nonces of the verifiers
+ * @param[in] evidence		Output of attest_enroll_msg_quote_batch_finish()
+ * @param[in] index		verifier index
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_quote_batch_select(struct attest_enroll_quote_batch *batch,
+				     attest_ctx_data *evidence, int index)
+{
+	struct data_item *src, *dest;
+	unsigned char *data;
+	int i;
+
+	if (index < 0 || index >= batch->num)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(quote_batch_fields); i++) {
+		src = attest_ctx_data_get(batch->nonces[index],
+					  quote_batch_fields[i]);
+		dest = attest_ctx_data_get(evidence, quote_batch_fields[i]);
+		if (!src || !dest)
+			return -ENOENT;
+
+		data = malloc(src->len);
+		if (!data)
+			return -ENOMEM;
+
+		memcpy(data, src->data, src->len);
+		free(dest->data);
+		dest->data = data;
+		dest->len = src->len;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a quote nonce response
+ * @param[in] privacy_ca_dir	Directory containing Privacy CA certificates
+ * @param[in] kernel_bios_log	take or not the current BIOS event log
+ * @param[in] kernel_ima_log	take or not the current IMA event log
+ * @param[in] pcr_alg_name	Selected PCR bank
+ * @param[in] pcr_list_str	String containing selected PCRs
+ * @param[in] skip_sig_ver	skip signature verification
+ * @param[in] send_unsigned_files	Send unsigned files to verifier
+ * @param[in] ima_delta	send only IMA measurements not yet verified
+ * @param[in] message_in	Input message
+ * @param[in,out] message_out	Output message
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_msg_quote_request(char *privacy_ca_dir, int kernel_bios_log,
+				    int kernel_ima_log, char *pcr_alg_name,
+				    char *pcr_list_str, int skip_sig_ver,
+				    int send_unsigned_files, int ima_delta,
+				    char *message_in, char **message_out)
+{
+	attest_ctx_data *evidence;
+	int rc;
+
+	rc = attest_enroll_msg_quote_evidence(privacy_ca_dir, kernel_bios_log,
+					      kernel_ima_log,
+					      send_unsigned_files, ima_delta,
+					      &evidence);
+	if (rc < 0)
+		return rc;
+
+	rc = attest_ctx_data_add_file(evidence, CTX_AK_CERT, AK_CERT_PATH,
+				      NULL);
+	if (!rc)
+		rc = attest_enroll_msg_quote_finish(evidence, pcr_alg_name,
+						    pcr_list_str, message_in);
+	if (!rc)
+		rc = attest_ctx_data_print_msg(evidence,
+					       client_session.msg_fmt,
+					       message_out);
+
+	attest_ctx_data_cleanup(evidence);
+	return rc;
+}
+
+/**
+ * Parse a quote response
+ * @param[in] message_in	message containing the quote response
+ * @param[in] token_path	path of the attestation token (can be NULL)
+ *
+ * The attestation token is written only if the server issued it.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_enroll_msg_quote_response(char *message_in, char *token_path)
+{
+	attest_ctx_data *d_ctx = NULL;
+	struct data_item *item;
+	int rc;
+
+	/* the server does not issue tokens */
+	if (!token_path || !*message_in)
+		return 0;
+
+	rc = attest_ctx_data_init(&d_ctx);
+	if (rc < 0)
+		return rc;
+
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
+	if (rc < 0)
+		goto out;
+
+	item = attest_ctx_data_get(d_ctx, CTX_ATTEST_TOKEN);
+	if (!item) {
+		rc = -ENOENT;
+		goto out;
+	}
+
+	rc = attest_util_write_file(token_path, item->len, item->data, 0);
 out:
 	attest_ctx_data_cleanup(d_ctx);
-	attest_ctx_verifier_cleanup(v_ctx);
 	return rc;
 }
 /** @}*/
@@ -17,6 +17,9 @@
  * @ingroup enroll-api
  * @brief
  * Functions to parse enrollment requests and generate responses for a client.
+ *
+ * These functions are thread-safe. Requests of the same connection must be
+ * processed by one thread at a time, as they share the session.
  * @addtogroup enroll-server-api
  *  @{
  */
@@ -27,15 +30,20 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/wait.h>
 
 #include "ctx_json.h"
+#include "ctx_tlv.h"
 #include "crypto.h"
 #include "skae.h"
 #include "util.h"
 #include "tss.h"
 #include "verifier.h"
 #include "enroll_server.h"
+#include "token.h"
+#include "event_log/ima.h"
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -44,10 +52,91 @@
 #include <ibmtss/ekutils.h>
 #include <ibmtss/cryptoutils.h>
 
-#define NONCE_LEN 32
+#define CTX_POOL_SIZE 16
+#define IMA_DELTA_CACHE_SIZE 1024
+#define IMA_DELTA_CLIENT_RECORDS 2
 
 int verbose;
 
+static pthread_mutex_t sign_csr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Contexts are reset and kept in a pool after a message has been processed,
+ * so that the next message does not create a new temporary directory and
+ * reuses the loaded verifiers, the PCR buffer and the arena memory.
+ */
+static attest_ctx_data *ctx_data_pool[CTX_POOL_SIZE];
+static int ctx_data_pool_num;
+static attest_ctx_verifier *ctx_verifier_pool[CTX_POOL_SIZE];
+static int ctx_verifier_pool_num;
+static pthread_mutex_t ctx_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int attest_enroll_ctx_data_get(attest_ctx_data **ctx)
+{
+	*ctx = NULL;
+
+	pthread_mutex_lock(&ctx_pool_lock);
+	if (ctx_data_pool_num)
+		*ctx = ctx_data_pool[--ctx_data_pool_num];
+	pthread_mutex_unlock(&ctx_pool_lock);
+
+	if (*ctx)
+		return 0;
+
+	return attest_ctx_data_init(ctx);
+}
+
+static void attest_enroll_ctx_data_put(attest_ctx_data *ctx)
+{
+	if (!ctx)
+		return;
+
+	attest_ctx_data_reset(ctx);
+
+	pthread_mutex_lock(&ctx_pool_lock);
+	if (ctx_data_pool_num < CTX_POOL_SIZE) {
+		ctx_data_pool[ctx_data_pool_num++] = ctx;
+		ctx = NULL;
+	}
+	pthread_mutex_unlock(&ctx_pool_lock);
+
+	if (ctx)
+		attest_ctx_data_cleanup(ctx);
+}
+
+static int attest_enroll_ctx_verifier_get(attest_ctx_verifier **ctx)
+{
+	*ctx = NULL;
+
+	pthread_mutex_lock(&ctx_pool_lock);
+	if (ctx_verifier_pool_num)
+		*ctx = ctx_verifier_pool[--ctx_verifier_pool_num];
+	pthread_mutex_unlock(&ctx_pool_lock);
+
+	if (*ctx)
+		return 0;
+
+	return attest_ctx_verifier_init(ctx);
+}
+
+static void attest_enroll_ctx_verifier_put(attest_ctx_verifier *ctx)
+{
+	if (!ctx)
+		return;
+
+	attest_ctx_verifier_reset(ctx);
+
+	pthread_mutex_lock(&ctx_pool_lock);
+	if (ctx_verifier_pool_num < CTX_POOL_SIZE) {
+		ctx_verifier_pool[ctx_verifier_pool_num++] = ctx;
+		ctx = NULL;
+	}
+	pthread_mutex_unlock(&ctx_pool_lock);
+
+	if (ctx)
+		attest_ctx_verifier_cleanup(ctx);
+}
+
 /**
  * Perform HMAC of AK and credential to correlate challenge and certificate reqs
  * @param[in] v_ctx		verifier context
@@ -561,9 +650,10 @@ int attest_enroll_sign_csr(char *caKeyPath, char *caKeyPassword,
 	char pass_arg[64];
 	char subj_arg[128];
 	size_t len;
+	pid_t pid;
 	int rc = -EINVAL, status;
 
-	attest_ctx_data_init(&d_ctx_in);
+	attest_enroll_ctx_data_get(&d_ctx_in);
 
 	snprintf(path_csr, sizeof(path_csr), "%s/csr.pem", d_ctx_in->data_dir);
 	snprintf(path_cert, sizeof(path_cert),
@@ -574,18 +664,24 @@ int attest_enroll_sign_csr(char *caKeyPath, char *caKeyPassword,
 	rc = attest_util_write_file(path_csr, strlen(csr_str),
 				    (uint8_t *)csr_str, 0);
 	if (rc < 0)
-		return rc;
+		goto out;
 
 	attest_enroll_merge_subject(path_csr, caCertPath, sizeof(subj_arg), subj_arg);
 
-	if (!fork())
-		return execlp("openssl", "openssl", "ca", "-cert", caCertPath,
-			      "-keyfile", caKeyPath, "-passin", pass_arg,
-			      "-in", path_csr, "-out", path_cert, "-batch",
-			      "-subj", subj_arg, "-name", openssl_ca_section,
-			      NULL);
+	/* the CA database is updated by one openssl process at a time */
+	pthread_mutex_lock(&sign_csr_lock);
+	pid = fork();
+	if (!pid) {
+		execlp("openssl", "openssl", "ca", "-cert", caCertPath,
+		       "-keyfile", caKeyPath, "-passin", pass_arg,
+		       "-in", path_csr, "-out", path_cert, "-batch",
+		       "-subj", subj_arg, "-name", openssl_ca_section, NULL);
+		_exit(1);
+	}
 
-	wait(&status);
+	if (pid < 0 || waitpid(pid, &status, 0) < 0)
+		status = 1;
+	pthread_mutex_unlock(&sign_csr_lock);
 
 	if (status){
 		rc = -EINVAL;
@@ -597,7 +693,7 @@ out:
 	unlink(path_cert);
 	unlink(path_csr);
 
-	attest_ctx_data_cleanup(d_ctx_in);
+	attest_enroll_ctx_data_put(d_ctx_in);
 
 	return rc;
 }
@@ -632,13 +728,12 @@ int attest_enroll_msg_make_credential(uint8_t *hmac_key, int hmac_key_len,
 	char *logs;
 	int rc;
 
-	attest_ctx_data_init(&d_ctx_in);
-	attest_ctx_data_init(&d_ctx_out);
-	attest_ctx_verifier_init(&v_ctx);
+	attest_enroll_ctx_data_get(&d_ctx_in);
+	attest_enroll_ctx_data_get(&d_ctx_out);
+	attest_enroll_ctx_verifier_get(&v_ctx);
 	attest_ctx_verifier_set_key(v_ctx, hmac_key_len, hmac_key);
 
-	rc = attest_ctx_data_add_json_data(d_ctx_in, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx_in, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -655,7 +750,9 @@ int attest_enroll_msg_make_credential(uint8_t *hmac_key, int hmac_key_len,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx_out, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx_out,
+				       attest_ctx_msg_format(message_in),
+				       message_out);
 	if (rc)
 		goto out;
 #ifdef DEBUG
@@ -664,9 +761,9 @@ int attest_enroll_msg_make_credential(uint8_t *hmac_key, int hmac_key_len,
 	free(message_out_stripped);
 #endif
 out:
-	attest_ctx_data_cleanup(d_ctx_in);
-	attest_ctx_data_cleanup(d_ctx_out);
-	attest_ctx_verifier_cleanup(v_ctx);
+	attest_enroll_ctx_data_put(d_ctx_in);
+	attest_enroll_ctx_data_put(d_ctx_out);
+	attest_enroll_ctx_verifier_put(v_ctx);
 	return rc;
 }
 
@@ -699,13 +796,12 @@ int attest_enroll_msg_make_cert(uint8_t *hmac_key, int hmac_key_len,
 	char *logs;
 	int rc;
 
-	attest_ctx_data_init(&d_ctx_in);
-	attest_ctx_data_init(&d_ctx_out);
-	attest_ctx_verifier_init(&v_ctx);
+	attest_enroll_ctx_data_get(&d_ctx_in);
+	attest_enroll_ctx_data_get(&d_ctx_out);
+	attest_enroll_ctx_verifier_get(&v_ctx);
 	attest_ctx_verifier_set_key(v_ctx, hmac_key_len, hmac_key);
 
-	rc = attest_ctx_data_add_json_data(d_ctx_in, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx_in, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -727,7 +823,9 @@ int attest_enroll_msg_make_cert(uint8_t *hmac_key, int hmac_key_len,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx_out, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx_out,
+				       attest_ctx_msg_format(message_in),
+				       message_out);
 	if (rc)
 		goto out;
 #ifdef DEBUG
@@ -736,9 +834,9 @@ int attest_enroll_msg_make_cert(uint8_t *hmac_key, int hmac_key_len,
 	free(message_out_stripped);
 #endif
 out:
-	attest_ctx_data_cleanup(d_ctx_in);
-	attest_ctx_data_cleanup(d_ctx_out);
-	attest_ctx_verifier_cleanup(v_ctx);
+	attest_enroll_ctx_data_put(d_ctx_in);
+	attest_enroll_ctx_data_put(d_ctx_out);
+	attest_enroll_ctx_verifier_put(v_ctx);
 	return rc;
 }
 
@@ -765,13 +863,12 @@ int attest_enroll_msg_process_csr(int pcr_mask_len, uint8_t *pcr_mask,
 	char *logs;
 	int rc;
 
-	attest_ctx_data_init(&d_ctx_in);
-	attest_ctx_verifier_init(&v_ctx);
+	attest_enroll_ctx_data_get(&d_ctx_in);
+	attest_enroll_ctx_verifier_get(&v_ctx);
 	attest_ctx_verifier_set_pcr_mask(v_ctx, pcr_mask_len, pcr_mask);
 	attest_ctx_verifier_set_flags(v_ctx, verifier_flags);
 
-	rc = attest_ctx_data_add_json_data(d_ctx_in, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx_in, message_in);
 	if (rc < 0)
 		goto out;
 #ifdef DEBUG
@@ -785,8 +882,8 @@ int attest_enroll_msg_process_csr(int pcr_mask_len, uint8_t *pcr_mask,
 	printf("%s\n", logs);
 	free(logs);
 out:
-	attest_ctx_data_cleanup(d_ctx_in);
-	attest_ctx_verifier_cleanup(v_ctx);
+	attest_enroll_ctx_data_put(d_ctx_in);
+	attest_enroll_ctx_verifier_put(v_ctx);
 	return rc;
 }
 
@@ -795,12 +892,13 @@ out:
  *
  * @param[in] cert_str	Signed certificate
  * @param[in] ca_cert_str	CA certificate
+ * @param[in] fmt	Format of the response
  * @param[in,out] message_out	Response for the client
  *
  * @returns 0 on success, a negative value on error
  */
 int attest_enroll_msg_return_cert(char *cert_str, char *ca_cert_str,
-				  char **message_out)
+				  enum ctx_msg_formats fmt, char **message_out)
 {
 	attest_ctx_data *d_ctx_out = NULL;
 #ifdef DEBUG
@@ -808,7 +906,7 @@ int attest_enroll_msg_return_cert(char *cert_str, char *ca_cert_str,
 #endif
 	int rc;
 
-	attest_ctx_data_init(&d_ctx_out);
+	attest_enroll_ctx_data_get(&d_ctx_out);
 
 	rc = attest_ctx_data_add_copy(d_ctx_out, CTX_KEY_CERT, strlen(cert_str),
 				      (uint8_t*)cert_str, NULL);
@@ -820,26 +918,62 @@ int attest_enroll_msg_return_cert(char *cert_str, char *ca_cert_str,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx_out, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx_out, fmt, message_out);
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx_out, &message_out_stripped);
 	printf("-> %s\n", message_out_stripped);
 	free(message_out_stripped);
 #endif
 out:
-	attest_ctx_data_cleanup(d_ctx_out);
+	attest_enroll_ctx_data_put(d_ctx_out);
 	return rc;
 }
 
+static int attest_enroll_session_set_ak_cert(
+					struct attest_enroll_session *session,
+					struct data_item *ak_cert)
+{
+	if (session->ak_cert_len == ak_cert->len &&
+	    !memcmp(session->ak_cert, ak_cert->data, ak_cert->len))
+		return 0;
+
+	free(session->ak_cert);
+	session->ak_cert_len = 0;
+
+	session->ak_cert = malloc(ak_cert->len);
+	if (!session->ak_cert)
+		return -ENOMEM;
+
+	memcpy(session->ak_cert, ak_cert->data, ak_cert->len);
+	session->ak_cert_len = ak_cert->len;
+	return 0;
+}
+
+/**
+ * Free the data of a client session
+ * @param[in] session	Client session
+ */
+void attest_enroll_session_cleanup(struct attest_enroll_session *session)
+{
+	free(session->ak_cert);
+	memset(session, 0, sizeof(*session));
+}
+
 /**
  * Generate a quote nonce response
  * @param[in] hmac_key_len	HMAC key length
  * @param[in] hmac_key		HMAC key to correlate client requests
+ * @param[in] session		Client session (can be NULL)
+ * @param[in] message_in	Message containing quote nonce request
  * @param[in,out] message_out	Message containing quote nonce response
  *
+ * If a session is provided, the AK certificate and the nonce are kept in the
+ * session, so that the quote can be sent without the AK certificate.
+ *
  * @returns 0 on success, a negative value on error
  */
 int attest_enroll_msg_gen_quote_nonce(int hmac_key_len, uint8_t *hmac_key,
+				      struct attest_enroll_session *session,
 				      char *message_in, char **message_out)
 {
 #ifdef DEBUG
@@ -855,16 +989,15 @@ int attest_enroll_msg_gen_quote_nonce(int hmac_key_len, uint8_t *hmac_key,
 	char *logs;
 	int rc;
 
-	attest_ctx_data_init(&d_ctx_in);
-	attest_ctx_data_init(&d_ctx_out);
-	attest_ctx_verifier_init(&v_ctx);
+	attest_enroll_ctx_data_get(&d_ctx_in);
+	attest_enroll_ctx_data_get(&d_ctx_out);
+	attest_enroll_ctx_verifier_get(&v_ctx);
 	attest_ctx_verifier_set_key(v_ctx, hmac_key_len, hmac_key);
 
 	log = attest_ctx_verifier_add_log(v_ctx, "generate quote nonce");
 
-	rc = attest_ctx_data_add_json_data(d_ctx_in, message_in,
-					   strlen(message_in));
-	check_goto(rc, rc, out, v_ctx, "attest_ctx_data_add_json_data() error");
+	rc = attest_ctx_data_add_msg(d_ctx_in, message_in);
+	check_goto(rc, rc, out, v_ctx, "attest_ctx_data_add_msg() error");
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx_in, &message_in_stripped);
 	printf("<- %s\n", message_in_stripped);
@@ -887,6 +1020,11 @@ int attest_enroll_msg_gen_quote_nonce(int hmac_key_len, uint8_t *hmac_key,
 
 	rc = attest_ctx_data_add_copy(d_ctx_out, CTX_NONCE_HMAC, hmac_len,
 				      hmac, NULL);
+	if (!rc && session) {
+		rc = attest_enroll_session_set_ak_cert(session, ak_cert);
+		memcpy(session->nonce, nonce, sizeof(nonce));
+		session->nonce_valid = !rc;
+	}
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx_out, &message_out_stripped);
 	printf("<- %s\n", message_out_stripped);
@@ -895,7 +1033,9 @@ int attest_enroll_msg_gen_quote_nonce(int hmac_key_len, uint8_t *hmac_key,
 	if (rc < 0)
 		goto out;
 
-	rc = attest_ctx_data_print_json(d_ctx_out, message_out);
+	rc = attest_ctx_data_print_msg(d_ctx_out,
+				       attest_ctx_msg_format(message_in),
+				       message_out);
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);
 
@@ -903,9 +1043,273 @@ out:
 	printf("%s\n", logs);
 	free(logs);
 
-	attest_ctx_data_cleanup(d_ctx_in);
-	attest_ctx_data_cleanup(d_ctx_out);
-	attest_ctx_verifier_cleanup(v_ctx);
+	attest_enroll_ctx_data_put(d_ctx_in);
+	attest_enroll_ctx_data_put(d_ctx_out);
+	attest_enroll_ctx_verifier_put(v_ctx);
+	return rc;
+}
+
+/*
+ * Value of the IMA PCR at the end of the IMA event logs verified so far, so
+ * that clients can send only the measurements added after that point.
+ */
+struct ima_delta_record {
+	uint8_t state[SHA256_DIGEST_SIZE];
+	uint32_t num_entries;
+	uint32_t bank_mask;
+	uint8_t pcr[PCR_BANK__LAST][sizeof(TPMU_HA)];
+};
+
+/*
+ * Records of a client, identified by the digest of the AK certificate. The
+ * last records are kept, as the client uses the new state only after it
+ * receives the response.
+ */
+struct ima_delta_client {
+	uint8_t ak_digest[SHA256_DIGEST_SIZE];
+	time_t last_used;
+	int next;
+	struct ima_delta_record records[IMA_DELTA_CLIENT_RECORDS];
+};
+
+static struct ima_delta_client ima_delta_cache[IMA_DELTA_CACHE_SIZE];
+static int ima_delta_cache_num;
+static pthread_mutex_t ima_delta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int attest_enroll_quote_has_pcr(struct data_item *tpms_attest,
+				       int pcr_num)
+{
+	TPMS_PCR_SELECTION *selection;
+	BYTE *data = tpms_attest->data;
+	INT32 len = tpms_attest->len;
+	TPMS_ATTEST a;
+	int i;
+
+	if (TPMS_ATTEST_Unmarshal(&a, &data, &len))
+		return 0;
+
+	if (a.type != TPM_ST_ATTEST_QUOTE)
+		return 0;
+
+	for (i = 0; i < a.attested.quote.pcrSelect.count; i++) {
+		selection = &a.attested.quote.pcrSelect.pcrSelections[i];
+		if (pcr_num / 8 < selection->sizeofSelect &&
+		    (selection->pcrSelect[pcr_num / 8] & (1 << (pcr_num % 8))))
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t attest_enroll_quote_banks(struct data_item *tpms_attest)
+{
+	BYTE *data = tpms_attest->data;
+	INT32 len = tpms_attest->len;
+	TPMS_ATTEST a;
+
+	if (TPMS_ATTEST_Unmarshal(&a, &data, &len) ||
+	    a.type != TPM_ST_ATTEST_QUOTE)
+		return 0;
+
+	return attest_pcr_selection_banks(&a.attested.quote.pcrSelect);
+}
+
+/* must be called with ima_delta_lock held */
+static struct ima_delta_client *ima_delta_client_lookup(uint8_t *ak_digest,
+							int add)
+{
+	struct ima_delta_client *client = NULL;
+	int i;
+
+	for (i = 0; i < ima_delta_cache_num; i++) {
+		if (!memcmp(ima_delta_cache[i].ak_digest, ak_digest,
+			    sizeof(ima_delta_cache[i].ak_digest))) {
+			client = &ima_delta_cache[i];
+			goto out;
+		}
+	}
+
+	if (!add)
+		return NULL;
+
+	/* the least recently used client is replaced when the cache is full */
+	if (ima_delta_cache_num < IMA_DELTA_CACHE_SIZE) {
+		client = &ima_delta_cache[ima_delta_cache_num++];
+	} else {
+		client = &ima_delta_cache[0];
+		for (i = 1; i < IMA_DELTA_CACHE_SIZE; i++)
+			if (ima_delta_cache[i].last_used < client->last_used)
+				client = &ima_delta_cache[i];
+	}
+
+	memset(client, 0, sizeof(*client));
+	memcpy(client->ak_digest, ak_digest, sizeof(client->ak_digest));
+out:
+	client->last_used = time(NULL);
+	return client;
+}
+
+static int ima_delta_ak_digest(struct data_item *ak_cert, uint8_t *ak_digest)
+{
+	if (EVP_Digest(ak_cert->data, ak_cert->len, ak_digest, NULL,
+		       EVP_sha256(), NULL) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int attest_enroll_ima_delta_apply(attest_ctx_verifier *v_ctx,
+					 struct data_item *ak_cert,
+					 uint32_t bank_mask,
+					 struct ima_delta *delta)
+{
+	uint8_t ak_digest[SHA256_DIGEST_SIZE];
+	struct ima_delta_client *client;
+	struct ima_delta_record *record = NULL;
+	int rc, i;
+
+	/* the client sent the whole log */
+	if (!delta->start_entry)
+		return 0;
+
+	rc = ima_delta_ak_digest(ak_cert, ak_digest);
+	if (rc)
+		return rc;
+
+	pthread_mutex_lock(&ima_delta_lock);
+	client = ima_delta_client_lookup(ak_digest, 0);
+	for (i = 0; client && i < IMA_DELTA_CLIENT_RECORDS; i++) {
+		/* banks not selected before were not extended */
+		if (client->records[i].num_entries == delta->start_entry &&
+		    !memcmp(client->records[i].state, delta->base_state,
+			    sizeof(delta->base_state)) &&
+		    !(bank_mask & ~client->records[i].bank_mask)) {
+			record = &client->records[i];
+			break;
+		}
+	}
+
+	if (!record)
+		rc = -IMA_DELTA_UNKNOWN_POS;
+
+	for (i = 0; record && i < PCR_BANK__LAST && !rc; i++)
+		rc = attest_pcr_set_base(v_ctx, IMA_PCR, attest_pcr_bank_alg(i),
+					 record->pcr[i]);
+	pthread_mutex_unlock(&ima_delta_lock);
+
+	if (!rc)
+		attest_ctx_verifier_set_flags(v_ctx, CTX_IMA_DELTA);
+
+	return rc;
+}
+
+static int attest_enroll_ima_delta_store(attest_ctx_verifier *v_ctx,
+					 struct data_item *ak_cert,
+					 struct ima_delta *delta)
+{
+	uint8_t ak_digest[SHA256_DIGEST_SIZE];
+	struct ima_delta_client *client;
+	struct ima_delta_record record;
+	TPMT_HA *pcr;
+	int rc, i;
+
+	rc = ima_delta_ak_digest(ak_cert, ak_digest);
+	if (rc)
+		return rc;
+
+	rc = attest_pcr_calc_state(v_ctx, IMA_DELTA_STATE_BANKS, 1 << IMA_PCR,
+				   record.state);
+	if (rc)
+		return rc;
+
+	record.num_entries = delta->start_entry + delta->num_entries;
+	record.bank_mask = v_ctx->pcr_bank_mask ?: ~0;
+
+	for (i = 0; i < PCR_BANK__LAST; i++) {
+		pcr = attest_pcr_get(v_ctx, IMA_PCR, attest_pcr_bank_alg(i));
+		if (!pcr)
+			return -ENOENT;
+
+		memcpy(record.pcr[i], (uint8_t *)&pcr->digest,
+		       attest_pcr_digest_size(pcr->hashAlg));
+	}
+
+	pthread_mutex_lock(&ima_delta_lock);
+	client = ima_delta_client_lookup(ak_digest, 1);
+	for (i = 0; i < IMA_DELTA_CLIENT_RECORDS; i++)
+		if (!memcmp(client->records[i].state, record.state,
+			    sizeof(record.state)) &&
+		    client->records[i].num_entries == record.num_entries)
+			break;
+
+	/* the oldest record of the client is replaced */
+	if (i == IMA_DELTA_CLIENT_RECORDS) {
+		client->records[client->next] = record;
+		client->next = (client->next + 1) % IMA_DELTA_CLIENT_RECORDS;
+	}
+	pthread_mutex_unlock(&ima_delta_lock);
+
+	return 0;
+}
+
+static int attest_enroll_add_token(attest_ctx_data *d_ctx_out,
+				   EVP_PKEY *token_key, uint32_t token_lifetime,
+				   struct data_item *ak_cert,
+				   struct data_item *tpms_attest, char *reqs)
+{
+	struct attest_token token = { 0 };
+	TPMS_PCR_SELECTION *selection;
+	TPMS_ATTEST a;
+	BYTE *data = tpms_attest->data;
+	INT32 len = tpms_attest->len;
+	uint8_t *token_data;
+	size_t token_len;
+	int rc, i, j;
+
+	if (!reqs)
+		return -ENOMEM;
+
+	if (TPMS_ATTEST_Unmarshal(&a, &data, &len) ||
+	    a.type != TPM_ST_ATTEST_QUOTE)
+		return -EINVAL;
+
+	if (a.attested.quote.pcrDigest.t.size > sizeof(token.pcr_digest))
+		return -EINVAL;
+
+	token.pcr_digest_len = a.attested.quote.pcrDigest.t.size;
+	memcpy(token.pcr_digest, a.attested.quote.pcrDigest.t.buffer,
+	       token.pcr_digest_len);
+
+	if (a.attested.quote.pcrSelect.count > ATTEST_TOKEN_MAX_BANKS)
+		return -EINVAL;
+
+	token.num_banks = a.attested.quote.pcrSelect.count;
+	for (i = 0; i < token.num_banks; i++) {
+		selection = &a.attested.quote.pcrSelect.pcrSelections[i];
+		token.banks[i].alg = selection->hash;
+
+		for (j = 0; j < selection->sizeofSelect &&
+			    j < sizeof(token.banks[i].pcr_mask); j++)
+			token.banks[i].pcr_mask |=
+				(uint32_t)selection->pcrSelect[j] << (j * 8);
+	}
+
+	if (EVP_Digest(ak_cert->data, ak_cert->len, token.ak_digest, NULL,
+		       EVP_sha256(), NULL) != 1 ||
+	    EVP_Digest(reqs, strlen(reqs), token.req_digest, NULL,
+		       EVP_sha256(), NULL) != 1)
+		return -EINVAL;
+
+	token.issued = time(NULL);
+	token.expires = token.issued + token_lifetime;
+
+	rc = attest_token_sign(token_key, &token, &token_len, &token_data);
+	if (rc < 0)
+		return rc;
+
+	rc = attest_ctx_data_add_copy(d_ctx_out, CTX_ATTEST_TOKEN, token_len,
+				      token_data, NULL);
+	free(token_data);
 	return rc;
 }
 
@@ -917,50 +1321,80 @@ out:
  * @param[in] pcr_mask		Mask of PCR to check
  * @param[in] reqPath		Path of requirements for TPM key policy check
  * @param[in] verifier_flags	verifier flags
+ * @param[in] session		Client session (can be NULL)
+ * @param[in] token_key	Key to sign attestation tokens (can be NULL)
+ * @param[in] token_lifetime	Attestation token lifetime in seconds
  * @param[in] message_in	input message
  * @param[in,out] message_out	output message
  *
+ * If the AK certificate is not in the message, the one in the session is used.
+ * The nonce generated for the session can be used only once.
+ *
+ * If a token key is provided, the response contains an attestation token
+ * with the AK certificate digest, the PCR digest of the quote and the digest
+ * of the requirements. Otherwise, the response is empty.
+ *
  * @returns 0 on success, a negative value on error
  */
 int attest_enroll_msg_process_quote(int hmac_key_len, uint8_t *hmac_key,
 				    int pcr_mask_len, uint8_t *pcr_mask,
 				    char *reqPath, uint16_t verifier_flags,
+				    struct attest_enroll_session *session,
+				    EVP_PKEY *token_key,
+				    uint32_t token_lifetime,
 				    char *message_in, char **message_out)
 {
-	attest_ctx_data *d_ctx = NULL;
+	attest_ctx_data *d_ctx = NULL, *d_ctx_out = NULL;
 	attest_ctx_verifier *v_ctx = NULL;
 	struct verification_log *log;
 	struct data_item *ak_cert, *nonce, *tpms_attest, *tpms_attest_sig;
+	struct data_item *ima_delta_item;
+	struct ima_delta ima_delta;
 #ifdef DEBUG
 	char *message_in_stripped;
 #endif
-	char *logs, *reqs;
-	int rc;
+	char *logs, *reqs = NULL;
+	int rc, ima_delta_verified = 0;
 
-	attest_ctx_data_init(&d_ctx);
-	attest_ctx_verifier_init(&v_ctx);
+	attest_enroll_ctx_data_get(&d_ctx);
+	attest_enroll_ctx_verifier_get(&v_ctx);
 	attest_ctx_verifier_set_pcr_mask(v_ctx, pcr_mask_len, pcr_mask);
 	attest_ctx_verifier_set_key(v_ctx, hmac_key_len, hmac_key);
 	attest_ctx_verifier_set_flags(v_ctx, verifier_flags);
 
 	log = attest_ctx_verifier_add_log(v_ctx, "verify quote");
 
-	rc = attest_ctx_data_add_json_data(d_ctx, message_in,
-					   strlen(message_in));
+	rc = attest_ctx_data_add_msg(d_ctx, message_in);
 	check_goto(rc, rc, out, v_ctx,
-		   "attest_ctx_data_add_json_data() error");
+		   "attest_ctx_data_add_msg() error");
 #ifdef DEBUG
 	attest_ctx_data_print_json_no_value(d_ctx, &message_in_stripped);
 	printf("<- %s\n", message_in_stripped);
 	free(message_in_stripped);
 #endif
 	ak_cert = attest_ctx_data_get(d_ctx, CTX_AK_CERT);
+	if (!ak_cert && session && session->ak_cert_len) {
+		rc = attest_ctx_data_add_copy(d_ctx, CTX_AK_CERT,
+					      session->ak_cert_len,
+					      session->ak_cert, NULL);
+		check_goto(rc, rc, out, v_ctx, "attest_ctx_data_add() error");
+
+		ak_cert = attest_ctx_data_get(d_ctx, CTX_AK_CERT);
+	}
+
 	check_goto(!ak_cert, -ENOENT, out, v_ctx,
 		   "AK certificate not provided");
 
 	nonce = attest_ctx_data_get(d_ctx, CTX_NONCE);
 	check_goto(!nonce, -ENOENT, out, v_ctx, "Nonce not provided");
 
+	if (session && session->nonce_valid) {
+		session->nonce_valid = 0;
+		check_goto(nonce->len != sizeof(session->nonce) ||
+			   memcmp(nonce->data, session->nonce, nonce->len),
+			   -EINVAL, out, v_ctx, "Nonce mismatch");
+	}
+
 	rc = attest_enroll_verify_hmac(d_ctx, v_ctx, nonce, ak_cert,
 				       CTX_NONCE_HMAC);
 	check_goto(rc, rc, out, v_ctx,
@@ -973,7 +1407,6 @@ int attest_enroll_msg_process_quote(int hmac_key_len, uint8_t *hmac_key,
 	printf("Processing quote with the following requirements:\n");
 	reqs = attest_ctx_verifier_req_print_json(v_ctx);
 	printf("%s\n", reqs);
-	free(reqs);
 
 	tpms_attest = attest_ctx_data_get(d_ctx, CTX_TPMS_ATTEST);
 	check_goto(!tpms_attest, -ENOENT, out, v_ctx,
@@ -983,6 +1416,26 @@ int attest_enroll_msg_process_quote(int hmac_key_len, uint8_t *hmac_key,
 	check_goto(!tpms_attest_sig, -ENOENT, out, v_ctx,
 		   "TPM attestation data signature not provided");
 
+	/* a part of the IMA event log is verified from the last PCR value */
+	ima_delta_item = attest_ctx_data_lookup_by_label(d_ctx,
+							 IMA_DELTA_LABEL);
+	if (ima_delta_item) {
+		check_goto(ima_delta_item->len != sizeof(ima_delta), -EINVAL,
+			   out, v_ctx, "invalid IMA delta");
+
+		memcpy(&ima_delta, ima_delta_item->data, sizeof(ima_delta));
+		ima_delta_verified = attest_enroll_quote_has_pcr(tpms_attest,
+								 IMA_PCR);
+		check_goto(!ima_delta_verified && ima_delta.start_entry,
+			   -ENOTSUP, out, v_ctx, "IMA PCR not quoted");
+
+		rc = attest_enroll_ima_delta_apply(v_ctx, ak_cert,
+					attest_enroll_quote_banks(tpms_attest),
+					&ima_delta);
+		check_goto(rc, rc, out, v_ctx,
+			   "IMA event log position unknown, send the whole log");
+	}
+
 	rc = attest_verifier_check_tpms_attest(d_ctx, v_ctx, tpms_attest->len,
 					       tpms_attest->data,
 					       tpms_attest_sig->len,
@@ -991,10 +1444,31 @@ int attest_enroll_msg_process_quote(int hmac_key_len, uint8_t *hmac_key,
 	check_goto(rc, rc, out, v_ctx,
 		   "attest_verifier_check_tpms_attest() error");
 
-	*message_out = calloc(1, sizeof(char));
-	if (!*message_out)
-		rc = -ENOMEM;
+	if (ima_delta_verified) {
+		rc = attest_enroll_ima_delta_store(v_ctx, ak_cert,
+						   &ima_delta);
+		check_goto(rc, rc, out, v_ctx,
+			   "attest_enroll_ima_delta_store() error: %d", rc);
+	}
 
+	if (!token_key) {
+		*message_out = calloc(1, sizeof(char));
+		if (!*message_out)
+			rc = -ENOMEM;
+
+		goto out;
+	}
+
+	attest_enroll_ctx_data_get(&d_ctx_out);
+
+	rc = attest_enroll_add_token(d_ctx_out, token_key, token_lifetime,
+				     ak_cert, tpms_attest, reqs);
+	check_goto(rc, rc, out, v_ctx,
+		   "attest_enroll_add_token() error: %d", rc);
+
+	rc = attest_ctx_data_print_msg(d_ctx_out,
+				       attest_ctx_msg_format(message_in),
+				       message_out);
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);
 
@@ -1002,8 +1476,10 @@ out:
 	printf("%s\n", logs);
 	free(logs);
 
-	attest_ctx_data_cleanup(d_ctx);
-	attest_ctx_verifier_cleanup(v_ctx);
+	free(reqs);
+	attest_enroll_ctx_data_put(d_ctx);
+	attest_enroll_ctx_data_put(d_ctx_out);
+	attest_enroll_ctx_verifier_put(v_ctx);
 	return rc;
 }
 /** @}*/
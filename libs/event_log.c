@@ -29,6 +29,7 @@
 #include <string.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include "event_log.h"
 
@@ -78,13 +79,13 @@ int attest_event_log_verify_digest(attest_ctx_verifier *v_ctx,
 
 	current_log(v_ctx);
 
-	check_goto(digest_len != TSS_GetDigestSize(algID), -EINVAL, out, v_ctx,
-		   "digest length mismatch");
+	check_goto(digest_len != attest_pcr_digest_size(algID), -EINVAL, out,
+		   v_ctx, "digest length mismatch");
 
 	d.hashAlg = algID;
 
-	rc = TSS_Hash_Generate(&d, data_len, data, 0, NULL); 
-	check_goto(rc, -EINVAL, out, v_ctx, "TSS_Hash_Generate() error: %d");
+	rc = attest_pcr_hash(&d, data_len, data, 0, NULL);
+	check_goto(rc, rc, out, v_ctx, "attest_pcr_hash() error: %d", rc);
 	rc = memcmp((uint8_t *)&d.digest, digest, digest_len);
 	/* FIXME: uncomment when BIOS log is verified correctly */
 	//check_goto(rc, rc, out, v_ctx, "digest mismatch");
@@ -106,22 +107,19 @@ static int attest_event_log_parse(attest_ctx_verifier *v_ctx,
 	current_log(v_ctx);
 
 	while (data_len > 0) {
-		new_log_entry = calloc(1, sizeof(*new_log_entry));
+		new_log_entry = attest_arena_calloc(&v_ctx->arena, 1,
+						    sizeof(*new_log_entry));
 		check_goto(!new_log_entry, -ENOMEM, out, v_ctx,
 			   "out of memory");
 
 		rc = parse_func(v_ctx, &data_len, &data_ptr,
 				&new_log_entry->log, &first_parsed_log);
-		if (rc)
-			free(new_log_entry);
-
 		check_goto(rc, rc, out, v_ctx,
 			   "error parsing entry #%d of log %s", i++, log_id);
 
 		list_add_tail(&new_log_entry->list, head);
 	}
 out:
-	free(first_parsed_log);
 	return rc;
 }
 
@@ -131,31 +129,98 @@ static void attest_event_log_free_event_logs(attest_ctx_verifier *v_ctx)
 	struct event_log_entry *e, *temp_e;
 
 	list_for_each_entry_safe(log, temp_log, &v_ctx->event_logs, list) {
-		list_for_each_entry_safe(e, temp_e, &log->logs, list) {
+		list_for_each_entry_safe(e, temp_e, &log->logs, list)
 			list_del(&e->list);
-			free(e->log);
-			free(e);
-		}
 
 		list_del(&log->list);
-		free(log);
 	}
 }
 
+struct event_log_job {
+	struct pcr_shadow shadow;
+	parse_log_func parse_func;
+	struct data_item *item;
+	struct event_log *event_log;
+	pthread_t thread;
+	int thread_started;
+	int rc;
+};
+
+static void *attest_event_log_parse_job(void *arg)
+{
+	struct event_log_job *job = (struct event_log_job *)arg;
+	attest_ctx_verifier *v_ctx = &job->shadow.v_ctx;
+	struct verification_log *log;
+
+	log = attest_ctx_verifier_add_log(v_ctx, "parse event log entries");
+
+	job->rc = attest_event_log_parse(v_ctx, job->parse_func,
+					 job->item->label, job->item->len,
+					 job->item->data, &job->event_log->logs);
+
+	attest_ctx_verifier_end_log(v_ctx, log, job->rc);
+	return NULL;
+}
+
+static void attest_event_log_move_logs(attest_ctx_verifier *v_ctx,
+				       attest_ctx_verifier *shadow_ctx)
+{
+	struct verification_log *log;
+
+	/*
+	 * Logs are stored from the newest to the oldest. The arena of the
+	 * shadow context is spliced into the arena of the verifier context.
+	 */
+	while (!list_empty(&shadow_ctx->logs)) {
+		log = list_last_entry(&shadow_ctx->logs,
+				      struct verification_log, list);
+		list_del(&log->list);
+		log->arena = &v_ctx->arena;
+		list_add(&log->list, &v_ctx->logs);
+	}
+}
+
+/*
+ * Event logs are parsed concurrently, each in a shadow PCR bank initialized
+ * from the verifier context. Shadow banks are merged afterwards: PCRs
+ * extended by one log are copied, PCRs extended by multiple logs are
+ * recalculated by replaying the extends in the order logs were provided.
+ */
 static int attest_event_log_parse_data(attest_ctx_data *d_ctx,
 				       attest_ctx_verifier *v_ctx)
 {
+	struct event_log_job *jobs = NULL, *job;
+	struct pcr_shadow **shadows = NULL;
 	struct event_log *new_log = NULL;
 	struct verification_log *log;
 	char library_name[MAX_PATH_LENGTH];
-	parse_log_func parse_func;
 	struct data_item *item;
 	void *handle = NULL;
-	int rc = 0;
+	int rc = 0, i, num_items = 0, num_jobs = 0;
 
 	log = attest_ctx_verifier_add_log(v_ctx, "parse event log");
 
+	list_for_each_entry(item, &d_ctx->ctx_data[CTX_EVENT_LOG], list)
+		num_items++;
+
+	if (!num_items)
+		goto out;
+
+	jobs = calloc(num_items, sizeof(*jobs));
+	check_goto(!jobs, -ENOMEM, out, v_ctx, "out of memory");
+
+	shadows = calloc(num_items, sizeof(*shadows));
+	check_goto(!shadows, -ENOMEM, out, v_ctx, "out of memory");
+
+	/* shadow PCRs are copied from, and merged into, the verifier PCRs */
+	if (!v_ctx->pcr) {
+		rc = attest_pcr_init(v_ctx);
+		check_goto(rc, rc, out, v_ctx, "cannot initialize PCRs");
+	}
+
 	list_for_each_entry(item, &d_ctx->ctx_data[CTX_EVENT_LOG], list) {
+		job = &jobs[num_jobs];
+
 		check_goto(!item->label, -EINVAL, out, v_ctx,
 			   "missing log type");
 
@@ -165,11 +230,11 @@ static int attest_event_log_parse_data(attest_ctx_data *d_ctx,
 		check_goto(!handle, -ENOENT, out, v_ctx,
 			   "event log library not found");
 
-		parse_func = dlsym(handle, "attest_event_log_parse");
-		check_goto(!parse_func, -ENOENT, out, v_ctx,
+		job->parse_func = dlsym(handle, "attest_event_log_parse");
+		check_goto(!job->parse_func, -ENOENT, out, v_ctx,
 			   "event log parser not found");
 
-		new_log = malloc(sizeof(*new_log));
+		new_log = attest_arena_alloc(&v_ctx->arena, sizeof(*new_log));
 		check_goto(!new_log, -ENOMEM, out, v_ctx,
 			   "out of memory");
 
@@ -178,13 +243,47 @@ static int attest_event_log_parse_data(attest_ctx_data *d_ctx,
 		new_log->id = item->label;
 		list_add_tail(&new_log->list, &v_ctx->event_logs);
 
-		rc = attest_event_log_parse(v_ctx, parse_func, item->label,
-					    item->len, item->data,
-					    &new_log->logs);
-		check_goto(rc, rc, out, v_ctx,
-			   "%s parser returned an error", item->label);
+		job->item = item;
+		job->event_log = new_log;
+		shadows[num_jobs++] = &job->shadow;
+
+		rc = attest_pcr_shadow_init(v_ctx, &job->shadow);
+		check_goto(rc, rc, out, v_ctx, "cannot initialize PCRs");
+	}
+
+	/* the last event log is parsed by the current thread */
+	for (i = 0; i < num_jobs - 1; i++)
+		jobs[i].thread_started = !pthread_create(&jobs[i].thread, NULL,
+						attest_event_log_parse_job,
+						&jobs[i]);
+
+	for (i = 0; i < num_jobs; i++)
+		if (!jobs[i].thread_started)
+			attest_event_log_parse_job(&jobs[i]);
+
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].thread_started)
+			pthread_join(jobs[i].thread, NULL);
+
+		attest_event_log_move_logs(v_ctx, &jobs[i].shadow.v_ctx);
 	}
+
+	for (i = 0; i < num_jobs; i++)
+		check_goto(jobs[i].rc, jobs[i].rc, out, v_ctx,
+			   "%s parser returned an error", jobs[i].item->label);
+
+	rc = attest_pcr_shadow_merge(v_ctx, shadows, num_jobs);
+	check_goto(rc, rc, out, v_ctx, "cannot merge PCRs of event logs");
 out:
+	/* parsed entries and moved logs are allocated from the shadow arenas */
+	for (i = 0; i < num_jobs; i++) {
+		attest_arena_splice(&v_ctx->arena, &jobs[i].shadow.v_ctx.arena);
+		attest_pcr_shadow_cleanup(&jobs[i].shadow);
+	}
+
+	free(shadows);
+	free(jobs);
+
 	if (rc)
 		attest_event_log_free_event_logs(v_ctx);
 
@@ -161,7 +161,7 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx,
 	struct tcg_pcr_event *event_header = NULL;
 	int rc;
 
-	log_entry = malloc(sizeof(*log_entry));
+	log_entry = attest_arena_alloc(&v_ctx->arena, sizeof(*log_entry));
 	if (!log_entry)
 		return -ENOMEM;
 
@@ -176,7 +176,8 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx,
 		rc = attest_event_log_parse_v1(v_ctx, remaining_len, data,
 					       &event_header);
 		if (!rc && event_header) {
-			first_log_entry = malloc(sizeof(*first_log_entry));
+			first_log_entry = attest_arena_alloc(&v_ctx->arena,
+						sizeof(*first_log_entry));
 			if (!first_log_entry) {
 				rc = -ENOMEM;
 				goto out;
@@ -189,8 +190,6 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx,
 out:
 	if (!rc)
 		*parsed_log = log_entry;
-	else
-		free(log_entry);
 
 	return rc;
 }
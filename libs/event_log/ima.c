@@ -240,8 +240,8 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx, uint32_t *remaining_len,
 	if (!desc)
 		return -ENOTSUP;
 
-	log_entry = malloc(sizeof(*log_entry) +
-			   desc->num_fields * sizeof(*log_entry->template_data));
+	log_entry = attest_arena_alloc(&v_ctx->arena, sizeof(*log_entry) +
+			desc->num_fields * sizeof(*log_entry->template_data));
 	if (!log_entry) {
 		rc = -ENOMEM;
 		goto out;
@@ -304,14 +304,20 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx, uint32_t *remaining_len,
 		if (attest_pcr_bank_alg(i) == TPM_ALG_SHA1)
 			continue;
 
+		/* the hash algorithm is not provided by OpenSSL */
+		if (!attest_pcr_digest_size(attest_pcr_bank_alg(i)))
+			continue;
+
+		/* the bank is not included in the quote */
+		if (!attest_pcr_bank_selected(v_ctx, i))
+			continue;
+
 		digest.hashAlg = attest_pcr_bank_alg(i);
 
-		rc = TSS_Hash_Generate(&digest, *ima_data_len, ima_data, 0,
-				       NULL);
-		if (rc) {
-			rc = -EINVAL;
+		rc = attest_pcr_hash(&digest, *ima_data_len, ima_data, 0,
+				     NULL);
+		if (rc)
 			break;
-		}
 
 		rc = attest_pcr_extend(v_ctx, ima_entry->header.pcr,
 				digest.hashAlg,
@@ -324,8 +330,6 @@ int attest_event_log_parse(attest_ctx_verifier *v_ctx, uint32_t *remaining_len,
 out:
 	if (!rc)
 		*parsed_log = log_entry;
-	else
-		free(log_entry);
 
 	return rc;
 }
@@ -28,6 +28,8 @@
 #include <string.h>
 #include <errno.h>
 
+#include <openssl/evp.h>
+
 #include "pcr.h"
 
 static TPMI_ALG_HASH supported_algorithms[PCR_BANK__LAST] = {
@@ -35,6 +37,7 @@ static TPMI_ALG_HASH supported_algorithms[PCR_BANK__LAST] = {
 	[PCR_BANK_SHA256] = TPM_ALG_SHA256,
 	[PCR_BANK_SHA384] = TPM_ALG_SHA384,
 	[PCR_BANK_SHA512] = TPM_ALG_SHA512,
+	[PCR_BANK_SM3_256] = TPM_ALG_SM3_256,
 };
 
 const char *supported_algorithms_names[PCR_BANK__LAST] = {
@@ -42,6 +45,7 @@ const char *supported_algorithms_names[PCR_BANK__LAST] = {
 	[PCR_BANK_SHA256] = "sha256",
 	[PCR_BANK_SHA384] = "sha384",
 	[PCR_BANK_SHA512] = "sha512",
+	[PCR_BANK_SM3_256] = "sm3",
 };
 
 static enum pcr_banks attest_pcr_lookup_bank(TPMI_ALG_HASH alg)
@@ -75,25 +79,145 @@ TPM_ALG_ID attest_pcr_bank_alg_from_name(char *alg_name, int alg_name_len)
 	return TPM_ALG_SHA1;
 }
 
+/**
+ * Find a PCR bank from the name of its hash algorithm
+ * @param[in] alg_name	hash algorithm name (not necessarily terminated)
+ * @param[in] alg_name_len	length of the name
+ *
+ * @returns PCR bank on success, PCR_BANK__LAST if the name is unknown
+ */
+enum pcr_banks attest_pcr_bank_from_name(const char *alg_name,
+					 int alg_name_len)
+{
+	int i;
+
+	for (i = 0; i < PCR_BANK__LAST; i++)
+		if (strlen(supported_algorithms_names[i]) == alg_name_len &&
+		    !strncmp(supported_algorithms_names[i], alg_name,
+			     alg_name_len))
+			return i;
+
+	return PCR_BANK__LAST;
+}
+
+/*
+ * Digests are calculated with OpenSSL. SHA-1 and SHA-2 use its assembly
+ * implementations, including the SHA extensions on x86, while SM3 is only
+ * accelerated on CPUs with SM3 instructions (e.g. ARMv8.2) and is portable C
+ * code elsewhere, there is no SIMD SM3 kernel here.
+ */
+static const EVP_MD *attest_pcr_md(TPMI_ALG_HASH alg)
+{
+	switch (alg) {
+	case TPM_ALG_SHA1:
+		return EVP_sha1();
+	case TPM_ALG_SHA256:
+		return EVP_sha256();
+	case TPM_ALG_SHA384:
+		return EVP_sha384();
+	case TPM_ALG_SHA512:
+		return EVP_sha512();
+#if OPENSSL_VERSION_NUMBER >= 0x10101000 && !defined(OPENSSL_NO_SM3)
+	case TPM_ALG_SM3_256:
+		return EVP_sm3();
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Get the digest size of a hash algorithm
+ * @param[in] alg	hash algorithm
+ *
+ * @returns digest size on success, 0 if the algorithm is not supported
+ */
+int attest_pcr_digest_size(TPMI_ALG_HASH alg)
+{
+	const EVP_MD *md = attest_pcr_md(alg);
+
+	return md ? EVP_MD_size(md) : 0;
+}
+
+/**
+ * Calculate the digest of one or two buffers
+ * @param[in,out] digest	digest, with the hash algorithm set
+ * @param[in] data1_len	length of the first buffer
+ * @param[in] data1	first buffer
+ * @param[in] data2_len	length of the second buffer
+ * @param[in] data2	second buffer (can be NULL)
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_pcr_hash(TPMT_HA *digest, size_t data1_len, const void *data1,
+		    size_t data2_len, const void *data2)
+{
+	const EVP_MD *md = attest_pcr_md(digest->hashAlg);
+	EVP_MD_CTX *mdctx;
+	int rc = -EINVAL;
+
+	if (!md)
+		return -ENOTSUP;
+
+	mdctx = EVP_MD_CTX_create();
+	if (!mdctx)
+		return -ENOMEM;
+
+	if (EVP_DigestInit_ex(mdctx, md, NULL) != 1 ||
+	    EVP_DigestUpdate(mdctx, data1, data1_len) != 1 ||
+	    (data2 && EVP_DigestUpdate(mdctx, data2, data2_len) != 1) ||
+	    EVP_DigestFinal_ex(mdctx, (uint8_t *)&digest->digest, NULL) != 1)
+		goto out;
+
+	rc = 0;
+out:
+	EVP_MD_CTX_destroy(mdctx);
+	return rc;
+}
+
+static void attest_pcr_reset_buffer(unsigned char *pcr)
+{
+	TPMT_HA *pcr_item;
+	int i, j;
+
+	for (i = 0; i < PCR_BANK__LAST; i++) {
+		for (j = 0; j < IMPLEMENTATION_PCR; j++) {
+			pcr_item = (TPMT_HA *)(pcr + sizeof(TPMT_HA) *
+				   (i * IMPLEMENTATION_PCR + j));
+			pcr_item->hashAlg = supported_algorithms[i];
+			memset((uint8_t *)&pcr_item->digest, 0,
+			       attest_pcr_digest_size(supported_algorithms[i]));
+		}
+	}
+}
+
 /// @private
 int attest_pcr_init(attest_ctx_verifier *v_ctx)
 {
-	TPMT_HA *pcr_item;
 	int rc = 0, i, j;
 	unsigned char *pcr;
+	size_t offset;
 
 	current_log(v_ctx);
 
-	pcr = malloc(sizeof(TPMT_HA) * PCR_BANK__LAST * IMPLEMENTATION_PCR);
+	/* reuse the buffer of a context that has been reset */
+	pcr = v_ctx->pcr;
+	if (!pcr)
+		pcr = malloc(sizeof(TPMT_HA) * PCR_BANK__LAST *
+			     IMPLEMENTATION_PCR);
 	check_goto(!pcr, -ENOMEM, out, ctx, "out of memory");
 
-	for (i = 0; i < PCR_BANK__LAST; i++) {
+	attest_pcr_reset_buffer(pcr);
+
+	/* PCRs with a base value do not start from zero */
+	for (i = 0; i < PCR_BANK__LAST && v_ctx->pcr_base_mask; i++) {
 		for (j = 0; j < IMPLEMENTATION_PCR; j++) {
-			pcr_item = (TPMT_HA *)(pcr + sizeof(TPMT_HA) *
-				   (i * IMPLEMENTATION_PCR + j));
-			pcr_item->hashAlg = supported_algorithms[i];
-			memset((uint8_t *)&pcr_item->digest, 0,
-			       TSS_GetDigestSize(supported_algorithms[i]));
+			if (!(v_ctx->pcr_base_mask & (1 << j)))
+				continue;
+
+			offset = sizeof(TPMT_HA) * (i * IMPLEMENTATION_PCR + j);
+			memcpy(pcr + offset, v_ctx->pcr_base + offset,
+			       sizeof(TPMT_HA));
 		}
 	}
 
@@ -102,10 +226,67 @@ out:
 	return rc;
 }
 
+/**
+ * Set the initial value of a PCR, used instead of zero when software PCRs
+ * are initialized
+ * @param[in] v_ctx	verifier context
+ * @param[in] pcr_num	PCR number
+ * @param[in] alg	PCR bank
+ * @param[in] digest	initial PCR value
+ *
+ * Banks not set for a PCR with a base value start from zero.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_pcr_set_base(attest_ctx_verifier *v_ctx, unsigned int pcr_num,
+			TPMI_ALG_HASH alg, unsigned char *digest)
+{
+	enum pcr_banks pcr_bank = attest_pcr_lookup_bank(alg);
+	TPMT_HA *pcr_item;
+	int i;
+
+	if (pcr_bank == PCR_BANK__LAST || pcr_num >= IMPLEMENTATION_PCR)
+		return -ENOENT;
+
+	if (!v_ctx->pcr_base) {
+		v_ctx->pcr_base = malloc(sizeof(TPMT_HA) * PCR_BANK__LAST *
+					 IMPLEMENTATION_PCR);
+		if (!v_ctx->pcr_base)
+			return -ENOMEM;
+
+		attest_pcr_reset_buffer(v_ctx->pcr_base);
+	}
+
+	/* discard values left by a context that has been reset */
+	if (!(v_ctx->pcr_base_mask & (1 << pcr_num))) {
+		for (i = 0; i < PCR_BANK__LAST; i++) {
+			pcr_item = (TPMT_HA *)(v_ctx->pcr_base +
+				   sizeof(TPMT_HA) *
+				   (i * IMPLEMENTATION_PCR + pcr_num));
+			memset((uint8_t *)&pcr_item->digest, 0,
+			       attest_pcr_digest_size(supported_algorithms[i]));
+		}
+	}
+
+	pcr_item = (TPMT_HA *)(v_ctx->pcr_base + sizeof(TPMT_HA) *
+			       (pcr_bank * IMPLEMENTATION_PCR + pcr_num));
+	memcpy((uint8_t *)&pcr_item->digest, digest,
+	       attest_pcr_digest_size(alg));
+
+	v_ctx->pcr_base_mask |= (1 << pcr_num);
+
+	if (v_ctx->pcr)
+		memcpy(attest_pcr_get(v_ctx, pcr_num, alg), pcr_item,
+		       sizeof(*pcr_item));
+
+	return 0;
+}
+
 /// @private
 void attest_pcr_cleanup(attest_ctx_verifier *v_ctx)
 {
 	free(v_ctx->pcr);
+	v_ctx->pcr = NULL;
 }
 
 /**
@@ -129,6 +310,38 @@ TPMT_HA *attest_pcr_get(attest_ctx_verifier *v_ctx, int pcr_num,
 	       (pcr_bank * IMPLEMENTATION_PCR + pcr_num);
 }
 
+static int attest_pcr_shadow_record(attest_ctx_verifier *v_ctx,
+				    unsigned int pcr_num, TPMI_ALG_HASH alg,
+				    unsigned char *digest)
+{
+	struct pcr_shadow *shadow = container_of(v_ctx, struct pcr_shadow,
+						 v_ctx);
+	struct pcr_shadow_extend *extends, *new_extend;
+	enum pcr_banks pcr_bank = attest_pcr_lookup_bank(alg);
+	int max_extends;
+
+	if (shadow->num_extends == shadow->max_extends) {
+		max_extends = shadow->max_extends ?
+			      shadow->max_extends * 2 : 64;
+
+		extends = realloc(shadow->extends,
+				  max_extends * sizeof(*extends));
+		if (!extends)
+			return -ENOMEM;
+
+		shadow->extends = extends;
+		shadow->max_extends = max_extends;
+	}
+
+	new_extend = &shadow->extends[shadow->num_extends++];
+	new_extend->pcr_num = pcr_num;
+	new_extend->bank = pcr_bank;
+	memcpy(new_extend->digest, digest, attest_pcr_digest_size(alg));
+
+	shadow->touched[pcr_bank] |= (1 << pcr_num);
+	return 0;
+}
+
 /**
  * Extend a PCR
  * @param[in] v_ctx	verifier context
@@ -142,17 +355,21 @@ int attest_pcr_extend(attest_ctx_verifier *v_ctx, unsigned int pcr_num,
 		      TPMI_ALG_HASH alg, unsigned char *digest)
 {
 	TPMT_HA *selected_pcr;
-	int rc, digest_len = TSS_GetDigestSize(alg);
+	int rc, digest_len = attest_pcr_digest_size(alg);
 
 	current_log(v_ctx);
 
 	selected_pcr = attest_pcr_get(v_ctx, pcr_num, alg);
 	check_goto(!selected_pcr, -ENOENT, out, v_ctx, "PCR not found");
 
-	rc = TSS_Hash_Generate(selected_pcr, digest_len, &selected_pcr->digest,
-			       digest_len, digest, 0, NULL);
-	check_goto(rc, -EINVAL, out, v_ctx, "TSS_Hash_Generate() error: %d",
-		   rc);
+	rc = attest_pcr_hash(selected_pcr, digest_len, &selected_pcr->digest,
+			     digest_len, digest);
+	check_goto(rc, rc, out, v_ctx, "attest_pcr_hash() error: %d", rc);
+
+	if (v_ctx->flags & CTX_PCR_SHADOW) {
+		rc = attest_pcr_shadow_record(v_ctx, pcr_num, alg, digest);
+		check_goto(rc, rc, out, v_ctx, "out of memory");
+	}
 out:
 	return rc;
 }
@@ -163,6 +380,9 @@ out:
  * @param[in] digest	PCR array
  * @param[in] pcrs	PCR selection
  *
+ * As the TPM does, the digest is calculated over the selected PCRs of every
+ * bank, in the order of the selection.
+ *
  * @returns 0 on success, a negative value on error
  */
 int attest_pcr_calc_digest(attest_ctx_verifier *v_ctx, TPMT_HA *digest,
@@ -170,27 +390,145 @@ int attest_pcr_calc_digest(attest_ctx_verifier *v_ctx, TPMT_HA *digest,
 {
 	UINT16 pcrLength = 0;
 	TPMT_HA *selected_pcr;
-	TPMI_ALG_HASH alg = pcrs->pcrSelections[0].hash;
-	int d_len = TSS_GetDigestSize(alg);
-	unsigned char buffer[IMPLEMENTATION_PCR * d_len];
+	TPMS_PCR_SELECTION *selection;
+	unsigned char buffer[PCR_BANK__LAST * IMPLEMENTATION_PCR *
+			     sizeof(TPMU_HA)];
+	unsigned char *buffer_ptr = buffer;
+	int rc, i, j, size = sizeof(buffer);
+
+	if (pcrs->count > PCR_BANK__LAST)
+		return -EINVAL;
+
+	for (i = 0; i < pcrs->count; i++) {
+		selection = &pcrs->pcrSelections[i];
+
+		for (j = 0; j < IMPLEMENTATION_PCR; j++) {
+			if (j / 8 >= selection->sizeofSelect ||
+			    !(selection->pcrSelect[j / 8] & (1 << (j % 8))))
+				continue;
+
+			selected_pcr = attest_pcr_get(v_ctx, j,
+						      selection->hash);
+			if (!selected_pcr)
+				return -ENOENT;
+
+			rc = TSS_Array_Marshal((uint8_t *)&selected_pcr->digest,
+				attest_pcr_digest_size(selection->hash),
+				&pcrLength, &buffer_ptr, &size);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return attest_pcr_hash(digest, pcrLength, buffer, 0, NULL);
+}
+
+/**
+ * Calculate a SHA256 digest of the value of selected PCRs in selected banks
+ * @param[in] v_ctx	verifier context
+ * @param[in] bank_mask	selected banks (bit set at the pcr_banks position)
+ * @param[in] pcr_mask	selected PCRs
+ * @param[in,out] digest	calculated digest
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_pcr_calc_state(attest_ctx_verifier *v_ctx, uint32_t bank_mask,
+			  uint32_t pcr_mask, unsigned char *digest)
+{
+	unsigned char buffer[IMPLEMENTATION_PCR * PCR_BANK__LAST *
+			     sizeof(TPMU_HA)];
 	unsigned char *buffer_ptr = buffer;
-	int rc, i, size = sizeof(buffer);
+	TPMT_HA *selected_pcr, state;
+	INT32 size = sizeof(buffer);
+	UINT16 written = 0;
+	int rc, i, j;
 
-	for (i = 0; i < IMPLEMENTATION_PCR; i++) {
-		if (!(pcrs->pcrSelections[0].pcrSelect[i / 8] & (1 << (i % 8))))
+	for (i = 0; i < PCR_BANK__LAST; i++) {
+		if (!(bank_mask & (1 << i)))
 			continue;
 
-		selected_pcr = attest_pcr_get(v_ctx, i, alg);
-		if (!selected_pcr)
-			return -ENOENT;
+		for (j = 0; j < IMPLEMENTATION_PCR; j++) {
+			if (!(pcr_mask & (1 << j)))
+				continue;
+
+			selected_pcr = attest_pcr_get(v_ctx, j,
+						      supported_algorithms[i]);
+
+			rc = TSS_Array_Marshal((uint8_t *)&selected_pcr->digest,
+				attest_pcr_digest_size(supported_algorithms[i]),
+				&written, &buffer_ptr, &size);
+			if (rc)
+				return -EINVAL;
+		}
+	}
+
+	state.hashAlg = TPM_ALG_SHA256;
+
+	rc = attest_pcr_hash(&state, written, buffer, 0, NULL);
+	if (rc)
+		return -EINVAL;
+
+	memcpy(digest, (uint8_t *)&state.digest, SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+/**
+ * Get the banks with at least one selected PCR
+ * @param[in] pcrs	PCR selection
+ *
+ * @returns mask of banks (bit set at the pcr_banks position)
+ */
+uint32_t attest_pcr_selection_banks(TPML_PCR_SELECTION *pcrs)
+{
+	TPMS_PCR_SELECTION *selection;
+	enum pcr_banks bank;
+	uint32_t bank_mask = 0;
+	int i, j;
+
+	for (i = 0; i < pcrs->count && i < PCR_BANK__LAST; i++) {
+		selection = &pcrs->pcrSelections[i];
+
+		bank = attest_pcr_lookup_bank(selection->hash);
+		if (bank == PCR_BANK__LAST)
+			continue;
 
-		rc = TSS_Array_Marshal((uint8_t *)&selected_pcr->digest,
-				       d_len, &pcrLength, &buffer_ptr, &size);
-		if (rc)
-			return rc;
+		for (j = 0; j < selection->sizeofSelect; j++)
+			if (selection->pcrSelect[j])
+				bank_mask |= (1 << bank);
 	}
 
-	return TSS_Hash_Generate(digest, pcrLength, buffer, 0, NULL);
+	return bank_mask;
+}
+
+/**
+ * Extend only the selected banks with the digests calculated by the verifier
+ * @param[in] v_ctx	verifier context
+ * @param[in] pcrs	PCR selection
+ *
+ * Calculating the digest of every event log entry for banks that are not
+ * verified is wasted work, in particular for SM3. The SHA1 bank is always
+ * extended, as IMA provides the SHA1 template digest.
+ */
+void attest_pcr_select_banks(attest_ctx_verifier *v_ctx,
+			     TPML_PCR_SELECTION *pcrs)
+{
+	v_ctx->pcr_bank_mask = attest_pcr_selection_banks(pcrs) |
+			       (1 << PCR_BANK_SHA1);
+}
+
+/**
+ * Check if the verifier calculates digests for a bank
+ * @param[in] v_ctx	verifier context
+ * @param[in] bank	PCR bank
+ *
+ * @returns 1 if the bank is selected or no bank was selected, 0 otherwise
+ */
+int attest_pcr_bank_selected(attest_ctx_verifier *v_ctx, enum pcr_banks bank)
+{
+	if (!v_ctx->pcr_bank_mask)
+		return 1;
+
+	return (v_ctx->pcr_bank_mask & (1 << bank)) != 0;
 }
 
 /**
@@ -214,6 +552,105 @@ int attest_pcr_verify(attest_ctx_verifier *v_ctx, TPML_PCR_SELECTION *pcrs,
 		return rc;
 
 	return memcmp(digest, (uint8_t *)&calculated_digest.digest,
-		      TSS_GetDigestSize(calculated_digest.hashAlg));
+		      attest_pcr_digest_size(calculated_digest.hashAlg));
+}
+
+/// @private
+int attest_pcr_shadow_init(attest_ctx_verifier *v_ctx,
+			   struct pcr_shadow *shadow)
+{
+	size_t pcr_len = sizeof(TPMT_HA) * PCR_BANK__LAST * IMPLEMENTATION_PCR;
+
+	memset(shadow, 0, sizeof(*shadow));
+
+	INIT_LIST_HEAD(&shadow->v_ctx.event_logs);
+	INIT_LIST_HEAD(&shadow->v_ctx.verifiers);
+	INIT_LIST_HEAD(&shadow->v_ctx.registry);
+	INIT_LIST_HEAD(&shadow->v_ctx.logs);
+
+	attest_arena_init(&shadow->v_ctx.arena);
+
+	memcpy(shadow->v_ctx.pcr_mask, v_ctx->pcr_mask,
+	       sizeof(v_ctx->pcr_mask));
+	shadow->v_ctx.flags = v_ctx->flags | CTX_PCR_SHADOW;
+	shadow->v_ctx.pcr_base = v_ctx->pcr_base;
+	shadow->v_ctx.pcr_base_mask = v_ctx->pcr_base_mask;
+	shadow->v_ctx.pcr_bank_mask = v_ctx->pcr_bank_mask;
+
+	if (!v_ctx->pcr)
+		return -EINVAL;
+
+	shadow->v_ctx.pcr = malloc(pcr_len);
+	if (!shadow->v_ctx.pcr)
+		return -ENOMEM;
+
+	memcpy(shadow->v_ctx.pcr, v_ctx->pcr, pcr_len);
+	return 0;
+}
+
+/// @private
+void attest_pcr_shadow_cleanup(struct pcr_shadow *shadow)
+{
+	attest_pcr_cleanup(&shadow->v_ctx);
+	attest_arena_release(&shadow->v_ctx.arena);
+	free(shadow->extends);
+}
+
+/// @private
+int attest_pcr_shadow_merge(attest_ctx_verifier *v_ctx,
+			    struct pcr_shadow **shadows, int num_shadows)
+{
+	struct pcr_shadow_extend *extend;
+	struct pcr_shadow *owner;
+	TPMT_HA *selected_pcr;
+	int rc = 0, i, j, k, l, num_owners;
+
+	for (i = 0; i < PCR_BANK__LAST; i++) {
+		for (j = 0; j < IMPLEMENTATION_PCR; j++) {
+			owner = NULL;
+			num_owners = 0;
+
+			for (k = 0; k < num_shadows; k++) {
+				if (!(shadows[k]->touched[i] & (1 << j)))
+					continue;
+
+				owner = shadows[k];
+				num_owners++;
+			}
+
+			if (!num_owners)
+				continue;
+
+			selected_pcr = attest_pcr_get(v_ctx, j,
+						      supported_algorithms[i]);
+
+			/* only one log extended the PCR, take its value */
+			if (num_owners == 1) {
+				memcpy(selected_pcr,
+				       attest_pcr_get(&owner->v_ctx, j,
+						      supported_algorithms[i]),
+				       sizeof(*selected_pcr));
+				continue;
+			}
+
+			/* replay extends in the order logs were provided */
+			for (k = 0; k < num_shadows; k++) {
+				for (l = 0; l < shadows[k]->num_extends; l++) {
+					extend = &shadows[k]->extends[l];
+					if (extend->bank != i ||
+					    extend->pcr_num != j)
+						continue;
+
+					rc = attest_pcr_extend(v_ctx, j,
+						supported_algorithms[i],
+						extend->digest);
+					if (rc)
+						return rc;
+				}
+			}
+		}
+	}
+
+	return rc;
 }
 /** @}*/
@@ -17,6 +17,15 @@
  * @ingroup app-api
  * @brief
  * Functions to create or verify a SKAE extension in a X.509 certificate or CSR.
+ *
+ * The verification functions are thread-safe as long as each thread passes
+ * its own data and verifier contexts. skae_callback() takes the contexts from
+ * the SSL object being verified, see skae_ssl_set_ctx().
+ *
+ * The result of a successful verification done by skae_callback() can be
+ * stored in a cache shared by multiple connections, keyed by the SHA-256
+ * digest of the certificate and of the verification policy, see
+ * skae_cache_init().
  */
 
 /**
@@ -29,6 +38,10 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
 
 #include "skae.h"
 #include "util.h"
@@ -238,23 +251,429 @@ int skae_verify_x509_req(attest_ctx_data *d_ctx,
 	return skae_verify_common(d_ctx, v_ctx, NULL, req);
 }
 
+/// @private
+static struct {
+	pthread_once_t once;
+	int d_ctx_idx;
+	int v_ctx_idx;
+	int cache_idx;
+	int policy_idx;
+} skae_ssl_ex_data = { .once = PTHREAD_ONCE_INIT, .d_ctx_idx = -1,
+		       .v_ctx_idx = -1, .cache_idx = -1, .policy_idx = -1 };
+
+static void skae_ssl_ex_data_init(void)
+{
+	skae_ssl_ex_data.d_ctx_idx = SSL_get_ex_new_index(0, "attest data ctx",
+							  NULL, NULL, NULL);
+	skae_ssl_ex_data.v_ctx_idx = SSL_get_ex_new_index(0,
+							  "attest verifier ctx",
+							  NULL, NULL, NULL);
+	skae_ssl_ex_data.cache_idx = SSL_get_ex_new_index(0, "SKAE cache",
+							  NULL, NULL, NULL);
+	skae_ssl_ex_data.policy_idx = SSL_get_ex_new_index(0, "SKAE policy",
+							   NULL, NULL, NULL);
+}
+
+/// @private
+struct skae_cache_entry {
+	struct list_head hash;
+	struct list_head lru;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	uint8_t policy[SHA256_DIGEST_LENGTH];
+	time_t expire;
+	int verdict;
+};
+
+/// @private
+struct skae_cache {
+	pthread_mutex_t lock;
+	struct list_head *buckets;
+	struct list_head lru;
+	int num_buckets;
+	int num_entries;
+	int max_entries;
+	int ttl;
+	uint8_t policy[SHA256_DIGEST_LENGTH];
+};
+
+static time_t skae_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static struct list_head *skae_cache_bucket(struct skae_cache *cache,
+					   const uint8_t *digest)
+{
+	uint32_t h;
+
+	memcpy(&h, digest, sizeof(h));
+	return &cache->buckets[h % cache->num_buckets];
+}
+
+static void skae_cache_del(struct skae_cache *cache,
+			   struct skae_cache_entry *entry)
+{
+	list_del(&entry->hash);
+	list_del(&entry->lru);
+	free(entry);
+	cache->num_entries--;
+}
+
+static void skae_cache_flush(struct skae_cache *cache)
+{
+	struct skae_cache_entry *entry, *temp_entry;
+
+	list_for_each_entry_safe(entry, temp_entry, &cache->lru, lru)
+		skae_cache_del(cache, entry);
+}
+
+/**
+ * Create a cache of SKAE verification results
+ * @param[in,out] cache		cache
+ * @param[in] max_entries	maximum number of certificates stored
+ * @param[in] ttl		seconds a result remains valid
+ *
+ * The cache can be shared by multiple threads.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int skae_cache_init(struct skae_cache **cache, int max_entries, int ttl)
+{
+	struct skae_cache *new_cache;
+	int i;
+
+	if (!cache || max_entries <= 0 || ttl <= 0)
+		return -EINVAL;
+
+	new_cache = calloc(1, sizeof(*new_cache));
+	if (!new_cache)
+		return -ENOMEM;
+
+	new_cache->num_buckets = max_entries;
+	new_cache->buckets = calloc(new_cache->num_buckets,
+				    sizeof(*new_cache->buckets));
+	if (!new_cache->buckets) {
+		free(new_cache);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < new_cache->num_buckets; i++)
+		INIT_LIST_HEAD(&new_cache->buckets[i]);
+
+	INIT_LIST_HEAD(&new_cache->lru);
+	pthread_mutex_init(&new_cache->lock, NULL);
+	new_cache->max_entries = max_entries;
+	new_cache->ttl = ttl;
+
+	*cache = new_cache;
+	return 0;
+}
+
+/**
+ * Set the digest of the verification policy
+ * @param[in] cache	cache
+ * @param[in] policy	SHA-256 digest of the requirements and PCR mask
+ *
+ * Stored results are discarded if the policy is different from the one
+ * previously set. Results obtained with another policy are not stored
+ * anymore, even if the verification started before this call.
+ */
+void skae_cache_set_policy(struct skae_cache *cache, const uint8_t *policy)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (memcmp(cache->policy, policy, sizeof(cache->policy))) {
+		skae_cache_flush(cache);
+		memcpy(cache->policy, policy, sizeof(cache->policy));
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Look up a verification result
+ * @param[in] cache	cache
+ * @param[in] policy	SHA-256 digest of the verification policy
+ * @param[in] digest	SHA-256 digest of the certificate
+ * @param[in,out] verdict	result of skae_verify_x509()
+ *
+ * @returns 0 on success, -ENOENT if not found, expired or obtained with a
+ * different policy
+ */
+int skae_cache_lookup(struct skae_cache *cache, const uint8_t *policy,
+		      const uint8_t *digest, int *verdict)
+{
+	struct skae_cache_entry *entry;
+	struct list_head *head;
+	int rc = -ENOENT;
+
+	pthread_mutex_lock(&cache->lock);
+	head = skae_cache_bucket(cache, digest);
+
+	list_for_each_entry(entry, head, hash) {
+		if (memcmp(entry->digest, digest, sizeof(entry->digest)))
+			continue;
+
+		if (entry->expire <= skae_cache_now() ||
+		    memcmp(entry->policy, policy, sizeof(entry->policy))) {
+			skae_cache_del(cache, entry);
+			break;
+		}
+
+		list_del(&entry->lru);
+		list_add(&entry->lru, &cache->lru);
+		*verdict = entry->verdict;
+		rc = 0;
+		break;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return rc;
+}
+
+/**
+ * Store a verification result
+ * @param[in] cache	cache
+ * @param[in] policy	SHA-256 digest of the verification policy
+ * @param[in] digest	SHA-256 digest of the certificate
+ * @param[in] verdict	result of skae_verify_x509()
+ *
+ * Only successful verifications are stored, so that a client failing for a
+ * transient reason is verified again at the next connection. Results are not
+ * stored if the policy changed meanwhile. If the cache is full, the least
+ * recently used result is replaced.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int skae_cache_add(struct skae_cache *cache, const uint8_t *policy,
+		   const uint8_t *digest, int verdict)
+{
+	struct skae_cache_entry *entry, *temp_entry;
+	struct list_head *head;
+	int rc = 0;
+
+	if (verdict != 1)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (memcmp(cache->policy, policy, sizeof(cache->policy)))
+		goto out;
+
+	head = skae_cache_bucket(cache, digest);
+
+	list_for_each_entry_safe(entry, temp_entry, head, hash) {
+		if (!memcmp(entry->digest, digest, sizeof(entry->digest))) {
+			skae_cache_del(cache, entry);
+			break;
+		}
+	}
+
+	if (cache->num_entries == cache->max_entries)
+		skae_cache_del(cache, list_last_entry(&cache->lru,
+				struct skae_cache_entry, lru));
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(entry->digest, digest, sizeof(entry->digest));
+	memcpy(entry->policy, policy, sizeof(entry->policy));
+	entry->expire = skae_cache_now() + cache->ttl;
+	entry->verdict = verdict;
+
+	list_add(&entry->hash, head);
+	list_add(&entry->lru, &cache->lru);
+	cache->num_entries++;
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return rc;
+}
+
+/**
+ * Release a cache of SKAE verification results
+ * @param[in] cache	cache
+ */
+void skae_cache_cleanup(struct skae_cache *cache)
+{
+	if (!cache)
+		return;
+
+	skae_cache_flush(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+/**
+ * Attach a cache of verification results to a SSL object for skae_callback()
+ * @param[in] ssl	SSL object
+ * @param[in] cache	cache
+ * @param[in] policy	SHA-256 digest of the policy used for the verification
+ *
+ * The policy must remain valid until the handshake is completed.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int skae_ssl_set_cache(SSL *ssl, struct skae_cache *cache,
+		       const uint8_t *policy)
+{
+	pthread_once(&skae_ssl_ex_data.once, skae_ssl_ex_data_init);
+
+	if (skae_ssl_ex_data.cache_idx < 0 || skae_ssl_ex_data.policy_idx < 0)
+		return -ENOMEM;
+
+	if (!SSL_set_ex_data(ssl, skae_ssl_ex_data.cache_idx, cache) ||
+	    !SSL_set_ex_data(ssl, skae_ssl_ex_data.policy_idx,
+			     (void *)policy))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Attach data and verifier contexts to a SSL object for skae_callback()
+ * @param[in] ssl	SSL object
+ * @param[in] d_ctx	data context
+ * @param[in] v_ctx	verifier context
+ *
+ * The contexts remain owned by the caller and must not be released before
+ * the handshake is completed. Thread-safe.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int skae_ssl_set_ctx(SSL *ssl, attest_ctx_data *d_ctx,
+		     attest_ctx_verifier *v_ctx)
+{
+	pthread_once(&skae_ssl_ex_data.once, skae_ssl_ex_data_init);
+
+	if (skae_ssl_ex_data.d_ctx_idx < 0 || skae_ssl_ex_data.v_ctx_idx < 0)
+		return -ENOMEM;
+
+	if (!SSL_set_ex_data(ssl, skae_ssl_ex_data.d_ctx_idx, d_ctx) ||
+	    !SSL_set_ex_data(ssl, skae_ssl_ex_data.v_ctx_idx, v_ctx))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Get data and verifier contexts attached to a SSL object
+ * @param[in] ssl	SSL object
+ * @param[in,out] d_ctx	data context
+ * @param[in,out] v_ctx	verifier context
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int skae_ssl_get_ctx(SSL *ssl, attest_ctx_data **d_ctx,
+		     attest_ctx_verifier **v_ctx)
+{
+	pthread_once(&skae_ssl_ex_data.once, skae_ssl_ex_data_init);
+
+	if (skae_ssl_ex_data.d_ctx_idx < 0 || skae_ssl_ex_data.v_ctx_idx < 0)
+		return -ENOENT;
+
+	*d_ctx = SSL_get_ex_data(ssl, skae_ssl_ex_data.d_ctx_idx);
+	*v_ctx = SSL_get_ex_data(ssl, skae_ssl_ex_data.v_ctx_idx);
+
+	if (!*d_ctx || !*v_ctx)
+		return -ENOENT;
+
+	return 0;
+}
+
+static int skae_verify_ssl_cert(SSL *ssl, X509 *cert)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct skae_cache *cache = NULL;
+	const uint8_t *policy = NULL;
+	struct verification_log *log;
+	attest_ctx_verifier *v_ctx;
+	attest_ctx_data *d_ctx;
+	unsigned int digest_len;
+	int verdict;
+
+	if (skae_ssl_get_ctx(ssl, &d_ctx, &v_ctx) < 0)
+		return 0;
+
+	if (skae_ssl_ex_data.cache_idx >= 0 && skae_ssl_ex_data.policy_idx >= 0) {
+		cache = SSL_get_ex_data(ssl, skae_ssl_ex_data.cache_idx);
+		policy = SSL_get_ex_data(ssl, skae_ssl_ex_data.policy_idx);
+	}
+
+	if (!policy ||
+	    (cache && !X509_digest(cert, EVP_sha256(), digest, &digest_len)))
+		cache = NULL;
+
+	if (cache && !skae_cache_lookup(cache, policy, digest, &verdict)) {
+		log = attest_ctx_verifier_add_log(v_ctx,
+					"lookup SKAE verification result");
+		attest_ctx_verifier_end_log(v_ctx, log, !verdict);
+		return verdict;
+	}
+
+	verdict = skae_verify_x509(d_ctx, v_ctx, cert);
+
+	if (cache)
+		skae_cache_add(cache, policy, digest, verdict);
+
+	return verdict;
+}
+
 /**
  * Callback function to be passed to SSL_CTX_set_verify()
  * @param[in] preverify	result of X509 verification
  * @param[in] x509_ctx	context for certificate chain verification
  *
+ * The data and verifier contexts are taken from the SSL object, and must be
+ * attached with skae_ssl_set_ctx() before the handshake. Verification fails
+ * if they are missing. If a cache was attached with skae_ssl_set_cache(), a
+ * result stored for the same certificate is returned without verification.
+ *
  * @returns 1 on success, 0 on error
  */
 int skae_callback(int preverify, X509_STORE_CTX* x509_ctx)
 {
 	X509* cert = X509_STORE_CTX_get_current_cert(x509_ctx);
 	STACK_OF(X509) *certs = X509_STORE_CTX_get_chain(x509_ctx);
+	SSL *ssl;
 
 	if (cert != sk_X509_value(certs, 0))
 		return 1;
 
-	return skae_verify_x509(attest_ctx_data_get_global(),
-				attest_ctx_verifier_get_global(), cert);
+	ssl = X509_STORE_CTX_get_ex_data(x509_ctx,
+					 SSL_get_ex_data_X509_STORE_CTX_idx());
+	if (!ssl)
+		return 0;
+
+	return skae_verify_ssl_cert(ssl, cert);
+}
+
+/**
+ * Verify the SKAE extension of the peer certificate after the handshake
+ * @param[in] ssl	SSL object
+ *
+ * Same as skae_callback(), for applications that don't want to block the
+ * handshake during the verification. The peer certificate must have been
+ * requested with SSL_VERIFY_PEER, and the application must not send or
+ * accept data before this function succeeds.
+ *
+ * @returns 1 on success, 0 on error
+ */
+int skae_verify_ssl(SSL *ssl)
+{
+	X509 *cert;
+	int rc;
+
+	cert = SSL_get_peer_certificate(ssl);
+	if (!cert)
+		return 0;
+
+	rc = skae_verify_ssl_cert(ssl, cert);
+	X509_free(cert);
+	return rc;
 }
 
 /**
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2019 Huawei Technologies Duesseldorf GmbH
+ *
+ * Author: Roberto Sassu <roberto.sassu@huawei.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * File: token.c
+ *      Attestation tokens.
+ */
+
+/**
+ * @defgroup token-api Attestation Token API
+ * @ingroup app-api
+ * @brief
+ * Functions to issue and verify attestation tokens
+ *
+ * An attestation token is issued by the server after a successful quote
+ * verification, and states that the platform identified by the AK
+ * certificate had the PCR digest found in the quote, calculated over the
+ * PCRs of the PCR selection, and satisfied the verifier requirements. Relying parties check the token with the public
+ * key of the server until the token expires, instead of verifying the quote
+ * and the event logs again.
+ *
+ * The token starts with struct attest_token_hdr, followed by the signature
+ * length (16 bit) and the signature of the header. The signature is
+ * calculated with SHA-256, except for EdDSA keys. Integers are in network
+ * byte order.
+ */
+
+/**
+ * @addtogroup token-api
+ *  @{
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <openssl/pem.h>
+
+#include "token.h"
+#include "list.h"
+
+/// @private
+struct attest_token_hdr {
+	uint8_t magic[ATTEST_TOKEN_MAGIC_LEN];
+	uint16_t version;
+	uint16_t pcr_digest_len;
+	uint64_t issued;
+	uint64_t expires;
+	uint8_t ak_digest[SHA256_DIGEST_LENGTH];
+	uint8_t req_digest[SHA256_DIGEST_LENGTH];
+	uint8_t pcr_digest[ATTEST_TOKEN_MAX_DIGEST_LEN];
+	uint16_t num_banks;
+	struct {
+		uint16_t alg;
+		uint32_t pcr_mask;
+	} __attribute__((packed)) banks[ATTEST_TOKEN_MAX_BANKS];
+} __attribute__((packed));
+
+/// @private
+struct token_key {
+	struct list_head list;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	EVP_PKEY *key;
+};
+
+static LIST_HEAD(token_keys);
+static pthread_mutex_t token_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const EVP_MD *token_md(EVP_PKEY *key)
+{
+	switch (EVP_PKEY_id(key)) {
+	case EVP_PKEY_ED25519:
+	case EVP_PKEY_ED448:
+		return NULL;
+	default:
+		return EVP_sha256();
+	}
+}
+
+/**
+ * Create a signed attestation token
+ * @param[in] key	private key of the server
+ * @param[in] token	token claims
+ * @param[in,out] len	token length
+ * @param[in,out] data	token
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_token_sign(EVP_PKEY *key, struct attest_token *token,
+		      size_t *len, uint8_t **data)
+{
+	struct attest_token_hdr hdr = { .magic = ATTEST_TOKEN_MAGIC };
+	EVP_MD_CTX *mdctx;
+	size_t sig_len;
+	uint16_t sig_len_be;
+	uint8_t *buf = NULL;
+	int rc = -EINVAL, i;
+
+	if (token->pcr_digest_len > sizeof(hdr.pcr_digest) ||
+	    token->num_banks > ATTEST_TOKEN_MAX_BANKS)
+		return -EINVAL;
+
+	hdr.version = htons(ATTEST_TOKEN_VERSION);
+	hdr.pcr_digest_len = htons(token->pcr_digest_len);
+	hdr.issued = htobe64(token->issued);
+	hdr.expires = htobe64(token->expires);
+	memcpy(hdr.ak_digest, token->ak_digest, sizeof(hdr.ak_digest));
+	memcpy(hdr.req_digest, token->req_digest, sizeof(hdr.req_digest));
+	memcpy(hdr.pcr_digest, token->pcr_digest, token->pcr_digest_len);
+
+	/* the PCR digest is meaningful only with the PCRs it covers */
+	hdr.num_banks = htons(token->num_banks);
+	for (i = 0; i < token->num_banks; i++) {
+		hdr.banks[i].alg = htons(token->banks[i].alg);
+		hdr.banks[i].pcr_mask = htonl(token->banks[i].pcr_mask);
+	}
+
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx)
+		return -ENOMEM;
+
+	if (EVP_DigestSignInit(mdctx, NULL, token_md(key), NULL, key) != 1)
+		goto out;
+
+	if (EVP_DigestSign(mdctx, NULL, &sig_len, (uint8_t *)&hdr,
+			   sizeof(hdr)) != 1 ||
+	    sig_len > ATTEST_TOKEN_MAX_SIG_LEN)
+		goto out;
+
+	buf = malloc(sizeof(hdr) + sizeof(sig_len_be) + sig_len);
+	if (!buf) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	if (EVP_DigestSign(mdctx, buf + sizeof(hdr) + sizeof(sig_len_be),
+			   &sig_len, (uint8_t *)&hdr, sizeof(hdr)) != 1) {
+		free(buf);
+		goto out;
+	}
+
+	sig_len_be = htons(sig_len);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &sig_len_be, sizeof(sig_len_be));
+
+	*data = buf;
+	*len = sizeof(hdr) + sizeof(sig_len_be) + sig_len;
+	rc = 0;
+out:
+	EVP_MD_CTX_free(mdctx);
+	return rc;
+}
+
+/**
+ * Verify an attestation token
+ * @param[in] key	public key of the server
+ * @param[in] len	token length
+ * @param[in] data	token
+ * @param[in,out] token	token claims
+ *
+ * @returns 0 on success, -EKEYEXPIRED if the token expired, a negative value
+ * on error
+ */
+int attest_token_verify(EVP_PKEY *key, size_t len, const uint8_t *data,
+			struct attest_token *token)
+{
+	struct attest_token_hdr hdr;
+	EVP_MD_CTX *mdctx;
+	uint16_t sig_len;
+	int rc = -EINVAL, i;
+
+	if (len < sizeof(hdr) + sizeof(sig_len))
+		return -EINVAL;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	memcpy(&sig_len, data + sizeof(hdr), sizeof(sig_len));
+	sig_len = ntohs(sig_len);
+
+	if (memcmp(hdr.magic, ATTEST_TOKEN_MAGIC, sizeof(hdr.magic)) ||
+	    ntohs(hdr.version) != ATTEST_TOKEN_VERSION ||
+	    ntohs(hdr.pcr_digest_len) > sizeof(hdr.pcr_digest) ||
+	    ntohs(hdr.num_banks) > ATTEST_TOKEN_MAX_BANKS ||
+	    len != sizeof(hdr) + sizeof(sig_len) + sig_len)
+		return -EINVAL;
+
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx)
+		return -ENOMEM;
+
+	if (EVP_DigestVerifyInit(mdctx, NULL, token_md(key), NULL, key) != 1)
+		goto out;
+
+	if (EVP_DigestVerify(mdctx, data + sizeof(hdr) + sizeof(sig_len),
+			     sig_len, data, sizeof(hdr)) != 1)
+		goto out;
+
+	token->issued = be64toh(hdr.issued);
+	token->expires = be64toh(hdr.expires);
+	memcpy(token->ak_digest, hdr.ak_digest, sizeof(token->ak_digest));
+	memcpy(token->req_digest, hdr.req_digest, sizeof(token->req_digest));
+	token->pcr_digest_len = ntohs(hdr.pcr_digest_len);
+	memcpy(token->pcr_digest, hdr.pcr_digest, token->pcr_digest_len);
+
+	token->num_banks = ntohs(hdr.num_banks);
+	for (i = 0; i < token->num_banks; i++) {
+		token->banks[i].alg = ntohs(hdr.banks[i].alg);
+		token->banks[i].pcr_mask = ntohl(hdr.banks[i].pcr_mask);
+	}
+
+	rc = 0;
+	if (time(NULL) >= token->expires)
+		rc = -EKEYEXPIRED;
+out:
+	EVP_MD_CTX_free(mdctx);
+	return rc;
+}
+
+/**
+ * Get the public key to verify attestation tokens
+ * @param[in] path	PEM file containing the public key of the server
+ * @param[in,out] key	public key (to be freed with EVP_PKEY_free())
+ *
+ * Keys are cached and read again only if the file changed.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_token_key_get(const char *path, EVP_PKEY **key)
+{
+	struct token_key *entry, *new_entry = NULL;
+	struct stat st;
+	FILE *fp;
+	int rc = 0;
+
+	if (stat(path, &st) == -1)
+		return -errno;
+
+	pthread_mutex_lock(&token_keys_lock);
+	list_for_each_entry(entry, &token_keys, list) {
+		if (strcmp(entry->path, path))
+			continue;
+
+		if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+		    entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    entry->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			goto out;
+
+		new_entry = entry;
+		break;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		rc = -errno;
+		goto out_unlock;
+	}
+
+	*key = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+	fclose(fp);
+
+	if (!*key) {
+		rc = -EINVAL;
+		goto out_unlock;
+	}
+
+	if (!new_entry) {
+		new_entry = calloc(1, sizeof(*new_entry));
+		if (!new_entry)
+			goto out_free_key;
+
+		new_entry->path = strdup(path);
+		if (!new_entry->path) {
+			free(new_entry);
+			goto out_free_key;
+		}
+
+		list_add(&new_entry->list, &token_keys);
+	}
+
+	EVP_PKEY_free(new_entry->key);
+	new_entry->key = *key;
+	new_entry->dev = st.st_dev;
+	new_entry->ino = st.st_ino;
+	new_entry->mtime = st.st_mtim;
+	entry = new_entry;
+out:
+	EVP_PKEY_up_ref(entry->key);
+	*key = entry->key;
+	goto out_unlock;
+out_free_key:
+	EVP_PKEY_free(*key);
+	*key = NULL;
+	rc = -ENOMEM;
+out_unlock:
+	pthread_mutex_unlock(&token_keys_lock);
+	return rc;
+}
+
+/**
+ * Remove the public keys from the cache
+ */
+void attest_token_key_cache_flush(void)
+{
+	struct token_key *entry, *tmp;
+
+	pthread_mutex_lock(&token_keys_lock);
+	list_for_each_entry_safe(entry, tmp, &token_keys, list) {
+		list_del(&entry->list);
+		EVP_PKEY_free(entry->key);
+		free(entry->path);
+		free(entry);
+	}
+	pthread_mutex_unlock(&token_keys_lock);
+}
+/** @}*/
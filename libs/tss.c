@@ -802,6 +802,88 @@ int attest_tss_pcrread(TSS_CONTEXT *tssContext, TPMI_DH_PCR pcr,
 	return 0;
 }
 
+#define PCR_READ_RETRIES 3
+
+/**
+ * Read multiple PCRs of the same bank
+ * @param[in] tssContext		TSS context
+ * @param[in] halg			PCR bank
+ * @param[in] pcr_mask			Selected PCRs
+ * @param[in,out] pcr_values		Array of IMPLEMENTATION_PCR elements
+ *
+ * The TPM returns at most eight digests per command, PCRs not returned are
+ * requested again with the next command. Values are read again if a PCR was
+ * extended between two commands.
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_tss_pcrread_multi(TSS_CONTEXT *tssContext, TPMI_ALG_HASH halg,
+			     uint32_t pcr_mask, TPMT_HA *pcr_values)
+{
+	TPMS_PCR_SELECTION *selection;
+	PCR_Read_In in;
+	PCR_Read_Out out;
+	uint32_t remaining, update_counter = 0;
+	int rc, i, j, retries = 0, first;
+
+retry:
+	remaining = pcr_mask;
+	first = 1;
+
+	while (remaining) {
+		in.pcrSelectionIn.count = 1;
+		selection = &in.pcrSelectionIn.pcrSelections[0];
+		selection->hash = halg;
+		selection->sizeofSelect = 3;
+		for (i = 0; i < 3; i++)
+			selection->pcrSelect[i] = (remaining >> (i * 8)) & 0xff;
+
+		rc = TSS_Execute(tssContext, (RESPONSE_PARAMETERS *)&out,
+				 (COMMAND_PARAMETERS *)&in, NULL,
+				 TPM_CC_PCR_Read, TPM_RH_NULL, NULL, 0);
+		if (rc) {
+			tss_print_error("TPM_CC_PCR_Read", rc);
+			return -EINVAL;
+		}
+
+		if (!out.pcrValues.count || !out.pcrSelectionOut.count) {
+			printf("PCR bank with alg %d not found\n", halg);
+			return -EINVAL;
+		}
+
+		if (!first && out.pcrUpdateCounter != update_counter) {
+			if (++retries == PCR_READ_RETRIES)
+				return -EAGAIN;
+
+			goto retry;
+		}
+
+		update_counter = out.pcrUpdateCounter;
+		first = 0;
+
+		/* digests are returned in the order of the selected PCRs */
+		selection = &out.pcrSelectionOut.pcrSelections[0];
+		for (i = 0, j = 0; i < IMPLEMENTATION_PCR &&
+		     j < out.pcrValues.count; i++) {
+			if (i / 8 >= selection->sizeofSelect ||
+			    !(selection->pcrSelect[i / 8] & (1 << (i % 8))))
+				continue;
+
+			pcr_values[i].hashAlg = halg;
+			memcpy((uint8_t *)&pcr_values[i].digest,
+			       out.pcrValues.digests[j].t.buffer,
+			       out.pcrValues.digests[j].t.size);
+			remaining &= ~(1 << i);
+			j++;
+		}
+
+		if (!j)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
 #define TYPE_ST                 2
 
 /**
@@ -974,7 +1056,6 @@ int attest_tss_quote(TSS_CONTEXT *tssContext, TPM_HANDLE ak_handle,
 	}
 
 	in.signHandle = ak_handle;
-	in.PCRselect.count = 1;
 	in.PCRselect = *pcrSelection;
 
 	if (nonce_len > sizeof(in.qualifyingData.t.buffer))
@@ -1038,6 +1119,40 @@ int attest_tss_check_key(TSS_CONTEXT *tssContext, TPM_HANDLE keyHandle)
 	return 0;
 }
 
+/**
+ * Read the public part of a loaded key
+ * @param[in] tssContext	TSS context
+ * @param[in] keyHandle		Key handle
+ * @param[in,out] public_len	Public part length
+ * @param[in,out] public	Public part
+ *
+ * @returns 0 on success, a negative value on error
+ */
+int attest_tss_readpublic(TSS_CONTEXT *tssContext, TPM_HANDLE keyHandle,
+			  UINT16 *public_len, BYTE **public)
+{
+	ReadPublic_In in;
+	ReadPublic_Out out;
+	int rc;
+
+	in.objectHandle = keyHandle;
+
+	rc = TSS_Execute(tssContext, (RESPONSE_PARAMETERS *)&out,
+			 (COMMAND_PARAMETERS *)&in, NULL, TPM_CC_ReadPublic,
+			 TPM_RH_NULL, NULL, 0);
+	if (rc)
+		return -ENOENT;
+
+	*public = NULL;
+	*public_len = 0;
+	rc = TSS_Structure_Marshal(public, public_len, &out.outPublic,
+				(MarshalFunction_t)TSS_TPM2B_PUBLIC_Marshal);
+	if (rc)
+		return -ENOMEM;
+
+	return 0;
+}
+
 /**
  * Make primary key as permanent
  * @param[in] tssContext	TSS context
@@ -48,7 +48,10 @@
 #define DECODED_BLOCK_SIZE 48
 #define ENCODED_BLOCK_SIZE 65
 
-int attest_util_read_file(const char *path, size_t *len, unsigned char **data)
+#define SEQ_FILE_MIN_SIZE 4096
+
+static int attest_util_mmap_file(const char *path, size_t *len,
+				 unsigned char **data, int prot)
 {
 	struct stat st;
 	int rc = 0, fd;
@@ -62,7 +65,7 @@ int attest_util_read_file(const char *path, size_t *len, unsigned char **data)
 
 	*len = st.st_size;
 
-	*data = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	*data = mmap(NULL, *len, prot, MAP_PRIVATE, fd, 0);
 	if (*data == MAP_FAILED)
 		rc = -ENOMEM;
 
@@ -70,60 +73,96 @@ int attest_util_read_file(const char *path, size_t *len, unsigned char **data)
 	return rc;
 }
 
+int attest_util_read_file(const char *path, size_t *len, unsigned char **data)
+{
+	return attest_util_mmap_file(path, len, data, PROT_READ | PROT_WRITE);
+}
+
+int attest_util_map_file(const char *path, size_t *len, unsigned char **data)
+{
+	return attest_util_mmap_file(path, len, data, PROT_READ);
+}
+
 int attest_util_read_seq_file(const char *path, size_t *len,
 			      unsigned char **data)
 {
-	unsigned char buf[512], *buf_ptr = buf;
-	size_t total_len = 0, cur_len, buf_len = sizeof(buf);
+	return attest_util_read_seq_file_from(path, 0, len, data);
+}
+
+int attest_util_read_seq_file_from(const char *path, off_t offset,
+				   size_t *len, unsigned char **data)
+{
+	unsigned char *buf = NULL, *new_buf;
+	size_t total_len = 0, buf_len = SEQ_FILE_MIN_SIZE;
+	ssize_t cur_len;
+	struct stat st;
 	int rc = 0, fd;
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return -EACCES;
 
-	*data = NULL;
-again:
-	if (*data) {
-		close(fd);
-		fd = open(path, O_RDONLY);
-		if (fd < 0) {
-			free (*data);
-			return -EACCES;
-		}
+	if (offset && lseek(fd, offset, SEEK_SET) != offset) {
+		rc = -ERANGE;
+		goto out;
 	}
 
-	while (buf_len) {
-		cur_len = read(fd, buf_ptr, buf_len);
-		if (cur_len <= 0) {
-			if (*data) {
-				if (buf_len)
-					return -EIO;
-
-				break;
+	/*
+	 * The size of sequential files is not known in advance, read them
+	 * into a buffer that grows geometrically. Regular files are read with
+	 * one allocation, plus the terminator and the byte to detect the end.
+	 */
+	if (!fstat(fd, &st) && st.st_size > offset)
+		buf_len = st.st_size - offset + 2;
+
+	while (1) {
+		if (!buf || total_len + 1 == buf_len) {
+			if (buf)
+				buf_len *= 2;
+
+			new_buf = realloc(buf, buf_len);
+			if (!new_buf) {
+				rc = -ENOMEM;
+				goto out;
 			}
 
-			if (!total_len)
-				return -EIO;
-
-			*data = malloc(total_len + 1);
-			if (!*data)
-				return -ENOMEM;
+			buf = new_buf;
+		}
 
-			(*data)[total_len] = '\0';
+		cur_len = read(fd, buf + total_len, buf_len - total_len - 1);
+		if (cur_len < 0 && errno == EINTR)
+			continue;
 
-			buf_ptr = *data;
-			buf_len = *len = total_len;
-			goto again;
+		if (cur_len < 0) {
+			rc = -EIO;
+			goto out;
 		}
 
-		if (*data) {
-			buf_ptr += cur_len;
-			buf_len -= cur_len;
-		} else {
-			total_len += cur_len;
-		}
+		if (!cur_len)
+			break;
+
+		total_len += cur_len;
 	}
 
+	if (!total_len && !offset) {
+		rc = -EIO;
+		goto out;
+	}
+
+	/* nothing after the offset is not an error, the file did not grow */
+	if (!total_len) {
+		free(buf);
+		buf = NULL;
+	} else {
+		buf[total_len] = '\0';
+	}
+
+	*data = buf;
+	*len = total_len;
+out:
+	if (rc)
+		free(buf);
+
 	close(fd);
 	return rc;
 }
@@ -145,12 +184,59 @@ int attest_util_write_file(const char *path, size_t len, unsigned char *data,
 	return rc;
 }
 
+static int attest_util_copy_file_range(const char *path_source,
+				       const char *path_dest)
+{
+	struct stat st;
+	ssize_t cur_len;
+	size_t len;
+	int rc = 0, fd_source, fd_dest;
+
+	fd_source = open(path_source, O_RDONLY);
+	if (fd_source < 0)
+		return -EACCES;
+
+	if (fstat(fd_source, &st) == -1) {
+		rc = -EACCES;
+		goto out;
+	}
+
+	fd_dest = open(path_dest, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd_dest < 0) {
+		rc = -EACCES;
+		goto out;
+	}
+
+	/* the kernel shares extents (reflink) if the filesystem supports it */
+	for (len = st.st_size; len > 0; len -= cur_len) {
+		cur_len = copy_file_range(fd_source, NULL, fd_dest, NULL, len,
+					  0);
+		if (cur_len <= 0) {
+			rc = (cur_len < 0) ? -errno : -EIO;
+			break;
+		}
+	}
+
+	close(fd_dest);
+
+	if (rc)
+		unlink(path_dest);
+out:
+	close(fd_source);
+	return rc;
+}
+
 int attest_util_copy_file(const char *path_source, const char *path_dest)
 {
 	unsigned char *data;
 	size_t len;
 	int rc;
 
+	rc = attest_util_copy_file_range(path_source, path_dest);
+	if (rc != -EXDEV && rc != -ENOSYS && rc != -EINVAL &&
+	    rc != -EOPNOTSUPP)
+		return rc;
+
 	rc = attest_util_read_file(path_source, &len, &data);
 	if (rc)
 		return rc;
@@ -163,7 +249,8 @@ int attest_util_copy_file(const char *path_source, const char *path_dest)
 static int attest_util_rw_buf(int fd, unsigned char *buf, size_t buf_len,
 			      int op)
 {
-	size_t processed = 0, cur_processed;
+	size_t processed = 0;
+	ssize_t cur_processed;
 
 	while (processed < buf_len) {
 		if (op == O_RDONLY)
@@ -370,8 +457,12 @@ int attest_util_check_mask(int mask_in_len, uint8_t *mask_in,
 		return -EINVAL;
 
 	for (i = 0; i < mask_ref_len; i++) {
-		if (i > mask_in_len && mask_ref[i])
-			return -ENOENT;
+		if (i >= mask_in_len) {
+			if (mask_ref[i])
+				return -ENOENT;
+
+			continue;
+		}
 
 		if ((mask_in[i] & mask_ref[i]) != mask_ref[i])
 			return -ENOENT;
@@ -417,6 +508,138 @@ out:
 	return rc;
 }
 
+/*
+ * Merkle tree of nonces (RFC 6962 hashing): leaves are SHA-256(0x00 || nonce),
+ * nodes are SHA-256(0x01 || left || right). The last node of a level with odd
+ * number of nodes is moved to the next level.
+ */
+static int merkle_hash(uint8_t prefix, const uint8_t *data1, size_t len1,
+		       const uint8_t *data2, size_t len2, uint8_t *digest)
+{
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+	int rc = -EINVAL;
+
+	if (mdctx == NULL)
+		return -ENOMEM;
+
+	if (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1 ||
+	    EVP_DigestUpdate(mdctx, &prefix, sizeof(prefix)) != 1 ||
+	    EVP_DigestUpdate(mdctx, data1, len1) != 1 ||
+	    (data2 && EVP_DigestUpdate(mdctx, data2, len2) != 1) ||
+	    EVP_DigestFinal_ex(mdctx, digest, NULL) != 1)
+		goto out;
+
+	rc = 0;
+out:
+	EVP_MD_CTX_destroy(mdctx);
+	return rc;
+}
+
+int attest_util_merkle_proof(int num_leaves, const uint8_t *leaves[],
+			     const size_t leaf_lens[], int index,
+			     uint8_t *root, size_t *proof_len, uint8_t **proof)
+{
+	uint8_t *nodes, *proof_ptr = NULL;
+	int rc = 0, num = num_leaves, i;
+
+	if (num_leaves < 1 || index < 0 || index >= num_leaves)
+		return -EINVAL;
+
+	nodes = malloc(num_leaves * MERKLE_HASH_LEN);
+	if (!nodes)
+		return -ENOMEM;
+
+	if (proof) {
+		/* one entry per level at most */
+		*proof = proof_ptr = malloc(sizeof(int) * 8 *
+					    MERKLE_PROOF_ENTRY_LEN);
+		if (!proof_ptr) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < num_leaves; i++) {
+		rc = merkle_hash(0x00, leaves[i], leaf_lens[i], NULL, 0,
+				 nodes + i * MERKLE_HASH_LEN);
+		if (rc < 0)
+			goto out;
+	}
+
+	while (num > 1) {
+		if (proof_ptr && (index ^ 1) < num) {
+			*proof_ptr = (index & 1) ? MERKLE_PROOF_LEFT :
+						   MERKLE_PROOF_RIGHT;
+			memcpy(proof_ptr + 1, nodes + (index ^ 1) *
+			       MERKLE_HASH_LEN, MERKLE_HASH_LEN);
+			proof_ptr += MERKLE_PROOF_ENTRY_LEN;
+		}
+
+		for (i = 0; i < num / 2; i++) {
+			rc = merkle_hash(0x01,
+					 nodes + 2 * i * MERKLE_HASH_LEN,
+					 MERKLE_HASH_LEN,
+					 nodes + (2 * i + 1) * MERKLE_HASH_LEN,
+					 MERKLE_HASH_LEN,
+					 nodes + i * MERKLE_HASH_LEN);
+			if (rc < 0)
+				goto out;
+		}
+
+		if (num % 2)
+			memmove(nodes + i * MERKLE_HASH_LEN,
+				nodes + (num - 1) * MERKLE_HASH_LEN,
+				MERKLE_HASH_LEN);
+
+		num = (num + 1) / 2;
+		index /= 2;
+	}
+
+	memcpy(root, nodes, MERKLE_HASH_LEN);
+
+	if (proof)
+		*proof_len = proof_ptr - *proof;
+out:
+	if (rc < 0 && proof) {
+		free(*proof);
+		*proof = NULL;
+	}
+
+	free(nodes);
+	return rc;
+}
+
+int attest_util_merkle_root(const uint8_t *leaf, size_t leaf_len,
+			    const uint8_t *proof, size_t proof_len,
+			    uint8_t *root)
+{
+	const uint8_t *proof_ptr;
+	int rc;
+
+	if (proof_len % MERKLE_PROOF_ENTRY_LEN)
+		return -EINVAL;
+
+	rc = merkle_hash(0x00, leaf, leaf_len, NULL, 0, root);
+
+	for (proof_ptr = proof; !rc && proof_ptr < proof + proof_len;
+	     proof_ptr += MERKLE_PROOF_ENTRY_LEN) {
+		switch (*proof_ptr) {
+		case MERKLE_PROOF_LEFT:
+			rc = merkle_hash(0x01, proof_ptr + 1, MERKLE_HASH_LEN,
+					 root, MERKLE_HASH_LEN, root);
+			break;
+		case MERKLE_PROOF_RIGHT:
+			rc = merkle_hash(0x01, root, MERKLE_HASH_LEN,
+					 proof_ptr + 1, MERKLE_HASH_LEN, root);
+			break;
+		default:
+			rc = -EINVAL;
+		}
+	}
+
+	return rc;
+}
+
 /**
  * @name Kernel Functions
  *  @{
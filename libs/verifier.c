@@ -18,6 +18,10 @@
  * @brief
  * Functions to verify TPM specific data structures (e.g. quote or certify
  * info).
+ *
+ * Verification state and failure logs are stored in the verifier context
+ * passed by the caller, so that different threads can verify at the same time
+ * with different contexts.
  */
 
 /**
@@ -145,7 +149,7 @@ static int attest_verifier_check_policy_digest(attest_ctx_data *d_ctx,
 	head = &d_ctx->ctx_data[policy_field];
 
 	list_for_each_entry(policy, head, list) {
-		policy_bin = malloc(policy->len / 2);
+		policy_bin = attest_arena_alloc(&v_ctx->arena, policy->len / 2);
 		check_goto(!policy_bin, -ENOMEM, out, v_ctx, "out of memory");
 		rc = _hex2bin(policy_bin, (const char *)policy->data,
 			      policy->len / 2);
@@ -156,8 +160,6 @@ static int attest_verifier_check_policy_digest(attest_ctx_data *d_ctx,
 				       TSS_GetDigestSize(digest.hashAlg),
 				       (BYTE *)&digest.digest,
 				       policy->len / 2, policy_bin, 0, NULL);
-
-		free(policy_bin);
 		check_goto(rc, -EINVAL, out, v_ctx,
 			   "TSS_Hash_Generate() error: %d", rc);
 	}
@@ -243,6 +245,21 @@ out:
 	return rc;
 }
 
+/* at least one bank must include the required PCRs */
+static int attest_verifier_check_selection_mask(TPML_PCR_SELECTION *pcrs,
+						int pcr_mask_len,
+						uint8_t *pcr_mask)
+{
+	int rc = -ENOENT, i;
+
+	for (i = 0; i < pcrs->count && rc; i++)
+		rc = attest_util_check_mask(pcrs->pcrSelections[i].sizeofSelect,
+					    pcrs->pcrSelections[i].pcrSelect,
+					    pcr_mask_len, pcr_mask);
+
+	return rc;
+}
+
 static int attest_verifier_check_pcrs(attest_ctx_data *d_ctx,
 				      attest_ctx_verifier *v_ctx,
 				      TPM_ALG_ID hashAlg,
@@ -260,17 +277,18 @@ static int attest_verifier_check_pcrs(attest_ctx_data *d_ctx,
 		goto out;
 	}
 
+	/* the PCR buffer is freed with the context, to be reused after reset */
 	rc = attest_pcr_init(v_ctx);
 	if (rc)
 		goto out;
 
+	attest_pcr_select_banks(v_ctx, pcr_selection);
+
 	rc = attest_event_log_parse_verify(d_ctx, v_ctx, 1);
 	if (rc)
-		goto out_cleanup;
+		goto out;
 
 	rc = attest_pcr_verify(v_ctx, pcr_selection, hashAlg, pcr_digest);
-out_cleanup:
-	attest_pcr_cleanup(v_ctx);
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);
 	return rc;
@@ -307,38 +325,36 @@ int attest_verifier_check_key_policy(attest_ctx_data *d_ctx,
 
 	list_for_each_entry(policy, head, list) {
 		policy_bin_len = policy->len / 2;
-		policy_bin_ptr = policy_bin = malloc(policy_bin_len);
+		policy_bin_ptr = policy_bin = attest_arena_alloc(&v_ctx->arena,
+								policy_bin_len);
 		check_goto(!policy_bin, -ENOMEM, out, v_ctx, "out of memory");
 
 		rc = _hex2bin(policy_bin, (const char *)policy->data,
 			      policy_bin_len);
-		check_goto(rc, -EINVAL, out_free, v_ctx,
+		check_goto(rc, -EINVAL, out, v_ctx,
 			   "policy hex -> bin conversion error");
 
 		rc = TPM_CC_Unmarshal(&code, &policy_bin_ptr, &policy_bin_len);
-		check_goto(rc, -EINVAL, out_free, v_ctx,
+		check_goto(rc, -EINVAL, out, v_ctx,
 			   "TPM_CC_Unmarshal() error: %d", rc);
 
-		if (code != TPM_CC_PolicyPCR) {
-			free(policy_bin);
+		if (code != TPM_CC_PolicyPCR)
 			continue;
-		}
 
 		rc = TPML_PCR_SELECTION_Unmarshal(&pcrs, &policy_bin_ptr,
 						  &policy_bin_len);
-		check_goto(rc, -EINVAL, out_free, v_ctx,
+		check_goto(rc, -EINVAL, out, v_ctx,
 			   "TPML_PCR_SELECTION_Unmarshal() error: %d", rc);
 
-		rc = attest_util_check_mask(pcrs.pcrSelections[0].sizeofSelect,
-				pcrs.pcrSelections[0].pcrSelect,
-			        pcr_mask_len ?
+		rc = attest_verifier_check_selection_mask(&pcrs,
+				pcr_mask_len ?
 				pcr_mask_len : sizeof(v_ctx->pcr_mask),
 				pcr_mask_len ? pcr_mask : v_ctx->pcr_mask);
-		check_goto(rc, rc, out_free, v_ctx,
+		check_goto(rc, rc, out, v_ctx,
 			   "PCR mask requirement not satisfied");
 
 		check_goto(policy_bin_len < TSS_GetDigestSize(hashAlg), -EINVAL,
-			   out_free, v_ctx,
+			   out, v_ctx,
 			   "insufficient data, expected: %d, current: %d",
 			   TSS_GetDigestSize(hashAlg), policy_bin_len);
 
@@ -346,8 +362,6 @@ int attest_verifier_check_key_policy(attest_ctx_data *d_ctx,
 						policy_bin_ptr, parse_logs);
 		break;
 	}
-out_free:
-	free(policy_bin);
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);
 	return rc;
@@ -396,9 +410,9 @@ static int attest_verifier_check_quote_pcr_mask(attest_ctx_data *d_ctx,
 
 	pcrs = &quote_info->pcrSelect;
 
-	rc = attest_util_check_mask(pcrs->pcrSelections[0].sizeofSelect,
-				    pcrs->pcrSelections[0].pcrSelect,
-				    sizeof(v_ctx->pcr_mask), v_ctx->pcr_mask);
+	rc = attest_verifier_check_selection_mask(pcrs,
+						  sizeof(v_ctx->pcr_mask),
+						  v_ctx->pcr_mask);
 	check_goto(rc, rc, out, v_ctx, "PCR mask requirement not satisfied");
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);
@@ -410,7 +424,8 @@ static int attest_verifier_check_extra_data(attest_ctx_data *d_ctx,
 					    TPM2B_DATA *extraData)
 {
 	struct verification_log *log;
-	struct data_item *nonce;
+	struct data_item *nonce, *proof;
+	uint8_t root[MERKLE_HASH_LEN];
 	int rc;
 
 	log = attest_ctx_verifier_add_log(v_ctx, "check extra data");
@@ -418,6 +433,21 @@ static int attest_verifier_check_extra_data(attest_ctx_data *d_ctx,
 	nonce = attest_ctx_data_get(d_ctx, CTX_NONCE);
 	check_goto(!nonce, -ENOENT, out, v_ctx, "Nonce not provided");
 
+	/* the quote is over the root of a Merkle tree including the nonce */
+	proof = attest_ctx_data_get(d_ctx, CTX_NONCE_PROOF);
+	if (proof) {
+		rc = attest_util_merkle_root(nonce->data, nonce->len,
+					     proof->data, proof->len, root);
+		check_goto(rc, rc, out, v_ctx, "invalid nonce proof");
+
+		check_goto(extraData->t.size != sizeof(root), -EINVAL, out,
+			   v_ctx, "extra data length mismatch");
+
+		rc = memcmp(root, extraData->t.buffer, sizeof(root));
+		check_goto(rc, -EINVAL, out, v_ctx, "nonce proof mismatch");
+		goto out;
+	}
+
 	check_goto(nonce->len != extraData->t.size, -EINVAL, out, v_ctx,
 		   "extra data length mismatch");
 
@@ -19,6 +19,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -26,19 +28,46 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 #include "enroll_client.h"
+#include "token.h"
+#include "ctx_json.h"
+#include "ctx_tlv.h"
 #include "util.h"
 #include "conf.h"
+#include "event_log/ima.h"
 
 #define SERVER_HOSTNAME "test-server"
 #define SERVER_PORT "3000"
 
-static int send_receive(char *test_server_fqdn, int op, char *message_in,
-			char **message_out)
+#define MAX_SERVERS 16
+
+/* connection kept open for all the requests of a session */
+struct server_conn {
+	char *fqdn;
+	int fd;
+	/* protocol version used on the connection */
+	int version;
+	/* event logs are compressed */
+	int zstd;
+};
+
+/* highest protocol version to request */
+static int max_version = RA_PROTOCOL_VERSION;
+
+static void server_disconnect(struct server_conn *s)
+{
+	if (s->fd < 0)
+		return;
+
+	close(s->fd);
+	s->fd = -1;
+}
+
+static int server_open(struct server_conn *s)
 {
 	struct addrinfo hints, *result = NULL, *rp;
-	size_t len;
 	int rc, fd = -1;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
@@ -47,9 +76,9 @@ static int send_receive(char *test_server_fqdn, int op, char *message_in,
 	hints.ai_flags = 0;
 	hints.ai_protocol = 0;
 
-	rc = getaddrinfo(test_server_fqdn, SERVER_PORT, &hints, &result);
+	rc = getaddrinfo(s->fqdn, SERVER_PORT, &hints, &result);
 	if (rc)
-		goto out;
+		return -EIO;
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		fd = socket(rp->ai_family, rp->ai_socktype,
@@ -65,47 +94,460 @@ static int send_receive(char *test_server_fqdn, int op, char *message_in,
 
 	freeaddrinfo(result);
 
-	if (!rp) {
-		rc = -EIO;
+	if (!rp)
+		return -EIO;
+
+	s->fd = fd;
+	s->version = 1;
+	s->zstd = 0;
+	return 0;
+}
+
+static int send_header(struct server_conn *s, int op, size_t message_len)
+{
+	size_t len = message_len + sizeof(len) * 2;
+	uint32_t hdr[2];
+	int rc;
+
+	if (s->version > 1) {
+		hdr[0] = htonl(message_len);
+		hdr[1] = htonl(op);
+		return attest_util_write_buf(s->fd, (uint8_t *)hdr,
+					     sizeof(hdr));
+	}
+
+	rc = attest_util_write_buf(s->fd, (uint8_t *)&len, sizeof(len));
+	if (rc)
+		return rc;
+
+	return attest_util_write_buf(s->fd, (uint8_t *)&op, sizeof(op));
+}
+
+static int receive_response(struct server_conn *s, char **message_out)
+{
+	uint32_t hdr[2];
+	size_t len;
+	int rc;
+
+	if (s->version > 1) {
+		rc = attest_util_read_buf(s->fd, (uint8_t *)hdr, sizeof(hdr));
+		if (rc)
+			return rc;
+
+		if (hdr[0])
+			return -(int)ntohl(hdr[0]);
+
+		len = ntohl(hdr[1]);
+
+		*message_out = malloc(len + 1);
+		if (!*message_out)
+			return -ENOMEM;
+
+		(*message_out)[len] = '\0';
+
+		rc = attest_util_read_buf(s->fd, (uint8_t *)*message_out, len);
+		if (rc)
+			return rc;
+
+		return attest_ctx_msg_check(*message_out, len);
+	}
+
+	rc = attest_util_read_buf(s->fd, (uint8_t *)&len, sizeof(len));
+	if (rc)
+		return rc;
+
+	if (len == 0)
+		return -EINVAL;
+
+	*message_out = malloc(len);
+	if (!*message_out)
+		return -ENOMEM;
+
+	len -= sizeof(len);
+
+	return attest_util_read_buf(s->fd, (uint8_t *)*message_out, len);
+}
+
+static int server_negotiate(struct server_conn *s)
+{
+	char version_str[16], *message_out = NULL;
+	int rc;
+
+	snprintf(version_str, sizeof(version_str), "%d%s", max_version,
+		 attest_ctx_tlv_zstd_supported() ? " " RA_FEATURE_ZSTD : "");
+
+	rc = send_header(s, RA_OP_NEGOTIATE, strlen(version_str));
+	if (!rc)
+		rc = attest_util_write_buf(s->fd, (uint8_t *)version_str,
+					   strlen(version_str));
+	if (!rc)
+		rc = receive_response(s, &message_out);
+	if (!rc) {
+		s->version = atoi(message_out);
+		s->zstd = (strstr(message_out, " " RA_FEATURE_ZSTD) != NULL);
+	}
+
+	free(message_out);
+	return rc;
+}
+
+static int server_connect(struct server_conn *s)
+{
+	int rc = 0;
+
+	if (s->fd >= 0)
+		goto out;
+
+	rc = server_open(s);
+	if (rc || max_version == 1)
 		goto out;
+
+	/* servers without negotiation close the connection after an error */
+	rc = server_negotiate(s);
+	if (rc) {
+		server_disconnect(s);
+		max_version = 1;
+
+		rc = server_open(s);
+		if (rc)
+			return rc;
 	}
+out:
+	/* messages are created in the format supported by the server */
+	if (s->version == 1)
+		attest_enroll_msg_set_format(CTX_MSG_JSON);
+	else if (s->zstd)
+		attest_enroll_msg_set_format(CTX_MSG_TLV_ZSTD);
+	else
+		attest_enroll_msg_set_format(CTX_MSG_TLV);
+	return rc;
+}
+
+static int send_request(struct server_conn *s, int op, char *message_in)
+{
+	size_t len;
+	int rc;
+
+	rc = server_connect(s);
+	if (rc)
+		return rc;
+
+	len = attest_ctx_msg_len(message_in);
+
+	rc = send_header(s, op, len);
+	if (!rc)
+		rc = attest_util_write_buf(s->fd, (uint8_t *)message_in, len);
+	if (rc)
+		server_disconnect(s);
+
+	return rc;
+}
+
+static int send_receive(struct server_conn *s, int op, char *message_in,
+			char **message_out)
+{
+	int rc;
+
+	rc = send_request(s, op, message_in);
+	if (rc)
+		return rc;
+
+	rc = receive_response(s, message_out);
+
+	/* servers without negotiation close the connection after a response */
+	if (rc || s->version == 1)
+		server_disconnect(s);
+
+	return rc;
+}
 
-	len = strlen(message_in);
-	len += sizeof(len) * 2;
+static int send_receive_ctx(struct server_conn *s, int op,
+			    attest_ctx_data *d_ctx, char **message_out)
+{
+	size_t len;
+	int rc;
 
-	rc = attest_util_write_buf(fd, (uint8_t *)&len, sizeof(len));
+	rc = server_connect(s);
+	if (rc)
+		return rc;
+
+	if (s->version > 1 && s->zstd)
+		rc = attest_ctx_data_tlv_compress(d_ctx);
 	if (rc)
 		goto out;
 
-	rc = attest_util_write_buf(fd, (uint8_t *)&op, sizeof(op));
+	if (s->version > 1)
+		rc = attest_ctx_data_tlv_len(d_ctx, &len);
+	else
+		rc = attest_ctx_data_json_len(d_ctx, &len);
 	if (rc)
 		goto out;
 
-	rc = attest_util_write_buf(fd, (uint8_t *)message_in,
-				   len - sizeof(len) * 2);
+	rc = send_header(s, op, len);
 	if (rc)
 		goto out;
 
-	rc = attest_util_read_buf(fd, (uint8_t *)&len, sizeof(len));
+	/* serialize data directly to the socket */
+	if (s->version > 1)
+		rc = attest_ctx_data_write_tlv(d_ctx, s->fd);
+	else
+		rc = attest_ctx_data_write_json(d_ctx, s->fd);
 	if (rc)
 		goto out;
 
-	if (len == 0) {
-		rc = -EINVAL;
+	rc = receive_response(s, message_out);
+out:
+	if (rc || s->version == 1)
+		server_disconnect(s);
+
+	return rc;
+}
+
+/* servers without negotiation don't keep the AK certificate of the session */
+static int evidence_add_ak_cert(struct server_conn **servers, int num_servers,
+				attest_ctx_data *evidence)
+{
+	int i;
+
+	if (attest_ctx_data_get(evidence, CTX_AK_CERT))
+		return 0;
+
+	for (i = 0; i < num_servers; i++)
+		if (servers[i]->version == 1)
+			return attest_ctx_data_add_file(evidence, CTX_AK_CERT,
+							AK_CERT_PATH, NULL);
+
+	return 0;
+}
+
+struct quote_evidence {
+	int kernel_bios_log;
+	int kernel_ima_log;
+	int send_unsigned_files;
+	int ima_delta;
+	attest_ctx_data *evidence;
+	int rc;
+};
+
+static void *quote_evidence_thread(void *arg)
+{
+	struct quote_evidence *e = arg;
+
+	e->rc = attest_enroll_msg_quote_evidence(PRIVACY_CA_DIR,
+						 e->kernel_bios_log,
+						 e->kernel_ima_log,
+						 e->send_unsigned_files,
+						 e->ima_delta, &e->evidence);
+	return NULL;
+}
+
+static void print_digest(const char *name, const uint8_t *digest, size_t len)
+{
+	char hex[ATTEST_TOKEN_MAX_DIGEST_LEN * 2 + 1];
+
+	_bin2hex(hex, digest, len);
+	hex[len * 2] = '\0';
+	printf("%s: %s\n", name, hex);
+}
+
+static int verify_token(char *token_path, char *token_pubkey_path)
+{
+	struct attest_token token;
+	EVP_PKEY *key = NULL;
+	uint8_t *data = NULL;
+	size_t len;
+	int rc, i;
+
+	rc = attest_token_key_get(token_pubkey_path, &key);
+	if (rc < 0) {
+		printf("Cannot read token public key %s\n", token_pubkey_path);
+		return rc;
+	}
+
+	rc = attest_util_read_seq_file(token_path, &len, &data);
+	if (rc < 0)
+		goto out;
+
+	rc = attest_token_verify(key, len, data, &token);
+	if (rc == -EKEYEXPIRED)
+		printf("expired token\n");
+	if (rc < 0)
+		goto out;
+
+	print_digest("ak_cert", token.ak_digest, sizeof(token.ak_digest));
+	print_digest("pcr", token.pcr_digest, token.pcr_digest_len);
+	for (i = 0; i < token.num_banks; i++)
+		printf("pcr bank: 0x%04x, mask: 0x%08x\n",
+		       token.banks[i].alg, token.banks[i].pcr_mask);
+	print_digest("requirements", token.req_digest,
+		     sizeof(token.req_digest));
+	printf("expires: %llu\n", (unsigned long long)token.expires);
+out:
+	free(data);
+	EVP_PKEY_free(key);
+	attest_token_key_cache_flush();
+	return rc;
+}
+
+static int send_quote(struct server_conn *s,
+		      struct quote_evidence *quote_evidence,
+		      char *pcr_alg_name, char *pcr_list_str, char *token_path)
+{
+	char *message_out = NULL, *message_in = NULL;
+	pthread_t quote_evidence_tid;
+	int rc;
+
+	rc = attest_enroll_msg_quote_nonce_request(&message_out);
+	if (rc < 0)
+		return rc;
+
+	/* collect evidence while the server generates the nonce */
+	rc = pthread_create(&quote_evidence_tid, NULL, quote_evidence_thread,
+			    quote_evidence);
+	if (rc) {
+		rc = -rc;
 		goto out;
 	}
 
-	*message_out = malloc(len);
-	if (!*message_out) {
-		rc = -ENOMEM;
+	rc = send_receive(s, 3, message_out, &message_in);
+
+	pthread_join(quote_evidence_tid, NULL);
+	if (!rc)
+		rc = quote_evidence->rc;
+	if (rc < 0)
+		goto out;
+
+	rc = attest_enroll_msg_quote_finish(quote_evidence->evidence,
+					    pcr_alg_name, pcr_list_str,
+					    message_in);
+	if (rc < 0)
 		goto out;
+
+	free(message_in);
+	message_in = NULL;
+
+	rc = evidence_add_ak_cert(&s, 1, quote_evidence->evidence);
+	if (rc < 0)
+		goto out;
+
+	rc = send_receive_ctx(s, 4, quote_evidence->evidence, &message_in);
+	if (!rc)
+		printf("successful verification\n");
+	else
+		printf("failed verification\n");
+
+	if (!rc)
+		rc = attest_enroll_msg_quote_response(message_in, token_path);
+out:
+	free(message_out);
+	free(message_in);
+	return rc;
+}
+
+/*
+ * Nonce requests are sent to all servers before reading the responses, and
+ * the TPM quotes once over the Merkle root of the received nonces. Each
+ * server then gets the evidence with its nonce and inclusion proof, and its
+ * verification result is stored in results.
+ */
+static int send_quote_batch(struct server_conn **servers, int num_servers,
+			    struct quote_evidence *quote_evidence,
+			    char *pcr_alg_name, char *pcr_list_str,
+			    char *token_path, int *results)
+{
+	struct attest_enroll_quote_batch *batch = NULL;
+	char *nonces[MAX_SERVERS] = { NULL }, *message_out, *message_in;
+	char path[MAX_PATH_LENGTH];
+	pthread_t quote_evidence_tid;
+	int rc = 0, rc_server, i, zstd = 1;
+
+	for (i = 0; i < num_servers && !rc; i++) {
+		rc = server_connect(servers[i]);
+		if (rc < 0) {
+			printf("Cannot connect to %s\n", servers[i]->fqdn);
+			return rc;
+		}
+
+		zstd &= (servers[i]->version > 1 && servers[i]->zstd);
+
+		rc = attest_enroll_msg_quote_nonce_request(&message_out);
+		if (rc < 0)
+			return rc;
+
+		rc = send_request(servers[i], 3, message_out);
+		free(message_out);
 	}
 
-	len -= sizeof(len);
+	if (rc < 0)
+		return rc;
+
+	/* compressed items are sent to all servers */
+	for (i = 0; i < num_servers; i++)
+		servers[i]->zstd = zstd;
+
+	/* collect evidence while the servers generate the nonces */
+	rc = pthread_create(&quote_evidence_tid, NULL, quote_evidence_thread,
+			    quote_evidence);
+	if (rc)
+		return -rc;
+
+	for (i = 0; i < num_servers && !rc; i++) {
+		rc = receive_response(servers[i], &nonces[i]);
+		if (rc || servers[i]->version == 1)
+			server_disconnect(servers[i]);
+	}
+
+	pthread_join(quote_evidence_tid, NULL);
+	if (!rc)
+		rc = quote_evidence->rc;
+	if (rc < 0)
+		goto out;
+
+	rc = attest_enroll_msg_quote_batch_finish(quote_evidence->evidence,
+						  pcr_alg_name, pcr_list_str,
+						  num_servers, nonces, &batch);
+	if (rc < 0)
+		goto out;
+
+	rc = evidence_add_ak_cert(servers, num_servers,
+				  quote_evidence->evidence);
+	if (rc < 0)
+		goto out;
 
-	rc = attest_util_read_buf(fd, (uint8_t *)*message_out, len);
+	/* a server rejecting the evidence does not prevent sending it to others */
+	for (i = 0; i < num_servers; i++) {
+		rc_server = attest_enroll_quote_batch_select(batch,
+						quote_evidence->evidence, i);
+		if (rc_server < 0) {
+			rc = rc_server;
+			break;
+		}
+
+		message_in = NULL;
+		rc_server = send_receive_ctx(servers[i], 4,
+					     quote_evidence->evidence,
+					     &message_in);
+		printf("%s: %s verification\n", servers[i]->fqdn,
+		       rc_server ? "failed" : "successful");
+
+		if (!rc_server && token_path) {
+			snprintf(path, sizeof(path), "%s.%s", token_path,
+				 servers[i]->fqdn);
+			rc_server = attest_enroll_msg_quote_response(message_in,
+								     path);
+		}
+
+		free(message_in);
+
+		results[i] = rc_server;
+		if (!rc)
+			rc = rc_server;
+	}
 out:
-	close(fd);
+	for (i = 0; i < num_servers; i++)
+		free(nonces[i]);
+
+	attest_enroll_quote_batch_free(batch);
 	return rc;
 }
 
@@ -115,15 +557,21 @@ static struct option long_options[] = {
 	{"request-key-cert", 0, 0, 'k'},
 	{"create-sym-key", 0, 0, 'y'},
 	{"send-quote", 0, 0, 'q'},
+	{"key-pool", 1, 0, 'G'},
 	{"skip-sig-ver", 0, 0, 'S'},
 	{"test-server-fqdn", 1, 0, 's'},
 	{"kernel-bios-log", 0, 0, 'b'},
 	{"kernel-ima-log", 0, 0, 'i'},
+	{"ima-delta", 0, 0, 'D'},
 	{"pcr-list", 1, 0, 'p'},
 	{"pcr-algo", 1, 0, 'P'},
 	{"save-attest-data", 1, 0, 'r'},
 	{"attest-data-url", 1, 0, 'U'},
 	{"send-unsigned-files", 0, 0, 'u'},
+	{"json", 0, 0, 'J'},
+	{"save-token", 1, 0, 't'},
+	{"verify-token", 1, 0, 'T'},
+	{"token-pubkey", 1, 0, 'K'},
 	{"help", 0, 0, 'h'},
 	{"version", 0, 0, 'v'},
 	{0, 0, 0, 0}
@@ -138,15 +586,23 @@ static void usage(char *argv0)
 		"\t-k, --request-key-cert        request TLS Key cert\n"
 		"\t-y, --create-sym-key          create symmetric key\n"
 		"\t-q, --send-quote              send quote\n"
+		"\t-G, --key-pool <num>          keep <num> keys generated in advance\n"
 		"\t-S, --skip-sig-ver            skip signature verification\n"
-		"\t-s, --test-server-fqdn        server FQDN\n"
+		"\t-s, --test-server-fqdn        server FQDN (repeat to quote\n"
+		"\t                              once for several servers)\n"
 		"\t-b, --kernel-bios-log         use kernel BIOS log\n"
 		"\t-i, --kernel-ima-log          use kernel IMA log\n"
+		"\t-D, --ima-delta               send only new IMA measurements\n"
 		"\t-p, --pcr-list                PCR list\n"
-		"\t-P, --pcr-algo                PCR bank algorithm\n"
+		"\t-P, --pcr-algo                PCR bank algorithm (comma\n"
+		"\t                              separated banks for -q)\n"
 		"\t-r, --save-attest-data <file> save attest data\n"
 		"\t-U, --attest-data-url 	 attest data URL\n"
 		"\t-u, --send-unsigned-files     send unsigned files\n"
+		"\t-J, --json                    send messages in JSON format\n"
+		"\t-t, --save-token <file>       save attestation token\n"
+		"\t-T, --verify-token <file>     verify attestation token\n"
+		"\t-K, --token-pubkey <file>     token public key\n"
 		"\t-h, --help                    print this help message\n"
 		"\t-v, --version                 print package version\n"
 		"\n"
@@ -156,17 +612,26 @@ static void usage(char *argv0)
 }
 
 enum request_types { REQUEST_AK_CERT, GENERATE_AK, REQUEST_KEY_CERT,
-		     CREATE_SYM_KEY, SEND_QUOTE, REQUEST__LAST };
+		     CREATE_SYM_KEY, SEND_QUOTE, SEND_QUOTE_BATCH, KEY_POOL,
+		     VERIFY_TOKEN, REQUEST__LAST };
+
+#define KEY_POOL_INTERVAL 10
 
 int main(int argc, char **argv)
 {
 	enum request_types type = REQUEST__LAST;
 	char *message_in = NULL, *message_out = NULL;
-	char *test_server_fqdn = SERVER_HOSTNAME, *pcr_list_str = NULL;
+	struct server_conn servers[MAX_SERVERS], *server = servers;
+	struct server_conn *pending[MAX_SERVERS];
+	int results[MAX_SERVERS], num_pending, quote_rc = 0, j;
+	char *pcr_list_str = NULL;
 	char **attest_data_ptr = NULL, *attest_data, *attest_data_path = NULL;
 	char *pcr_alg_name = "sha1", *attest_data_url = NULL;
+	char *token_path = NULL, *token_pubkey_path = TOKEN_PUBKEY_PATH;
 	char hostname[128];
-	int skip_sig_ver = 0, send_unsigned_files = 0;
+	int send_unsigned_files = 0, ima_delta = 0;
+	int key_pool_size = 0, num_servers = 0, i;
+	struct quote_evidence quote_evidence = { .evidence = NULL };
 	int rc = 0, option_index, c, kernel_bios_log = 0, kernel_ima_log = 0;
 	char *csr_subject_entries[] = {
 		"DE",
@@ -179,9 +644,17 @@ int main(int argc, char **argv)
 
 	setvbuf(stdout, NULL, _IONBF, 1);
 
+	/* write errors on a closed connection are handled by the caller */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < MAX_SERVERS; i++) {
+		servers[i].fqdn = SERVER_HOSTNAME;
+		servers[i].fd = -1;
+	}
+
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "aAkyqSs:bip:P:r:U:uhv",
+		c = getopt_long(argc, argv, "aAkyqG:Ss:biDp:P:r:U:uJt:T:K:hv",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -202,11 +675,20 @@ int main(int argc, char **argv)
 			case 'q':
 				type = SEND_QUOTE;
 				break;
+			case 'G':
+				type = KEY_POOL;
+				key_pool_size = atoi(optarg);
+				break;
 			case 'S':
-				skip_sig_ver = 1;
+				/* signature verification is done by the server */
 				break;
 			case 's':
-				test_server_fqdn = optarg;
+				if (num_servers == MAX_SERVERS) {
+					printf("Too many servers\n");
+					return -E2BIG;
+				}
+
+				servers[num_servers++].fqdn = optarg;
 				break;
 			case 'b':
 				kernel_bios_log = 1;
@@ -214,6 +696,9 @@ int main(int argc, char **argv)
 			case 'i':
 				kernel_ima_log = 1;
 				break;
+			case 'D':
+				ima_delta = 1;
+				break;
 			case 'p':
 				pcr_list_str = optarg;
 				break;
@@ -230,6 +715,19 @@ int main(int argc, char **argv)
 			case 'u':
 				send_unsigned_files = 1;
 				break;
+			case 'J':
+				max_version = 1;
+				break;
+			case 't':
+				token_path = optarg;
+				break;
+			case 'T':
+				type = VERIFY_TOKEN;
+				token_path = optarg;
+				break;
+			case 'K':
+				token_pubkey_path = optarg;
+				break;
 			case 'h':
 				usage(argv[0]);
 				break;
@@ -247,6 +745,27 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* saved attest data is in JSON format */
+	if (type == REQUEST_AK_CERT && attest_data_ptr)
+		max_version = 1;
+
+	if (!num_servers)
+		num_servers = 1;
+
+	/* a quote is sent to several servers in batch mode */
+	if (type == SEND_QUOTE && num_servers > 1)
+		type = SEND_QUOTE_BATCH;
+
+	/* messages are created in the format supported by the server */
+	if (type == REQUEST_AK_CERT || type == REQUEST_KEY_CERT ||
+	    type == SEND_QUOTE) {
+		rc = server_connect(server);
+		if (rc < 0) {
+			printf("Cannot connect to %s\n", server->fqdn);
+			return rc;
+		}
+	}
+
 	switch (type) {
 	case REQUEST_AK_CERT:
 		rc = attest_enroll_msg_ak_challenge_request(EK_CA_DIR,
@@ -259,7 +778,7 @@ int main(int argc, char **argv)
 					strlen(message_in),
 					(unsigned char *)message_in, 0);
 
-		rc = send_receive(test_server_fqdn, 0, message_in,
+		rc = send_receive(server, 0, message_in,
 				  &message_out);
 		if (rc < 0)
 			break;
@@ -280,7 +799,7 @@ int main(int argc, char **argv)
 		message_in = message_out;
 		message_out = NULL;
 
-		rc = send_receive(test_server_fqdn, 1, message_in,
+		rc = send_receive(server, 1, message_in,
 				  &message_out);
 		if (rc < 0)
 			break;
@@ -307,7 +826,7 @@ int main(int argc, char **argv)
 		if (rc < 0)
 			break;
 
-		rc = send_receive(test_server_fqdn, 2, message_in,
+		rc = send_receive(server, 2, message_in,
 				  &message_out);
 		if (rc < 0)
 			break;
@@ -328,36 +847,76 @@ int main(int argc, char **argv)
 						  pcr_list_str);
 		break;
 	case SEND_QUOTE:
-		rc = attest_enroll_msg_quote_nonce_request(&message_out);
-		if (rc < 0)
-			break;
-
-		rc = send_receive(test_server_fqdn, 3, message_out,
-				  &message_in);
-		if (rc < 0)
-			break;
-
-		free(message_out);
-		message_out = NULL;
-
-		rc = attest_enroll_msg_quote_request(PRIVACY_CA_DIR,
-						kernel_bios_log, kernel_ima_log,
-						pcr_alg_name, pcr_list_str,
-						skip_sig_ver,
-						send_unsigned_files,
-						message_in, &message_out);
-		if (rc < 0)
-			break;
+	case SEND_QUOTE_BATCH:
+		quote_evidence.kernel_bios_log = kernel_bios_log;
+		quote_evidence.kernel_ima_log = kernel_ima_log;
+		quote_evidence.send_unsigned_files = send_unsigned_files;
+		quote_evidence.ima_delta = ima_delta;
+
+		for (i = 0; i < num_servers; i++)
+			pending[i] = &servers[i];
+
+		num_pending = num_servers;
+
+		while (1) {
+			memset(results, 0, sizeof(results));
+
+			if (type == SEND_QUOTE)
+				rc = results[0] = send_quote(server,
+						&quote_evidence, pcr_alg_name,
+						pcr_list_str, token_path);
+			else
+				rc = send_quote_batch(pending, num_pending,
+						      &quote_evidence,
+						      pcr_alg_name,
+						      pcr_list_str, token_path,
+						      results);
+
+			/*
+			 * Servers may not know the IMA PCR value the part of
+			 * the log starts from (restart, cache eviction, new
+			 * server). Send the whole log again only to them.
+			 */
+			for (i = 0, j = 0; i < num_pending; i++) {
+				if (results[i] == -IMA_DELTA_UNKNOWN_POS)
+					pending[j++] = pending[i];
+				else if (results[i] && !quote_rc)
+					quote_rc = results[i];
+			}
+
+			if (rc == 0 || !j || !ima_delta || !kernel_ima_log ||
+			    attest_enroll_ima_delta_reset() < 0)
+				break;
 
-		free(message_in);
-		message_in = NULL;
+			num_pending = j;
+			printf("Sending the whole IMA event log\n");
+			attest_ctx_data_cleanup(quote_evidence.evidence);
+			quote_evidence.evidence = NULL;
+		}
 
-		rc = send_receive(test_server_fqdn, 4, message_out,
-				  &message_in);
+		/* servers that failed before the retry */
 		if (!rc)
-			printf("successful verification\n");
-		else
-			printf("failed verification\n");
+			rc = quote_rc;
+
+		if (!rc && ima_delta && kernel_ima_log)
+			rc = attest_enroll_ima_delta_commit();
+		break;
+	case KEY_POOL:
+		/* replace keys taken by requests until interrupted */
+		while (1) {
+			rc = attest_enroll_key_pool_fill(kernel_bios_log,
+							 kernel_ima_log,
+							 pcr_alg_name,
+							 pcr_list_str,
+							 key_pool_size);
+			if (rc < 0)
+				printf("Failed to generate keys, rc: %d\n", rc);
+
+			sleep(KEY_POOL_INTERVAL);
+		}
+		break;
+	case VERIFY_TOKEN:
+		rc = verify_token(token_path, token_pubkey_path);
 		break;
 	default:
 		printf("Request not provided\n");
@@ -369,5 +928,12 @@ int main(int argc, char **argv)
 	if (message_out)
 		free(message_out);
 
+	if (quote_evidence.evidence)
+		attest_ctx_data_cleanup(quote_evidence.evidence);
+
+	for (i = 0; i < num_servers; i++)
+		server_disconnect(&servers[i]);
+
+	attest_enroll_session_close();
 	return rc;
 }
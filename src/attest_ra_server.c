@@ -19,15 +19,20 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
 
 #include "enroll_server.h"
 #include "util.h"
+#include "conf.h"
 
 #include <ibmtss/tss.h>
 #include <ibmtss/tssmarshal.h>
@@ -38,12 +43,41 @@
 #include <openssl/rand.h>
 #include <openssl/conf.h>
 
+#define MAX_CONNS 64
+#define CONN_IDLE_TIMEOUT 30
+#define MAX_REQUEST_LEN (1UL << 26)
+
+/* settings shared by all connections, read-only after startup */
+struct ra_server_conf {
+	BYTE hmac_key[64];
+	uint8_t pcr_mask[3];
+	char *req_path;
+	uint16_t verifier_flags;
+	char *caCertPath;
+	char *caKeyPath;
+	char *caKeyPassword;
+	char *openssl_ca_section;
+	EVP_PKEY *token_key;
+	uint32_t token_lifetime;
+};
+
+struct ra_conn {
+	struct ra_server_conf *conf;
+	int fd;
+};
+
+static int num_conns;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_cond = PTHREAD_COND_INITIALIZER;
+
 static struct option long_options[] = {
 	{"pcr-list", 0, 0, 'p'},
 	{"requirements", 1, 0, 'r'},
 	{"ima-violations", 0, 0, 'i'},
 	{"skip-sig-ver", 0, 0, 's'},
 	{"openssl-ca-section", 1, 0, 'S'},
+	{"token-key", 1, 0, 'k'},
+	{"token-lifetime", 1, 0, 'l'},
 	{"help", 0, 0, 'h'},
 	{"version", 0, 0, 'v'},
 	{0, 0, 0, 0}
@@ -58,6 +92,8 @@ static void usage(char *argv0)
 		"\t-i, --ima-violations          allow IMA violations\n"
 		"\t-s, --skip-sig-ver            skip signature verification\n"
 		"\t-S, --openssl-ca-section      openssl CA section to use\n"
+		"\t-k, --token-key <file>        sign attestation tokens\n"
+		"\t-l, --token-lifetime <secs>   attestation token lifetime\n"
 		"\t-h, --help                    print this help message\n"
 		"\t-v, --version                 print package version\n"
 		"\n"
@@ -66,20 +102,117 @@ static void usage(char *argv0)
 	exit(-1);
 }
 
-int main(int argc, char *argv[])
+static int read_request_hdr(int fd, int version, size_t *len, int *op)
 {
-	char *message_in = NULL, *message_out = NULL, *req_path = NULL;
-	char *csr_str = NULL, *cert_str = NULL, *ca_cert_str = NULL;
-	char *pcr_list_str = NULL;
+	uint32_t hdr[2];
+	int rc;
+
+	if (version == 1) {
+		rc = attest_util_read_buf(fd, (uint8_t *)len, sizeof(*len));
+		if (!rc)
+			rc = attest_util_read_buf(fd, (uint8_t *)op,
+						  sizeof(*op));
+		if (rc)
+			return rc;
+
+		if (*len < 2 * sizeof(*len))
+			return -EINVAL;
+
+		*len -= 2 * sizeof(*len);
+		return 0;
+	}
+
+	/* payload length and op in network byte order */
+	rc = attest_util_read_buf(fd, (uint8_t *)hdr, sizeof(hdr));
+	if (rc)
+		return rc;
+
+	*len = ntohl(hdr[0]);
+	*op = ntohl(hdr[1]);
+	return 0;
+}
+
+static int write_response(int fd, int version, int status, char *message_out)
+{
+	uint32_t hdr[2];
+	size_t len = 0;
+	int rc;
+
+	if (version == 1) {
+		/* zero length means error */
+		if (!status)
+			len = strlen(message_out) + sizeof(len) + 1;
+
+		rc = attest_util_write_buf(fd, (uint8_t *)&len, sizeof(len));
+		if (!rc && len)
+			rc = attest_util_write_buf(fd, (uint8_t *)message_out,
+						   len - sizeof(len));
+		return rc;
+	}
+
+	/* error code and payload length in network byte order */
+	if (!status)
+		len = attest_ctx_msg_len(message_out);
+
+	hdr[0] = htonl(-status);
+	hdr[1] = htonl(len);
+
+	rc = attest_util_write_buf(fd, (uint8_t *)hdr, sizeof(hdr));
+	if (!rc && len)
+		rc = attest_util_write_buf(fd, (uint8_t *)message_out, len);
+
+	return rc;
+}
+
+/* message: <version>[ zstd] */
+static int negotiate_version(char *message_in, char **message_out,
+			     int *version)
+{
+	int client_version = atoi(message_in), zstd;
+
+	if (client_version < 1)
+		return -EINVAL;
+
+	*version = client_version < RA_PROTOCOL_VERSION ?
+		   client_version : RA_PROTOCOL_VERSION;
+
+	/* compressed items can be sent only in TLV messages */
+	zstd = (*version > 1 && strstr(message_in, " " RA_FEATURE_ZSTD) &&
+		attest_ctx_tlv_zstd_supported());
+
+	*message_out = malloc(16);
+	if (!*message_out)
+		return -ENOMEM;
+
+	snprintf(*message_out, 16, "%d%s", *version,
+		 zstd ? " " RA_FEATURE_ZSTD : "");
+	return 0;
+}
+
+static void conn_release(struct ra_conn *conn)
+{
+	close(conn->fd);
+	free(conn);
+
+	pthread_mutex_lock(&conns_lock);
+	num_conns--;
+	pthread_cond_signal(&conns_cond);
+	pthread_mutex_unlock(&conns_lock);
+}
+
+/*
+ * Requests of a client are processed in order on its connection, until the
+ * client closes the connection or stays idle for CONN_IDLE_TIMEOUT seconds.
+ */
+static void *conn_thread(void *arg)
+{
+	struct ra_conn *conn = arg;
+	struct ra_server_conf *conf = conn->conf;
+	struct attest_enroll_session session;
+	char *message_in, *message_out;
+	char *csr_str, *cert_str, *ca_cert_str;
 	size_t len, ca_cert_str_len;
-	struct sockaddr_in addr;
-	BYTE hmac_key[64];
-	uint8_t pcr_mask[3] = { 0 };
-	int pcr_list[IMPLEMENTATION_PCR];
-	uint16_t verifier_flags = 0;
-	int rc, option_index, c, fd, fd_socket = -1, op, reuse_addr = 1, i;
-	CONF *conf = NULL;
-	char *openssl_config_file = NULL;
+	int rc, op, version, next_version;
 	char *cert_subject_entries[] = {
 		"DE",
 		"Bayern",
@@ -89,14 +222,163 @@ int main(int argc, char *argv[])
 		NULL,
 		NULL};
 	size_t num_subject_entries = sizeof(cert_subject_entries) / sizeof(char *);
-	char *caCertPath = NULL, *caKeyPath, *caKeyPassword;
-	char *openssl_ca_section = NULL;
+
+	memset(&session, 0, sizeof(session));
+	version = next_version = 1;
+request:
+	message_in = NULL;
+	message_out = NULL;
+
+	csr_str = NULL;
+	cert_str = NULL;
+	ca_cert_str = NULL;
+
+	/* the client closes the connection after the last request */
+	rc = read_request_hdr(conn->fd, version, &len, &op);
+	if (rc)
+		goto out_free;
+
+	/* the payload is not read, the connection cannot be used anymore */
+	if (len > MAX_REQUEST_LEN) {
+		printf("request too large\n");
+		write_response(conn->fd, version, -E2BIG, NULL);
+		rc = -E2BIG;
+		goto out_free;
+	}
+
+	message_in = malloc(len + 1);
+	if (!message_in) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+
+	message_in[len] = '\0';
+
+	rc = attest_util_read_buf(conn->fd, (uint8_t *)message_in, len);
+	if (rc)
+		goto out_free;
+
+	rc = attest_ctx_msg_check(message_in, len);
+	if (rc)
+		goto response;
+
+	switch (op) {
+	case 0:
+		rc = attest_enroll_msg_make_credential(conf->hmac_key,
+					sizeof(conf->hmac_key),
+					conf->caKeyPath, conf->caKeyPassword,
+					conf->caCertPath, message_in,
+					&message_out);
+		break;
+	case 1:
+		/* the CN is taken from the request */
+		cert_subject_entries[5] = NULL;
+
+		rc = attest_enroll_msg_make_cert(conf->hmac_key,
+					sizeof(conf->hmac_key),
+					conf->caKeyPath, conf->caKeyPassword,
+					conf->caCertPath, cert_subject_entries,
+					num_subject_entries, message_in,
+					&message_out);
+		break;
+	case 2:
+		rc = attest_enroll_msg_process_csr(sizeof(conf->pcr_mask),
+						   conf->pcr_mask,
+						   conf->req_path,
+						   conf->verifier_flags,
+						   message_in, &csr_str);
+		if (rc < 0)
+			break;
+
+		rc = attest_enroll_sign_csr(conf->caKeyPath,
+					    conf->caKeyPassword,
+					    conf->caCertPath,
+					    conf->openssl_ca_section, csr_str,
+					    &cert_str);
+		if (rc < 0)
+			break;
+
+		rc = attest_util_read_seq_file(conf->caCertPath,
+					       &ca_cert_str_len,
+					       (uint8_t **)&ca_cert_str);
+		if (rc < 0)
+			break;
+
+		rc = attest_enroll_msg_return_cert(cert_str, ca_cert_str,
+					attest_ctx_msg_format(message_in),
+					&message_out);
+		break;
+	case 3:
+		rc = attest_enroll_msg_gen_quote_nonce(sizeof(conf->hmac_key),
+						       conf->hmac_key,
+						       &session, message_in,
+						       &message_out);
+		break;
+	case 4:
+		rc = attest_enroll_msg_process_quote(sizeof(conf->hmac_key),
+						     conf->hmac_key,
+						     sizeof(conf->pcr_mask),
+						     conf->pcr_mask,
+						     conf->req_path,
+						     conf->verifier_flags,
+						     &session,
+						     conf->token_key,
+						     conf->token_lifetime,
+						     message_in, &message_out);
+		break;
+	case RA_OP_NEGOTIATE:
+		rc = negotiate_version(message_in, &message_out,
+				       &next_version);
+		break;
+	default:
+		rc = -EINVAL;
+		break;
+	}
+response:
+	if (rc)
+		printf("error\n");
+
+	/* the negotiated version is used after the response */
+	rc = write_response(conn->fd, version, rc, message_out);
+	version = next_version;
+out_free:
+	free(message_in);
+	free(message_out);
+	free(csr_str);
+	free(cert_str);
+	free(ca_cert_str);
+
+	if (!rc)
+		goto request;
+
+	attest_enroll_session_cleanup(&session);
+	conn_release(conn);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ra_server_conf ra_conf = {
+		.token_lifetime = ATTEST_TOKEN_LIFETIME,
+	};
+	struct timeval timeout = { .tv_sec = CONN_IDLE_TIMEOUT };
+	struct sockaddr_in addr;
+	struct ra_conn *conn;
+	pthread_attr_t attr;
+	pthread_t tid;
+	char *pcr_list_str = NULL;
+	int pcr_list[IMPLEMENTATION_PCR];
+	int rc, option_index, c, fd, fd_socket = -1, reuse_addr = 1, i;
+	CONF *conf = NULL;
+	char *openssl_config_file = NULL;
+	char *openssl_ca_section = NULL, *token_key_path = NULL;
+	FILE *fp;
 
 	setvbuf(stdout, NULL, _IONBF, 1);
 
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "p:r:isS:hv",
+		c = getopt_long(argc, argv, "p:r:isS:k:l:hv",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -106,17 +388,23 @@ int main(int argc, char *argv[])
 				pcr_list_str = optarg;
 				break;
 			case 'r':
-				req_path = optarg;
+				ra_conf.req_path = optarg;
 				break;
 			case 'i':
-				verifier_flags |= CTX_ALLOW_IMA_VIOLATIONS;
+				ra_conf.verifier_flags |= CTX_ALLOW_IMA_VIOLATIONS;
 				break;
 			case 's':
-				verifier_flags |= CTX_SKIP_SIG_VER;
+				ra_conf.verifier_flags |= CTX_SKIP_SIG_VER;
 				break;
 			case 'S':
 				openssl_ca_section = optarg;
 				break;
+			case 'k':
+				token_key_path = optarg;
+				break;
+			case 'l':
+				ra_conf.token_lifetime = strtoul(optarg, NULL, 10);
+				break;
 			case 'h':
 				usage(argv[0]);
 				break;
@@ -153,12 +441,15 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	caCertPath = NCONF_get_string(conf, openssl_ca_section, "certificate");
-	caKeyPath = NCONF_get_string(conf, openssl_ca_section, "private_key");
-	caKeyPassword = NCONF_get_string(conf, openssl_ca_section, "input_password");
-
+	ra_conf.openssl_ca_section = openssl_ca_section;
+	ra_conf.caCertPath = NCONF_get_string(conf, openssl_ca_section,
+					      "certificate");
+	ra_conf.caKeyPath = NCONF_get_string(conf, openssl_ca_section,
+					     "private_key");
+	ra_conf.caKeyPassword = NCONF_get_string(conf, openssl_ca_section,
+						 "input_password");
 
-	if (!caCertPath || !caKeyPath) {
+	if (!ra_conf.caCertPath || !ra_conf.caKeyPath) {
 		printf("Cannot read openssl config\n");
 		rc = -ENOENT;
 		goto out;
@@ -175,13 +466,29 @@ int main(int argc, char *argv[])
 			if (pcr_list[i] == -1)
 				continue;
 
-			pcr_mask[pcr_list[i] / 8] |= 1 << (pcr_list[i] % 8);
+			ra_conf.pcr_mask[pcr_list[i] / 8] |=
+				1 << (pcr_list[i] % 8);
 		}
 	}
 
 	OpenSSL_add_all_algorithms();
 
-	rc = RAND_bytes(hmac_key, sizeof(hmac_key));
+	if (token_key_path) {
+		fp = fopen(token_key_path, "r");
+		if (fp) {
+			ra_conf.token_key = PEM_read_PrivateKey(fp, NULL, NULL,
+								NULL);
+			fclose(fp);
+		}
+
+		if (!ra_conf.token_key) {
+			printf("Cannot read token key %s\n", token_key_path);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+
+	rc = RAND_bytes(ra_conf.hmac_key, sizeof(ra_conf.hmac_key));
 	if (!rc) {
 		printf("Cannot generate HMAC key\n");
 		rc = -EINVAL;
@@ -210,127 +517,50 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* a client going away must not terminate the other connections */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
 	while (1) {
+		/* wait until a connection slot is free */
+		pthread_mutex_lock(&conns_lock);
+		while (num_conns == MAX_CONNS)
+			pthread_cond_wait(&conns_cond, &conns_lock);
+		pthread_mutex_unlock(&conns_lock);
+
 		fd = accept(fd_socket, NULL, NULL);
 		if (fd < 0)
 			continue;
 
-		rc = attest_util_read_buf(fd, (uint8_t *)&len, sizeof(len));
-		if (rc)
-			goto out_free;
-
-		rc = attest_util_read_buf(fd, (uint8_t *)&op, sizeof(op));
-		if (rc)
-			goto out_free;
-
-		len -= 2 * sizeof(len);
-		message_in = malloc(len + 1);
+		/* idle clients must not hold a connection slot forever */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
 
-		if (!message_in) {
-			len = 0;
-			goto response;
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			continue;
 		}
 
-		message_in[len] = '\0';
-
-		rc = attest_util_read_buf(fd, (uint8_t *)message_in, len);
-		if (rc)
-			goto out_free;
-
-		len = 0;
-
-		message_out = NULL;
+		conn->conf = &ra_conf;
+		conn->fd = fd;
 
-		csr_str = NULL;
-		cert_str = NULL;
-		ca_cert_str = NULL;
-
-		switch (op) {
-		case 0:
-			rc = attest_enroll_msg_make_credential(hmac_key,
-						sizeof(hmac_key), caKeyPath,
-						caKeyPassword, caCertPath,
-						message_in, &message_out);
-			break;
-		case 1:
-			rc = attest_enroll_msg_make_cert(hmac_key, sizeof(hmac_key),
-							 caKeyPath, caKeyPassword,
-							 caCertPath,
-							 cert_subject_entries,
-							 num_subject_entries,
-							 message_in, &message_out);
-			break;
-		case 2:
-			rc = attest_enroll_msg_process_csr(sizeof(pcr_mask),
-							pcr_mask, req_path,
-							verifier_flags,
-							message_in, &csr_str);
-			if (rc < 0)
-				break;
+		pthread_mutex_lock(&conns_lock);
+		num_conns++;
+		pthread_mutex_unlock(&conns_lock);
 
-			rc = attest_enroll_sign_csr(caKeyPath, caKeyPassword,
-						    caCertPath,
-						    openssl_ca_section, csr_str,
-						    &cert_str);
-			if (rc < 0)
-				break;
-
-			rc = attest_util_read_seq_file(caCertPath,
-						&ca_cert_str_len,
-						(uint8_t **)&ca_cert_str);
-			if (rc < 0)
-				break;
-
-			rc = attest_enroll_msg_return_cert(cert_str,
-							   ca_cert_str,
-							   &message_out);
-			break;
-		case 3:
-			rc = attest_enroll_msg_gen_quote_nonce(sizeof(hmac_key),
-							       hmac_key,
-							       message_in,
-							       &message_out);
-			break;
-		case 4:
-			rc = attest_enroll_msg_process_quote(sizeof(hmac_key),
-							     hmac_key,
-							     sizeof(pcr_mask),
-							     pcr_mask, req_path,
-							     verifier_flags,
-							     message_in,
-							     &message_out);
-			break;
-		default:
-			rc = -EINVAL;
-			break;
+		rc = pthread_create(&tid, &attr, conn_thread, conn);
+		if (rc) {
+			printf("Cannot create connection thread\n");
+			conn_release(conn);
 		}
-
-		if (!rc)
-			len = strlen(message_out) + sizeof(len) + 1;
-response:
-		if (!len)
-			printf("error\n");
-
-		rc = attest_util_write_buf(fd, (uint8_t *)&len, sizeof(len));
-		if (rc)
-			goto out;
-
-		if (len)
-			rc = attest_util_write_buf(fd, (uint8_t *)message_out,
-						   len - sizeof(len));
-out_free:
-		free(message_in);
-		free(message_out);
-		free(csr_str);
-		free(cert_str);
-		free(ca_cert_str);
-
-		close(fd);
-
-		if (rc)
-			break;
 	}
 out:
+	EVP_PKEY_free(ra_conf.token_key);
 	EVP_cleanup();
 	NCONF_free(conf);
 	if (fd_socket != -1)
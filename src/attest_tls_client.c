@@ -19,6 +19,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <getopt.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <arpa/inet.h>
@@ -26,6 +27,7 @@
 #include <openssl/err.h>
 
 #include "attest_tls_common.h"
+#include "skae_ssl.h"
 
 #define SERVER_PORT "4433"
 
@@ -134,6 +136,7 @@ static struct option long_options[] = {
 	{"requirements", 1, 0, 'r'},
 	{"verify-skae", 0, 0, 'S'},
 	{"disable-custom-protocol", 0, 0, 'D'},
+	{"session", 1, 0, 'R'},
 	{"verbose", 0, 0, 'V'},
 	{"help", 0, 0, 'h'},
 	{"version", 0, 0, 'v'},
@@ -155,6 +158,7 @@ static void usage(char *argv0)
 		"\t-r, --requirements            verifier requirements\n"
 		"\t-S, --verify-skae             verify peer's SKAE\n"
 		"\t-D, --disable-custom-protocol disable custom protocol\n"
+		"\t-R, --session                 file to resume the TLS session\n"
 		"\t-V, --verbose                 verbose mode\n"
 		"\t-h, --help                    print this help message\n"
 		"\t-v, --version                 print package version\n"
@@ -164,6 +168,48 @@ static void usage(char *argv0)
 	exit(-1);
 }
 
+static int save_session(SSL *ssl, SSL_SESSION *session)
+{
+	char *session_path = SSL_get_app_data(ssl);
+	FILE *fp;
+	int fd;
+
+	if (!SSL_SESSION_is_resumable(session))
+		return 0;
+
+	/* the session contains the resumption secret */
+	fd = open(session_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return 0;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return 0;
+	}
+
+	PEM_write_SSL_SESSION(fp, session);
+	fclose(fp);
+
+	/* the reference to the session is not kept */
+	return 0;
+}
+
+static SSL_SESSION *load_session(char *session_path)
+{
+	SSL_SESSION *session;
+	FILE *fp;
+
+	fp = fopen(session_path, "r");
+	if (!fp)
+		return NULL;
+
+	session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+	fclose(fp);
+
+	return session;
+}
+
 int main(int argc, char **argv)
 {
 	SSL_CTX *ctx;
@@ -172,8 +218,11 @@ int main(int argc, char **argv)
 	char *key_path = NULL, *cert_path = NULL, *ca_path = NULL;
 	char *attest_data_path = NULL, *req_path = NULL;
 	char *server_fqdn = NULL, *server_port = SERVER_PORT;
-	char *pcr_list_str = NULL, *logs;
+	char *pcr_list_str = NULL, *logs, *session_path = NULL;
 	unsigned char *server_attest_data = NULL;
+	SSL_SESSION *session = NULL;
+	attest_ctx_data *d_ctx = NULL;
+	attest_ctx_verifier *v_ctx = NULL;
 	size_t server_attest_data_size = 0, nbytes, total = 0;
 	int server, option_index, c, custom_protocol = 1;
 	int rc = -EINVAL, engine = 0, verify_skae = 0, verbose = 0;
@@ -182,7 +231,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "k:c:d:s:P:a:ep:r:SDVhv", long_options,
+		c = getopt_long(argc, argv, "k:c:d:s:P:a:ep:r:SDR:Vhv", long_options,
 				&option_index);
 		if (c == -1)
 			break;
@@ -224,6 +273,9 @@ int main(int argc, char **argv)
 			case 'D':
 				custom_protocol = 0;
 				break;
+			case 'R':
+				session_path = optarg;
+				break;
 			case 'h':
 				usage(argv[0]);
 				break;
@@ -262,14 +314,31 @@ int main(int argc, char **argv)
 	if (rc < 0)
 		goto cleanup;
 
+	/*
+	 * TLS 1.3 tickets are received after the handshake, store them with a
+	 * callback. A resumed session skips the TPM signature and the SKAE
+	 * verification, within the lifetime decided by the server.
+	 */
+	if (session_path) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, save_session);
+		session = load_session(session_path);
+	}
+
 	server = create_socket(server_fqdn, server_port);
 	if (server < 0) {
 		perror("Unable to connect");
 		goto free;
 	}
 
-	attest_ctx_data_init(NULL);
-	attest_ctx_verifier_init(NULL);
+	rc = attest_ctx_data_init(&d_ctx);
+	if (rc < 0)
+		goto error;
+
+	rc = attest_ctx_verifier_init(&v_ctx);
+	if (rc < 0)
+		goto error;
 
 	if (custom_protocol) {
 		rc = send_receive_attest_data(server, attest_data_path,
@@ -280,7 +349,7 @@ int main(int argc, char **argv)
 	}
 
 	if (verify_skae) {
-		rc = configure_attest(server, server_attest_data_size,
+		rc = configure_attest(d_ctx, v_ctx, server_attest_data_size,
 				      server_attest_data, pcr_list_str,
 				      req_path);
 		if (rc < 0)
@@ -290,11 +359,23 @@ int main(int argc, char **argv)
 	ssl = SSL_new(ctx);
 	SSL_set_fd(ssl, server);
 
+	if (session_path) {
+		SSL_set_app_data(ssl, session_path);
+
+		if (session && SSL_SESSION_is_resumable(session))
+			SSL_set_session(ssl, session);
+	}
+
+	if (verify_skae) {
+		rc = skae_ssl_set_ctx(ssl, d_ctx, v_ctx);
+		if (rc < 0)
+			goto error_ssl;
+	}
+
 	rc = SSL_connect(ssl);
 
 	if (verify_skae && verbose) {
-		logs = attest_ctx_verifier_result_print_json(
-					attest_ctx_verifier_get_global());
+		logs = attest_ctx_verifier_result_print_json(v_ctx);
 		printf("%s\n", logs);
 		free(logs);
 	}
@@ -312,6 +393,9 @@ int main(int argc, char **argv)
 		goto error_ssl;
 	}
 
+	if (SSL_session_reused(ssl))
+		printf("resumed session\n");
+
 	printf("good server cert\n");
 	if (custom_protocol) {
 		SSL_read(ssl, reply, sizeof(reply) - 1);
@@ -337,9 +421,10 @@ error:
 free:
 	SSL_CTX_free(ctx);
 cleanup:
+	SSL_SESSION_free(session);
 	cleanup_openssl();
 	free(server_attest_data);
-	attest_ctx_data_cleanup(NULL);
-	attest_ctx_verifier_cleanup(NULL);
+	attest_ctx_data_cleanup(d_ctx);
+	attest_ctx_verifier_cleanup(v_ctx);
 	return rc;
 }
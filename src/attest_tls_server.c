@@ -19,17 +19,86 @@
 #include <string.h>
 #include <getopt.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/engine.h>
 
 #include "attest_tls_common.h"
+#include "skae_ssl.h"
 
 #define SERVER_PORT 4433
 #define BUFLEN 1024
+#define MAX_WORKERS 256
+#define CONN_QUEUE_LEN 64
+#define MAX_EVENTS 64
+#define CACHE_DEFAULT_SIZE 1024
+
+/*
+ * Attestation data of the server, sent to every client. Replaced on SIGHUP,
+ * the previous one is freed when the last connection using it is done.
+ */
+struct attest_blob {
+	int refs;
+	size_t len;
+	/* length in network byte order followed by the data */
+	unsigned char data[];
+};
+
+struct tls_server_conf {
+	SSL_CTX *ctx;
+	struct attest_blob *blob;
+	char *attest_data_path;
+	char *pcr_list_str;
+	char *req_path;
+	struct skae_cache *cache;
+	/* digest of the requirements, replaced on SIGHUP */
+	uint8_t policy[SHA256_DIGEST_LENGTH];
+	int verify_skae;
+	int verbose;
+};
+
+enum conn_states { CONN_READ_LEN, CONN_READ_DATA, CONN_WRITE_DATA,
+		  CONN_HANDSHAKE };
+
+/*
+ * Connection driven by the handshake thread until the TLS handshake is done,
+ * and then passed to a verification worker.
+ */
+struct tls_conn {
+	int fd;
+	enum conn_states state;
+	SSL *ssl;
+	int verified;
+	size_t offset;
+	size_t client_data_size;
+	unsigned char *client_attest_data;
+	struct attest_blob *blob;
+	/* digest of the requirements used to verify the client */
+	uint8_t policy[SHA256_DIGEST_LENGTH];
+};
+
+struct conn_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct tls_conn *conns[CONN_QUEUE_LEN];
+	int head;
+	int num;
+};
+
+static struct conn_queue queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
 
 int create_socket(void)
 {
@@ -55,12 +124,17 @@ int create_socket(void)
 		goto out;
 	}
 
-	if (listen(s, 1) < 0) {
+	if (listen(s, SOMAXCONN) < 0) {
 		perror("Unable to listen");
 		goto out;
 	}
-out:
+
 	return s;
+out:
+	if (s >= 0)
+		close(s);
+
+	return -1;
 }
 
 static struct option long_options[] = {
@@ -72,6 +146,9 @@ static struct option long_options[] = {
 	{"pcr-list", 0, 0, 'p'},
 	{"requirements", 1, 0, 'r'},
 	{"verify-skae", 0, 0, 'S'},
+	{"threads", 1, 0, 't'},
+	{"cache-ttl", 1, 0, 'T'},
+	{"cache-size", 1, 0, 'C'},
 	{"verbose", 0, 0, 'V'},
 	{"help", 0, 0, 'h'},
 	{"version", 0, 0, 'v'},
@@ -90,6 +167,9 @@ static void usage(char *argv0)
 		"\t-p, --pcr-list                PCR list\n"
 		"\t-r, --requirements            verifier requirements\n"
 		"\t-S, --verify-skae             verify peer's SKAE\n"
+		"\t-t, --threads                 number of verification threads\n"
+		"\t-T, --cache-ttl               seconds SKAE results are cached\n"
+		"\t-C, --cache-size              max number of cached SKAE results\n"
 		"\t-V, --verbose                 verbose mode\n"
 		"\t-h, --help                    print this help message\n"
 		"\t-v, --version                 print package version\n"
@@ -99,23 +179,630 @@ static void usage(char *argv0)
 	exit(-1);
 }
 
+static void queue_push(struct tls_conn *conn)
+{
+	pthread_mutex_lock(&queue.lock);
+	while (queue.num == CONN_QUEUE_LEN)
+		pthread_cond_wait(&queue.not_full, &queue.lock);
+
+	queue.conns[(queue.head + queue.num) % CONN_QUEUE_LEN] = conn;
+	queue.num++;
+
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static struct tls_conn *queue_pop(void)
+{
+	struct tls_conn *conn;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!queue.num)
+		pthread_cond_wait(&queue.not_empty, &queue.lock);
+
+	conn = queue.conns[queue.head];
+	queue.head = (queue.head + 1) % CONN_QUEUE_LEN;
+	queue.num--;
+
+	pthread_cond_signal(&queue.not_full);
+	pthread_mutex_unlock(&queue.lock);
+	return conn;
+}
+
+/*
+ * Cached results and resumed sessions are valid only for the requirements
+ * and PCR list used to obtain them, as the requirements file can be changed
+ * at run-time and reloaded with SIGHUP.
+ */
+static int calc_policy(struct tls_server_conf *conf, uint8_t *policy)
+{
+	EVP_MD_CTX *mdctx = NULL;
+	unsigned char *req_data;
+	size_t req_len;
+	int rc;
+
+	rc = attest_util_read_file(conf->req_path, &req_len, &req_data);
+	if (rc < 0)
+		return rc;
+
+	rc = -EINVAL;
+
+	mdctx = EVP_MD_CTX_create();
+	if (!mdctx)
+		goto out;
+
+	if (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1 ||
+	    EVP_DigestUpdate(mdctx, req_data, req_len) != 1)
+		goto out;
+
+	if (conf->pcr_list_str &&
+	    EVP_DigestUpdate(mdctx, conf->pcr_list_str,
+			     strlen(conf->pcr_list_str) + 1) != 1)
+		goto out;
+
+	if (EVP_DigestFinal_ex(mdctx, policy, NULL) != 1)
+		goto out;
+
+	rc = 0;
+out:
+	EVP_MD_CTX_destroy(mdctx);
+	munmap(req_data, req_len);
+	return rc;
+}
+
+/* the policy is used only by the handshake thread, no locking needed */
+static int policy_reload(struct tls_server_conf *conf)
+{
+	uint8_t policy[SHA256_DIGEST_LENGTH];
+	int rc;
+
+	if (!conf->verify_skae)
+		return 0;
+
+	rc = calc_policy(conf, policy);
+	if (rc < 0) {
+		printf("Cannot read %s\n", conf->req_path);
+		return rc;
+	}
+
+	memcpy(conf->policy, policy, sizeof(conf->policy));
+
+	if (conf->cache)
+		skae_cache_set_policy(conf->cache, conf->policy);
+
+	return 0;
+}
+
+static void conn_free(struct tls_conn *conn)
+{
+	if (conn->ssl) {
+		SSL_shutdown(conn->ssl);
+		SSL_free(conn->ssl);
+	}
+
+	close(conn->fd);
+	free(conn->client_attest_data);
+	free(conn);
+}
+
+static int conn_set_nonblock(int fd, int nonblock)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+
+	if (nonblock)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* returns 1 if all data was read, 0 if more data is expected */
+static int conn_read(struct tls_conn *conn, unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (conn->offset < len) {
+		n = read(conn->fd, buf + conn->offset, len - conn->offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -EIO;
+
+		conn->offset += n;
+	}
+
+	conn->offset = 0;
+	return 1;
+}
+
+static struct attest_blob *blob_load(const char *path)
+{
+	struct attest_blob *blob;
+	unsigned char *data = NULL;
+	size_t data_len = 0, hdr_len = sizeof(size_t);
+	size_t hdr;
+
+	if (path && attest_util_read_file(path, &data_len, &data) < 0) {
+		printf("Cannot read %s\n", path);
+		return NULL;
+	}
+
+	blob = malloc(sizeof(*blob) + hdr_len + data_len);
+	if (blob) {
+		blob->refs = 1;
+		blob->len = hdr_len + data_len;
+
+		/* same encoding used by the client */
+		hdr = htonl(data_len);
+		memcpy(blob->data, &hdr, hdr_len);
+		if (data_len)
+			memcpy(blob->data + hdr_len, data, data_len);
+	}
+
+	if (data)
+		munmap(data, data_len);
+
+	return blob;
+}
+
+/* blobs are referenced only by the handshake thread, no locking needed */
+static void blob_put(struct attest_blob *blob)
+{
+	if (blob && !--blob->refs)
+		free(blob);
+}
+
+static void blob_reload(struct tls_server_conf *conf, const char *path)
+{
+	struct attest_blob *blob;
+
+	blob = blob_load(path);
+	if (!blob)
+		return;
+
+	blob_put(conf->blob);
+	conf->blob = blob;
+}
+
+/* length and server attestation data, in one call if possible */
+static int conn_write(struct tls_conn *conn)
+{
+	ssize_t n;
+
+	while (conn->offset < conn->blob->len) {
+		n = write(conn->fd, conn->blob->data + conn->offset,
+			  conn->blob->len - conn->offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0)
+			return -EIO;
+
+		conn->offset += n;
+	}
+
+	conn->offset = 0;
+	blob_put(conn->blob);
+	conn->blob = NULL;
+	return 1;
+}
+
+static int conn_start_handshake(struct tls_server_conf *conf,
+				struct tls_conn *conn)
+{
+	conn->ssl = SSL_new(conf->ctx);
+	if (!conn->ssl)
+		return -ENOMEM;
+
+	SSL_set_fd(conn->ssl, conn->fd);
+	SSL_set_app_data(conn->ssl, conn);
+
+	if (!conf->verify_skae)
+		return 0;
+
+	/* the policy can be replaced before the worker verifies the client */
+	memcpy(conn->policy, conf->policy, sizeof(conn->policy));
+
+	/* sessions established with a different policy are not resumed */
+	if (!SSL_set_session_id_context(conn->ssl, conn->policy,
+					sizeof(conn->policy)))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Advance the connection without blocking. Returns the events to wait for,
+ * 0 if the handshake is done, or a negative value on error.
+ */
+static int conn_process(struct tls_server_conf *conf, struct tls_conn *conn)
+{
+	int rc;
+
+	switch (conn->state) {
+	case CONN_READ_LEN:
+		rc = conn_read(conn, (unsigned char *)&conn->client_data_size,
+			       sizeof(conn->client_data_size));
+		if (rc <= 0)
+			return rc < 0 ? rc : EPOLLIN;
+
+		conn->client_data_size = ntohl(conn->client_data_size);
+		if (conn->client_data_size) {
+			conn->client_attest_data =
+				malloc(conn->client_data_size);
+			if (!conn->client_attest_data)
+				return -ENOMEM;
+		}
+
+		conn->state = CONN_READ_DATA;
+		/* fall through */
+	case CONN_READ_DATA:
+		rc = conn_read(conn, conn->client_attest_data,
+			       conn->client_data_size);
+		if (rc <= 0)
+			return rc < 0 ? rc : EPOLLIN;
+
+		conn->blob = conf->blob;
+		conn->blob->refs++;
+		conn->state = CONN_WRITE_DATA;
+		/* fall through */
+	case CONN_WRITE_DATA:
+		rc = conn_write(conn);
+		if (rc <= 0)
+			return rc < 0 ? rc : EPOLLOUT;
+
+		rc = conn_start_handshake(conf, conn);
+		if (rc < 0)
+			return rc;
+
+		conn->state = CONN_HANDSHAKE;
+		/* fall through */
+	case CONN_HANDSHAKE:
+		rc = SSL_accept(conn->ssl);
+		if (rc == 1)
+			return 0;
+
+		switch (SSL_get_error(conn->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			return EPOLLIN;
+		case SSL_ERROR_WANT_WRITE:
+			return EPOLLOUT;
+		default:
+			ERR_print_errors_fp(stderr);
+			return -EIO;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Verify the SKAE extension of the client certificate with contexts owned by
+ * this connection, after the handshake thread completed the handshake.
+ */
+static int conn_verify_cached(struct tls_server_conf *conf,
+			      struct tls_conn *conn)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	unsigned int digest_len;
+	X509 *cert;
+	int rc, verdict;
+
+	cert = SSL_get_peer_certificate(conn->ssl);
+	if (!cert)
+		return -ENOENT;
+
+	rc = -EINVAL;
+	if (X509_digest(cert, EVP_sha256(), digest, &digest_len))
+		rc = skae_cache_lookup(conf->cache, conn->policy, digest,
+				       &verdict);
+
+	X509_free(cert);
+	return rc < 0 ? rc : verdict;
+}
+
+static int conn_verify(struct tls_server_conf *conf, struct tls_conn *conn)
+{
+	attest_ctx_data *d_ctx = NULL;
+	attest_ctx_verifier *v_ctx = NULL;
+	char *logs;
+	int rc;
+
+	/* the result was checked when the session was established */
+	if (SSL_session_reused(conn->ssl)) {
+		printf("resumed session\n");
+		return 1;
+	}
+
+	/* contexts are set up only if the result is not cached */
+	if (conf->cache) {
+		rc = conn_verify_cached(conf, conn);
+		if (rc >= 0) {
+			printf("cached SKAE verification result\n");
+			goto verified;
+		}
+	}
+
+	rc = attest_ctx_data_init(&d_ctx);
+	if (rc < 0)
+		goto out;
+
+	rc = attest_ctx_verifier_init(&v_ctx);
+	if (rc < 0)
+		goto out;
+
+	if (conn->client_data_size) {
+		rc = configure_attest(d_ctx, v_ctx, conn->client_data_size,
+				      conn->client_attest_data,
+				      conf->pcr_list_str, conf->req_path);
+		if (rc < 0)
+			goto out;
+	}
+
+	rc = skae_ssl_set_ctx(conn->ssl, d_ctx, v_ctx);
+	if (rc < 0)
+		goto out;
+
+	if (conf->cache) {
+		rc = skae_ssl_set_cache(conn->ssl, conf->cache,
+					conn->policy);
+		if (rc < 0)
+			goto out;
+	}
+
+	rc = skae_verify_ssl(conn->ssl);
+
+	if (conf->verbose) {
+		logs = attest_ctx_verifier_result_print_json(v_ctx);
+		printf("%s\n", logs);
+		free(logs);
+	}
+
+	/* contexts are released below */
+	skae_ssl_set_ctx(conn->ssl, NULL, NULL);
+verified:
+	if (rc == 1) {
+		conn->verified = 1;
+
+		/* tickets are issued only after a successful verification */
+		if (conf->cache)
+			SSL_new_session_ticket(conn->ssl);
+	}
+out:
+	attest_ctx_data_cleanup(d_ctx);
+	attest_ctx_verifier_cleanup(v_ctx);
+	return rc == 1;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct tls_server_conf *conf = arg;
+	const char reply[] = "test\n";
+	struct tls_conn *conn;
+	int verified;
+
+	while (1) {
+		conn = queue_pop();
+
+		verified = (SSL_get_verify_result(conn->ssl) == X509_V_OK);
+		if (verified && conf->verify_skae)
+			verified = conn_verify(conf, conn);
+
+		if (verified) {
+			printf("good client cert\n");
+			SSL_write(conn->ssl, reply, strlen(reply));
+		} else {
+			ERR_print_errors_fp(stderr);
+			printf("bad client cert\n");
+		}
+
+		conn_free(conn);
+	}
+
+	return NULL;
+}
+
+static int ticket_gen(SSL *ssl, void *arg)
+{
+	struct tls_conn *conn = SSL_get_app_data(ssl);
+	unsigned char verified = conn && conn->verified;
+
+	if (!SSL_SESSION_set1_ticket_appdata(SSL_get_session(ssl), &verified,
+					     sizeof(verified)))
+		return 0;
+
+	return 1;
+}
+
+static SSL_TICKET_RETURN ticket_dec(SSL *ssl, SSL_SESSION *session,
+				    const unsigned char *keyname,
+				    size_t keyname_len,
+				    SSL_TICKET_STATUS status, void *arg)
+{
+	unsigned char *verified;
+	size_t verified_len;
+
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		break;
+	case SSL_TICKET_EMPTY:
+	case SSL_TICKET_NO_DECRYPT:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	default:
+		return SSL_TICKET_RETURN_ABORT;
+	}
+
+	/* tickets issued before the SKAE verification require a handshake */
+	if (!SSL_SESSION_get0_ticket_appdata(session, (void **)&verified,
+					     &verified_len) ||
+	    verified_len != sizeof(*verified) || !*verified)
+		return SSL_TICKET_RETURN_IGNORE;
+
+	return SSL_TICKET_RETURN_USE;
+}
+
+/* epoll tags of the listening socket and of the signal fd */
+static int listen_tag, signal_tag;
+
+static void conn_close(struct tls_conn *conn)
+{
+	blob_put(conn->blob);
+	conn_free(conn);
+}
+
+static int event_loop(struct tls_server_conf *conf, int sock,
+		      sigset_t *sigset)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct signalfd_siginfo siginfo;
+	struct tls_conn *conn;
+	int epfd, sigfd = -1, client, n, i, rc;
+
+	rc = conn_set_nonblock(sock, 1);
+	if (rc < 0)
+		return rc;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		return -errno;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		rc = -errno;
+		goto out;
+	}
+
+	sigfd = signalfd(-1, sigset, SFD_NONBLOCK);
+	if (sigfd < 0) {
+		rc = -errno;
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &signal_tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+		rc = -errno;
+		goto out;
+	}
+
+	while (1) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			rc = -errno;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+
+			if (events[i].data.ptr == &signal_tag) {
+				while (read(sigfd, &siginfo,
+					    sizeof(siginfo)) == sizeof(siginfo))
+					;
+
+				printf("Reloading attestation data\n");
+				blob_reload(conf, conf->attest_data_path);
+				policy_reload(conf);
+				continue;
+			}
+
+			if (events[i].data.ptr == &listen_tag) {
+				client = accept4(sock, NULL, NULL,
+						 SOCK_NONBLOCK);
+				if (client < 0 && (errno == EAGAIN ||
+						   errno == EINTR ||
+						   errno == ECONNABORTED))
+					continue;
+
+				if (client < 0) {
+					rc = -errno;
+					perror("Unable to accept");
+					goto out;
+				}
+
+				conn = calloc(1, sizeof(*conn));
+				if (!conn) {
+					close(client);
+					continue;
+				}
+
+				conn->fd = client;
+				conn->state = CONN_READ_LEN;
+
+				ev.events = EPOLLIN;
+				ev.data.ptr = conn;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, client,
+					      &ev) < 0) {
+					conn_close(conn);
+					continue;
+				}
+			}
+
+			rc = conn_process(conf, conn);
+			if (rc > 0) {
+				ev.events = rc;
+				ev.data.ptr = conn;
+				if (!epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd,
+					       &ev))
+					continue;
+			}
+
+			epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+			if (!rc && !conn_set_nonblock(conn->fd, 0)) {
+				queue_push(conn);
+				continue;
+			}
+
+			conn_close(conn);
+		}
+	}
+out:
+	if (sigfd >= 0)
+		close(sigfd);
+
+	close(epfd);
+	return rc;
+}
+
 int main(int argc, char **argv)
 {
-	SSL_CTX *ctx;
+	struct tls_server_conf conf = { 0 };
+	pthread_t workers[MAX_WORKERS];
+	sigset_t sigset;
 	char *key_path = NULL, *cert_path = NULL, *ca_path = NULL;
-	char *attest_data_path = NULL, *req_path = NULL;
-	char *pcr_list_str = NULL, *logs;
-	unsigned char *client_attest_data, *server_attest_data;
-	size_t file_size, data_size;
-	int sock, option_index, c;
-	int rc = -EINVAL, engine = 0, verify_skae = 0, verbose = 0;
+	int sock, option_index, c, i;
+	int rc = -EINVAL, engine = 0, num_workers;
+	int cache_ttl = 0, cache_size = CACHE_DEFAULT_SIZE;
 
 	setvbuf(stdout, NULL, _IONBF, 1);
 
+	/* a client going away must not terminate the other connections */
+	signal(SIGPIPE, SIG_IGN);
+
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_workers < 1)
+		num_workers = 1;
+
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "k:c:d:a:ep:r:SVhv", long_options,
-				&option_index);
+		c = getopt_long(argc, argv, "k:c:d:a:ep:r:St:T:C:Vhv",
+				long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -130,22 +817,31 @@ int main(int argc, char **argv)
 				ca_path = optarg;
 				break;
 			case 'a':
-				attest_data_path = optarg;
+				conf.attest_data_path = optarg;
 				break;
 			case 'e':
 				engine = 1;
 				break;
 			case 'p':
-				pcr_list_str = optarg;
+				conf.pcr_list_str = optarg;
 				break;
 			case 'r':
-				req_path = optarg;
+				conf.req_path = optarg;
 				break;
 			case 'S':
-				verify_skae = 1;
+				conf.verify_skae = 1;
+				break;
+			case 't':
+				num_workers = atoi(optarg);
+				break;
+			case 'T':
+				cache_ttl = atoi(optarg);
+				break;
+			case 'C':
+				cache_size = atoi(optarg);
 				break;
 			case 'V':
-				verbose = 1;
+				conf.verbose = 1;
 				break;
 			case 'h':
 				usage(argv[0]);
@@ -169,142 +865,107 @@ int main(int argc, char **argv)
 		return -EINVAL;
 	}
 
-	if (verify_skae && !req_path) {
+	if (conf.verify_skae && !conf.req_path) {
 		printf("Missing requirements\n");
 		return -EINVAL;
 	}
 
+	if (num_workers < 1 || num_workers > MAX_WORKERS) {
+		printf("Invalid number of threads\n");
+		return -EINVAL;
+	}
+
+	if (conf.verify_skae && cache_ttl > 0) {
+		rc = skae_cache_init(&conf.cache, cache_size, cache_ttl);
+		if (rc < 0) {
+			printf("Cannot create the SKAE cache\n");
+			return rc;
+		}
+	}
+
 	init_openssl();
 
-	ctx = create_context(CONTEXT_SERVER);
-	if (!ctx)
+	conf.ctx = create_context(CONTEXT_SERVER);
+	if (!conf.ctx)
 		goto cleanup;
 
-	rc = SSL_CTX_set_max_early_data(ctx, BUFLEN);
+	rc = SSL_CTX_set_max_early_data(conf.ctx, BUFLEN);
 	if (rc <= 0) {
 		ERR_print_errors_fp(stderr);
 		goto cleanup;
 	}
 
-	rc = configure_context(ctx, engine, verify_skae, key_path, cert_path,
+	/* SKAE is verified by the workers, after the handshake */
+	rc = configure_context(conf.ctx, engine, 0, key_path, cert_path,
 			       ca_path);
 	if (rc < 0)
 		goto free;
 
-	sock = create_socket();
-
-	while(1) {
-		struct sockaddr_in addr;
-		uint len = sizeof(addr);
-		SSL *ssl;
-		const char reply[] = "test\n";
-
-		int client = accept(sock, (struct sockaddr*)&addr, &len);
-		if (client < 0) {
-			perror("Unable to accept");
-			goto close;
-		}
-
-		attest_ctx_data_init(NULL);
-		attest_ctx_verifier_init(NULL);
-
-		client_attest_data = NULL;
-		server_attest_data = NULL;
-
-		rc = attest_util_read_buf(client, (unsigned char *)&data_size,
-					  sizeof(data_size));
-		if (rc < 0)
-			goto error;
-
-		data_size = ntohl(data_size);
-		if (data_size) {
-			client_attest_data = malloc(data_size);
-			if (!client_attest_data) {
-				rc = -ENOMEM;
-				goto error;
-			}
-
-			rc = attest_util_read_buf(client, client_attest_data,
-						  data_size);
-			if (rc < 0)
-				goto error;
-
-			if (verify_skae) {
-				rc = configure_attest(client, data_size,
-						      client_attest_data,
-						      pcr_list_str, req_path);
-				if (rc < 0)
-					goto error;
-			}
-		}
-
-		data_size = 0;
-
-		if (attest_data_path) {
-			rc = attest_util_read_file(attest_data_path, &file_size,
-						   &server_attest_data);
-			if (!rc)
-				data_size = file_size;
-		}
-
-		data_size = htonl(data_size);
-
-		rc = attest_util_write_buf(client, (unsigned char *)&data_size,
-					   sizeof(data_size));
-		if (rc < 0)
-			goto error;
-
-		if (data_size) {
-			rc = attest_util_write_buf(client, server_attest_data,
-						   file_size);
-			if (rc < 0)
-				goto error;
-		}
+	if (conf.verify_skae)
+		SSL_CTX_set_verify(conf.ctx, SSL_VERIFY_PEER |
+				   SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+	/*
+	 * A resumed session skips the SKAE verification. Issue tickets only if
+	 * verification results can be cached, after the verification succeeded,
+	 * and make them expire with the cached results.
+	 */
+	if (conf.verify_skae) {
+		/* early data would require stateful tickets */
+		SSL_CTX_set_max_early_data(conf.ctx, 0);
+		SSL_CTX_set_num_tickets(conf.ctx, 0);
+		SSL_CTX_set_session_cache_mode(conf.ctx, SSL_SESS_CACHE_OFF);
+
+		if (!conf.cache)
+			SSL_CTX_set_options(conf.ctx, SSL_OP_NO_TICKET);
+		else
+			SSL_CTX_set_timeout(conf.ctx, cache_ttl);
+
+		SSL_CTX_set_session_ticket_cb(conf.ctx, ticket_gen, ticket_dec,
+					      NULL);
+	}
 
-		ssl = SSL_new(ctx);
-		SSL_set_fd(ssl, client);
+	conf.blob = blob_load(conf.attest_data_path);
+	if (!conf.blob) {
+		rc = -ENOENT;
+		goto free;
+	}
 
-		rc = SSL_accept(ssl);
+	rc = policy_reload(&conf);
+	if (rc < 0)
+		goto free;
 
-		if (verify_skae && verbose) {
-			logs = attest_ctx_verifier_result_print_json(
-					attest_ctx_verifier_get_global());
-			printf("%s\n", logs);
-			free(logs);
-		}
+	/* SIGHUP is received by the handshake thread, through a signal fd */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-		if (rc <= 0) {
-			ERR_print_errors_fp(stderr);
-			rc = -EIO;
-			goto error_ssl;
-		}
+	sock = create_socket();
+	if (sock < 0) {
+		rc = -EIO;
+		goto free;
+	}
 
-		if (SSL_get_verify_result(ssl) == X509_V_OK) {
-			printf("good client cert\n");
-			SSL_write(ssl, reply, strlen(reply));
-		} else {
-			ERR_print_errors_fp(stderr);
-			printf("bad client cert\n");
+	for (i = 0; i < num_workers; i++) {
+		rc = pthread_create(&workers[i], NULL, worker_thread, &conf);
+		if (rc) {
+			printf("Cannot create worker thread\n");
+			rc = -rc;
+			goto close;
 		}
-error_ssl:
-		SSL_shutdown(ssl);
-		SSL_free(ssl);
-error:
-		close(client);
-		free(client_attest_data);
 
-		if (server_attest_data)
-			munmap(server_attest_data, file_size);
-
-		attest_ctx_data_cleanup(NULL);
-		attest_ctx_verifier_cleanup(NULL);
+		pthread_detach(workers[i]);
 	}
+
+	rc = event_loop(&conf, sock, &sigset);
 close:
 	close(sock);
 free:
-	SSL_CTX_free(ctx);
+	blob_put(conf.blob);
+	SSL_CTX_free(conf.ctx);
 cleanup:
 	cleanup_openssl();
+	skae_cache_cleanup(conf.cache);
 
 	return rc;
 }
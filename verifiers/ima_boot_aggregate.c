@@ -39,6 +39,12 @@ int verify(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx)
 
 	log = attest_ctx_verifier_add_log(v_ctx, "verify IMA boot aggregate");
 
+	/* the boot aggregate was verified with the first part of the log */
+	if (v_ctx->flags & CTX_IMA_DELTA) {
+		rc = 0;
+		goto out;
+	}
+
 	ima_log = attest_event_log_get(v_ctx, "ima");
 	check_goto(!ima_log, -ENOENT, out, v_ctx,
 		   "IMA event log not provided");
@@ -63,20 +69,19 @@ int verify(attest_ctx_data *d_ctx, attest_ctx_verifier *v_ctx)
 			goto out;
 
 		rc = TSS_Array_Marshal((uint8_t *)&pcr->digest,
-				       TSS_GetDigestSize(digest.hashAlg),
+				       attest_pcr_digest_size(digest.hashAlg),
 				       &written, &buffer_ptr, &size);
 		check_goto(rc, -EINVAL, out, v_ctx,
 			   "TSS_Array_Marshal() error: %d", rc);
 	}
 
-	rc = TSS_Hash_Generate(&digest, written, buffer, 0, NULL);
-	check_goto(rc, -EINVAL, out, v_ctx,
-		   "TSS_Hash_Generate() error: %d", rc);
+	rc = attest_pcr_hash(&digest, written, buffer, 0, NULL);
+	check_goto(rc, rc, out, v_ctx, "attest_pcr_hash() error: %d", rc);
 
 	boot_aggregate_entry->flags |= LOG_ENTRY_PROCESSED;
 
 	rc = memcmp((uint8_t *)&digest.digest, digest_ptr,
-		    TSS_GetDigestSize(digest.hashAlg));
+		    attest_pcr_digest_size(digest.hashAlg));
 	check_goto(rc, rc, out, v_ctx, "calculated digest != provided digest");
 out:
 	attest_ctx_verifier_end_log(v_ctx, log, rc);